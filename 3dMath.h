@@ -1,4 +1,9 @@
 #include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MATH_SSE2
+#include <emmintrin.h>
+#endif
 //=====================================================================
 // 数学库：此部分应该不用详解，熟悉 D3D 矩阵变换即可
 //=====================================================================
@@ -217,14 +222,19 @@ void matrix_set_lookat(matrix_t *m, const vector_t *eye, const vector_t *at, con
     m->m[3][3] = 1.0f;
 }
 
-// D3DXMatrixPerspectiveFovLH
+// D3DXMatrixPerspectiveFovLH，zf <= 0 时为无限远平面（zf 趋于无穷的极限）
 void matrix_set_perspective(matrix_t *m, float fovy, float aspect, float zn, float zf) {
     float fax = 1.0f / (float)tan(fovy * 0.5f);
     matrix_set_zero(m);
     m->m[0][0] = (float)(fax / aspect);
     m->m[1][1] = (float)(fax);
-    m->m[2][2] = zf / (zf - zn);
-    m->m[3][2] = - zn * zf / (zf - zn);
+    if (zf > 0.0f) {
+        m->m[2][2] = zf / (zf - zn);
+        m->m[3][2] = - zn * zf / (zf - zn);
+    }   else {
+        m->m[2][2] = 1.0f;
+        m->m[3][2] = - zn;
+    }
     m->m[2][3] = 1;
 }
 
@@ -286,6 +296,98 @@ void transform_homogenize(const transform_t *ts, vector_t *y, const vector_t *x)
     y->w = 1.0f;
 }
 
+// 顶点流：structure-of-arrays 形式保存的 n 个矢量，x[i] y[i] z[i] w[i] 为第 i 个
+typedef struct { float *x, *y, *z, *w; } vector_stream_t;
+
+void vector_stream_get(const vector_stream_t *s, int i, vector_t *v) {
+    v->x = s->x[i];
+    v->y = s->y[i];
+    v->z = s->z[i];
+    v->w = s->w[i];
+}
+
+void vector_stream_set(const vector_stream_t *s, int i, const vector_t *v) {
+    s->x[i] = v->x;
+    s->y[i] = v->y;
+    s->z[i] = v->z;
+    s->w[i] = v->w;
+}
+
+#ifdef MATH_SSE2
+// 4 个矢量的 x, y, z, w 分量各占一个寄存器，乘以矩阵 m 的第 j 列，
+// 累加顺序与 matrix_apply 相同，因此结果逐位一致
+#define MATH_SSE_COLUMN(m, X, Y, Z, W, j) \
+    _mm_add_ps(_mm_add_ps(_mm_add_ps( \
+        _mm_mul_ps(X, _mm_set1_ps((m)->m[0][j])), _mm_mul_ps(Y, _mm_set1_ps((m)->m[1][j]))), \
+        _mm_mul_ps(Z, _mm_set1_ps((m)->m[2][j]))), _mm_mul_ps(W, _mm_set1_ps((m)->m[3][j])))
+#endif
+
+// 批量变换：out[i] = in[i] * m，in 和 out 可以是同一个流
+void matrix_apply_stream(const matrix_t *m, const vector_stream_t *in, 
+    const vector_stream_t *out, int count) {
+    vector_t x, y;
+    int i = 0;
+#ifdef MATH_SSE2
+    for (; i + 4 <= count; i += 4) {
+        __m128 X = _mm_loadu_ps(in->x + i), Y = _mm_loadu_ps(in->y + i);
+        __m128 Z = _mm_loadu_ps(in->z + i), W = _mm_loadu_ps(in->w + i);
+        _mm_storeu_ps(out->x + i, MATH_SSE_COLUMN(m, X, Y, Z, W, 0));
+        _mm_storeu_ps(out->y + i, MATH_SSE_COLUMN(m, X, Y, Z, W, 1));
+        _mm_storeu_ps(out->z + i, MATH_SSE_COLUMN(m, X, Y, Z, W, 2));
+        _mm_storeu_ps(out->w + i, MATH_SSE_COLUMN(m, X, Y, Z, W, 3));
+    }
+#endif
+    for (; i < count; i++) {
+        vector_stream_get(in, i, &x);
+        matrix_apply(&y, &x, m);
+        vector_stream_set(out, i, &y);
+    }
+}
+
+// 批量投影：一趟完成 transform_apply、transform_check_cvv 和 transform_homogenize。
+// out 的 x, y, z 为屏幕坐标和深度，w 保留裁剪空间的 w；cvv[i] 为第 i 个点的检查结果
+void transform_apply_stream(const transform_t *ts, const vector_stream_t *in, 
+    const vector_stream_t *out, int *cvv, int count) {
+    vector_t x, c, y;
+    int i = 0;
+#ifdef MATH_SSE2
+    const matrix_t *m = &ts->transform;
+    __m128 one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f), zero = _mm_setzero_ps();
+    __m128 sw = _mm_set1_ps(ts->w), sh = _mm_set1_ps(ts->h);
+    for (; i + 4 <= count; i += 4) {
+        __m128 X = _mm_loadu_ps(in->x + i), Y = _mm_loadu_ps(in->y + i);
+        __m128 Z = _mm_loadu_ps(in->z + i), W = _mm_loadu_ps(in->w + i);
+        __m128 cx = MATH_SSE_COLUMN(m, X, Y, Z, W, 0);
+        __m128 cy = MATH_SSE_COLUMN(m, X, Y, Z, W, 1);
+        __m128 cz = MATH_SSE_COLUMN(m, X, Y, Z, W, 2);
+        __m128 cw = MATH_SSE_COLUMN(m, X, Y, Z, W, 3);
+        __m128 nw = _mm_sub_ps(zero, cw), rhw;
+        __m128i check;
+        // 每个比较得到全 1 的掩码，与对应的位相与后合并
+        check = _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(cz, zero)), _mm_set1_epi32(1));
+        check = _mm_or_si128(check, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(cz, cw)), _mm_set1_epi32(2)));
+        check = _mm_or_si128(check, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(cx, nw)), _mm_set1_epi32(4)));
+        check = _mm_or_si128(check, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(cx, cw)), _mm_set1_epi32(8)));
+        check = _mm_or_si128(check, _mm_and_si128(_mm_castps_si128(_mm_cmplt_ps(cy, nw)), _mm_set1_epi32(16)));
+        check = _mm_or_si128(check, _mm_and_si128(_mm_castps_si128(_mm_cmpgt_ps(cy, cw)), _mm_set1_epi32(32)));
+        _mm_storeu_si128((__m128i*)(cvv + i), check);
+        rhw = _mm_div_ps(one, cw);
+        _mm_storeu_ps(out->x + i, _mm_mul_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(cx, rhw), one), sw), half));
+        _mm_storeu_ps(out->y + i, _mm_mul_ps(_mm_mul_ps(_mm_sub_ps(one, _mm_mul_ps(cy, rhw)), sh), half));
+        _mm_storeu_ps(out->z + i, _mm_mul_ps(cz, rhw));
+        _mm_storeu_ps(out->w + i, cw);
+    }
+#endif
+    for (; i < count; i++) {
+        vector_stream_get(in, i, &x);
+        transform_apply(ts, &c, &x);
+        cvv[i] = transform_check_cvv(&c);
+        transform_homogenize(ts, &y, &c);
+        y.w = c.w;
+        vector_stream_set(out, i, &y);
+    }
+}
+
 
 //=====================================================================
 // 几何计算：顶点、扫描线、边缘、矩形、步长计算
@@ -294,8 +396,10 @@ typedef struct { float r, g, b; } color_t;
 typedef struct { float u, v; } texcoord_t;
 typedef struct { point_t pos; texcoord_t tc; color_t color; float rhw; float light; } vertex_t;
 
-typedef struct { vertex_t v, v1, v2; } edge_t;
-typedef struct { float top, bottom; edge_t left, right; } trapezoid_t;
+// 28.4 定点（1/16 像素）的边 (x1, y1) - (x2, y2)，y1 < y2
+typedef struct { int x1, y1, x2, y2; } edge_t;
+// 梯形覆盖像素中心 y + 0.5 落在 [top, bottom)（28.4 定点）之内的行
+typedef struct { int top, bottom; edge_t left, right; } trapezoid_t;
 typedef struct { vertex_t v, step; int x, y, w; } scanline_t;
 
 
@@ -346,4 +450,27 @@ void vertex_add(vertex_t *y, const vertex_t *x) {
     y->color.r += x->color.r;
     y->color.g += x->color.g;
     y->color.b += x->color.b;
-}
\ No newline at end of file
+}
+
+
+//=====================================================================
+// 网格文件：顶点、法向量、索引三段按照内存中 vertex_t / vector_t / int
+// 的布局直接存放，映射到内存后即可交给绘制函数，不需要逐顶点解析或复制
+//=====================================================================
+#define MESH_MAGIC                  0x4d44334d  // "M3DM"，字节序不同时不匹配
+#define MESH_VERSION                1
+#define MESH_ALIGN                  64          // 各段在文件中的起始偏移按缓存行对齐
+
+typedef struct {
+    unsigned int magic;             // MESH_MAGIC
+    unsigned int version;           // MESH_VERSION
+    unsigned int vertex_size;       // sizeof(vertex_t)，与当前编译的布局不同时拒绝加载
+    unsigned int normal_size;       // sizeof(vector_t)
+    unsigned int vertex_count;      // 顶点数，法向量与顶点一一对应
+    unsigned int index_count;       // 索引数，每 3 个组成一个三角形
+    unsigned long long vertex_offset;   // 各段相对文件开头的偏移
+    unsigned long long normal_offset;
+    unsigned long long index_offset;
+    unsigned long long file_size;   // 整个文件的长度，用于发现被截断的文件
+    point_t bound_min, bound_max;   // 顶点的包围盒
+}   mesh_header_t;
@@ -2,479 +2,4782 @@
 // build:
 //   mingw: gcc -O3 mini3d.c -o mini3d.exe -lgdi32
 //   msvc:  cl -O2 -nologo mini3d.c 
+//   bench: gcc -O3 -DMINI3D_BENCH mini3d.c -o mini3d_bench -lm -pthread
+//          （非 Windows 平台总是编译为无窗口的 benchmark 程序）
 //=====================================================================
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "3dMath.h"
 #include <assert.h>
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MINI3D_SSE2
+#include <emmintrin.h>
+#endif
+
+// x86 上额外编译 SSE4.1 / AVX2 的内核，运行时根据 cpuid 选择
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define MINI3D_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define TARGET_SSE41
+#define TARGET_AVX2
+#else
+#define TARGET_SSE41 __attribute__((target("sse4.1")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+#ifdef _WIN32
+#ifndef _WIN32_WINNT
+#define _WIN32_WINNT 0x0600     // 条件变量需要 Vista 以上的 API
+#endif
 #include <windows.h>
 #include <tchar.h>
+#else
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <signal.h>
+#ifndef MINI3D_BENCH
+#define MINI3D_BENCH
+#endif
+#endif
 
 typedef unsigned int IUINT32;
+typedef unsigned short IUINT16;
+typedef unsigned long long IUINT64;
+
+#ifdef _MSC_VER
+#define FORCE_INLINE static __forceinline
+#else
+#define FORCE_INLINE static __inline__ __attribute__((always_inline))
+#endif
 
 #define RENDER_STATE_WIREFRAME      1       // 渲染线框
 #define RENDER_STATE_TEXTURE        2       // 渲染纹理
 #define RENDER_STATE_COLOR          4       // 渲染颜色
 
+#define RASTERIZER_TRAPEZOID        0       // 拆分梯形逐行扫描
+#define RASTERIZER_HALFSPACE        1       // 边函数按 8x8 块遍历
+
+#define TILE_CLEAN                  0       // 8x8 深度块：最小 rhw 有效
+#define TILE_DIRTY                  1       // 8x8 深度块：写入过深度，最小 rhw 需要重新计算
+#define TILE_STALE                  2       // 8x8 深度块：device_clear 之后尚未清零
+
+#define DEPTH_FLOAT32               0       // 深度缓存：32 位浮点的 rhw，即无限远平面的反向 Z
+#define DEPTH_UNORM16               1       // 深度缓存：16 位整数，rhw * NEAR_PLANE 映射到 [0, 65535]
+
+#define GUARD_BAND                  4.0f    // 保护带：裁剪空间 |x|, |y| <= GUARD_BAND * w 时不做 x/y 裁剪
+
 int REMOVE_BACKFACE = 1;      				// 背面消除
 
-// 根据三角形生成 0-2 个梯形，并且返回合法梯形的数量
+// 屏幕坐标取整到 28.4 定点：光栅化只使用取整后的顶点，共享的边在相邻三角形中完全相同
+int fixed_snap(float x) {
+    float f = x * 16.0f + 0.5f;
+    int i = (int)f;
+    return (i > f)? i - 1 : i;
+}
+
+// 向下取整的整数除法，b > 0
+FORCE_INLINE long long floor_div(long long a, long long b) {
+    long long q = a / b;
+    return (q * b > a)? q - 1 : q;
+}
+
+// 根据三角形生成 0-2 个梯形，并且返回合法梯形的数量，不经过任何像素中心所在行的梯形不算合法。
+// 顶点取整到 28.4 定点后按 y 排序，长边 p1-p3 在两个梯形中共用；
+// 中间顶点在长边左侧时短边为左边，否则为右边。面积用整数计算，没有舍入
 int trapezoid_init_triangle(trapezoid_t *trap, const vertex_t *p1, 
     const vertex_t *p2, const vertex_t *p3) {
     const vertex_t *p;
-    float k, x;
+    int x1, y1, x2, y2, x3, y3, n = 0;
+    long long area;
+    edge_t e12, e13, e23;
 
+    // 取整不改变 y 的先后，可以先按浮点坐标排序
     if (p1->pos.y > p2->pos.y) p = p1, p1 = p2, p2 = p;
     if (p1->pos.y > p3->pos.y) p = p1, p1 = p3, p3 = p;
     if (p2->pos.y > p3->pos.y) p = p2, p2 = p3, p3 = p;
-    if (p1->pos.y == p2->pos.y && p1->pos.y == p3->pos.y) return 0;
-    if (p1->pos.x == p2->pos.x && p1->pos.x == p3->pos.x) return 0;
-
-    if (p1->pos.y == p2->pos.y) {   // triangle down
-        if (p1->pos.x > p2->pos.x) p = p1, p1 = p2, p2 = p;
-        trap[0].top = p1->pos.y;
-        trap[0].bottom = p3->pos.y;
-        trap[0].left.v1 = *p1;
-        trap[0].left.v2 = *p3;
-        trap[0].right.v1 = *p2;
-        trap[0].right.v2 = *p3;
-        return (trap[0].top < trap[0].bottom)? 1 : 0;
-    }
-
-    if (p2->pos.y == p3->pos.y) {   // triangle up
-        if (p2->pos.x > p3->pos.x) p = p2, p2 = p3, p3 = p;
-        trap[0].top = p1->pos.y;
-        trap[0].bottom = p3->pos.y;
-        trap[0].left.v1 = *p1;
-        trap[0].left.v2 = *p2;
-        trap[0].right.v1 = *p1;
-        trap[0].right.v2 = *p3;
-        return (trap[0].top < trap[0].bottom)? 1 : 0;
-    }
-
-    trap[0].top = p1->pos.y;
-    trap[0].bottom = p2->pos.y;
-    trap[1].top = p2->pos.y;
-    trap[1].bottom = p3->pos.y;
-
-    k = (p3->pos.y - p1->pos.y) / (p2->pos.y - p1->pos.y);
-    x = p1->pos.x + (p2->pos.x - p1->pos.x) * k;
-
-    if (x <= p3->pos.x) {       // triangle left
-        trap[0].left.v1 = *p1;
-        trap[0].left.v2 = *p2;
-        trap[0].right.v1 = *p1;
-        trap[0].right.v2 = *p3;
-        trap[1].left.v1 = *p2;
-        trap[1].left.v2 = *p3;
-        trap[1].right.v1 = *p1;
-        trap[1].right.v2 = *p3;
-    }   else {                  // triangle right
-        trap[0].left.v1 = *p1;
-        trap[0].left.v2 = *p3;
-        trap[0].right.v1 = *p1;
-        trap[0].right.v2 = *p2;
-        trap[1].left.v1 = *p1;
-        trap[1].left.v2 = *p3;
-        trap[1].right.v1 = *p2;
-        trap[1].right.v2 = *p3;
-    }
-
-    return 2;
-}
-
-// 按照 Y 坐标计算出左右两条边纵坐标等于 Y 的顶点
-void trapezoid_edge_interp(trapezoid_t *trap, float y) {
-    float s1 = trap->left.v2.pos.y - trap->left.v1.pos.y;
-    float s2 = trap->right.v2.pos.y - trap->right.v1.pos.y;
-    float t1 = (y - trap->left.v1.pos.y) / s1;
-    float t2 = (y - trap->right.v1.pos.y) / s2;
-    vertex_interp(&trap->left.v, &trap->left.v1, &trap->left.v2, t1);
-    vertex_interp(&trap->right.v, &trap->right.v1, &trap->right.v2, t2);
-}
-
-// 根据左右两边的端点，初始化计算出扫描线的起点和步长
-void trapezoid_init_scan_line(const trapezoid_t *trap, scanline_t *scanline, int y) {
-    float width = trap->right.v.pos.x - trap->left.v.pos.x;
-    scanline->x = (int)(trap->left.v.pos.x + 0.5f);
-    scanline->w = (int)(trap->right.v.pos.x + 0.5f) - scanline->x;
+    y1 = fixed_snap(p1->pos.y);
+    y2 = fixed_snap(p2->pos.y);
+    y3 = fixed_snap(p3->pos.y);
+    if (((y1 + 7) >> 4) >= ((y3 + 7) >> 4)) return 0;
+    x1 = fixed_snap(p1->pos.x);
+    x2 = fixed_snap(p2->pos.x);
+    x3 = fixed_snap(p3->pos.x);
+
+    area = (long long)(x2 - x1) * (y3 - y1) - (long long)(y2 - y1) * (x3 - x1);
+    if (area == 0) return 0;
+
+    e12.x1 = x1, e12.y1 = y1, e12.x2 = x2, e12.y2 = y2;
+    e13.x1 = x1, e13.y1 = y1, e13.x2 = x3, e13.y2 = y3;
+    e23.x1 = x2, e23.y1 = y2, e23.x2 = x3, e23.y2 = y3;
+
+    if (((y1 + 7) >> 4) < ((y2 + 7) >> 4)) {    // 上半部分
+        trap[n].top = y1;
+        trap[n].bottom = y2;
+        trap[n].left = (area < 0)? e12 : e13;
+        trap[n].right = (area < 0)? e13 : e12;
+        n++;
+    }
+    if (((y2 + 7) >> 4) < ((y3 + 7) >> 4)) {    // 下半部分
+        trap[n].top = y2;
+        trap[n].bottom = y3;
+        trap[n].left = (area < 0)? e23 : e13;
+        trap[n].right = (area < 0)? e13 : e23;
+        n++;
+    }
+
+    return n;
+}
+
+// 边在第 y 行的整数步进状态。x 为像素中心落在边上或边右侧的第一列：
+// 设 X 为边在像素中心 y + 0.5 处的 28.4 横坐标，则 x = ceil((X - 8) / 16)。
+// 左边取 [x, ...)、右边取 [..., x)，恰好落在边上的像素只归左边所有（top-left 规则），
+// 共享一条边的两个三角形对同一行算出相同的 x，每个像素只被覆盖一次
+typedef struct { 
+    int x;          // 当前行的列
+    int r;          // 余数，[0, den)
+    int step;       // 每行 x 的整数增量
+    int rstep;      // 每行余数的增量，[0, den)
+    int den;        // 16 * (y2 - y1)
+}   edge_step_t;
+
+void edge_step_init(edge_step_t *s, const edge_t *e, int y) {
+    long long dx = e->x2 - e->x1, dy = e->y2 - e->y1, den = dy * 16, m, q;
+    // ceil(N / den) = floor((N + den - 1) / den)，N = (x1 - 8) * dy + (y * 16 + 8 - y1) * dx
+    m = (long long)(e->x1 - 8) * dy + ((long long)y * 16 + 8 - e->y1) * dx + den - 1;
+    q = floor_div(m, den);
+    s->x = (int)q;
+    s->r = (int)(m - q * den);
+    q = floor_div(dx * 16, den);
+    s->step = (int)q;
+    s->rstep = (int)(dx * 16 - q * den);
+    s->den = (int)den;
+}
+
+// 步进到下一行，只有整数加法
+FORCE_INLINE void edge_step_next(edge_step_t *s) {
+    s->x += s->step;
+    s->r += s->rstep;
+    if (s->r >= s->den) {
+        s->r -= s->den;
+        s->x++;
+    }
+}
+
+// 屏幕上的矩形区域 [x0, x1) x [y0, y1)，用于把绘制限制在屏幕或者某个 tile 内
+typedef struct { int x0, y0, x1, y1; } rect_t;
+
+// 屏幕空间的线性平面：attr(x, y) = c + dx * x + dy * y
+typedef struct { float c, dx, dy; } plane_t;
+
+// 边函数光栅化的三角形：三条边 E(x, y) = a * x + b * y + c，内部三者都 >= 0，
+// 属性（已乘过 rhw）在屏幕空间线性插值，以像素中心 (x + 0.5, y + 0.5) 采样
+typedef struct {
+    float a[3], b[3], c[3];     // 三条边函数的系数
+    int topleft[3];             // 是否为上边或左边：恰好落在边上的像素只归上/左边所有
+    rect_t bound;               // 覆盖像素的包围盒
+    plane_t rhw, u, v, red, green, blue, light;
+}   halfspace_t;
+
+// 由三个顶点计算属性平面，inv_area 为两倍面积的倒数
+void plane_init(plane_t *p, const vertex_t *v1, const vertex_t *v2, const vertex_t *v3,
+    float a1, float a2, float a3, float inv_area) {
+    float dx1 = v2->pos.x - v1->pos.x, dy1 = v2->pos.y - v1->pos.y;
+    float dx2 = v3->pos.x - v1->pos.x, dy2 = v3->pos.y - v1->pos.y;
+    p->dx = ((a2 - a1) * dy2 - (a3 - a1) * dy1) * inv_area;
+    p->dy = ((a3 - a1) * dx1 - (a2 - a1) * dx2) * inv_area;
+    p->c = a1 - p->dx * v1->pos.x - p->dy * v1->pos.y;
+}
+
+// 初始化边函数三角形，面积为零时返回 0
+int halfspace_init_triangle(halfspace_t *tri, const vertex_t *p1, 
+    const vertex_t *p2, const vertex_t *p3) {
+    const vertex_t *v[3];
+    float area, minx, miny, maxx, maxy;
+    int i;
+    area = (p2->pos.x - p1->pos.x) * (p3->pos.y - p1->pos.y) - 
+           (p2->pos.y - p1->pos.y) * (p3->pos.x - p1->pos.x);
+    if (area == 0.0f) return 0;
+    v[0] = p1;
+    v[1] = (area > 0.0f)? p2 : p3;      // 统一为使内部边函数为正的绕序
+    v[2] = (area > 0.0f)? p3 : p2;
+    if (area < 0.0f) area = -area;
+    for (i = 0; i < 3; i++) {
+        const vertex_t *a = v[i], *b = v[(i + 1) % 3];
+        tri->a[i] = a->pos.y - b->pos.y;
+        tri->b[i] = b->pos.x - a->pos.x;
+        tri->c[i] = a->pos.x * b->pos.y - a->pos.y * b->pos.x;
+        tri->topleft[i] = (tri->a[i] > 0.0f) || (tri->a[i] == 0.0f && tri->b[i] > 0.0f);
+    }
+    minx = maxx = p1->pos.x;
+    miny = maxy = p1->pos.y;
+    for (i = 1; i < 3; i++) {
+        if (v[i]->pos.x < minx) minx = v[i]->pos.x;
+        if (v[i]->pos.x > maxx) maxx = v[i]->pos.x;
+        if (v[i]->pos.y < miny) miny = v[i]->pos.y;
+        if (v[i]->pos.y > maxy) maxy = v[i]->pos.y;
+    }
+    tri->bound.x0 = (int)floor(minx);
+    tri->bound.y0 = (int)floor(miny);
+    tri->bound.x1 = (int)floor(maxx) + 1;
+    tri->bound.y1 = (int)floor(maxy) + 1;
+    area = 1.0f / area;
+    plane_init(&tri->rhw, v[0], v[1], v[2], v[0]->rhw, v[1]->rhw, v[2]->rhw, area);
+    plane_init(&tri->u, v[0], v[1], v[2], v[0]->tc.u, v[1]->tc.u, v[2]->tc.u, area);
+    plane_init(&tri->v, v[0], v[1], v[2], v[0]->tc.v, v[1]->tc.v, v[2]->tc.v, area);
+    plane_init(&tri->red, v[0], v[1], v[2], v[0]->color.r, v[1]->color.r, v[2]->color.r, area);
+    plane_init(&tri->green, v[0], v[1], v[2], v[0]->color.g, v[1]->color.g, v[2]->color.g, area);
+    plane_init(&tri->blue, v[0], v[1], v[2], v[0]->color.b, v[1]->color.b, v[2]->color.b, area);
+    plane_init(&tri->light, v[0], v[1], v[2], v[0]->light, v[1]->light, v[2]->light, area);
+    return 1;
+}
+
+// 初始化第 y 行 [x, x + w) 的扫描线：属性取自三角形的平面，在第一个像素的中心求值，
+// 步长为平面的 dx，与边函数光栅化在同一像素上的插值相同，每行没有除法
+void trapezoid_init_scan_line(const halfspace_t *tri, scanline_t *scanline, int x, int y, int w) {
+    float px = (float)x + 0.5f, py = (float)y + 0.5f;
+    scanline->x = x;
     scanline->y = y;
-    scanline->v = trap->left.v;
-    if (trap->left.v.pos.x >= trap->right.v.pos.x) scanline->w = 0;
-    vertex_division(&scanline->step, &trap->left.v, &trap->right.v, width);
+    scanline->w = w;
+    scanline->v.rhw = tri->rhw.c + tri->rhw.dx * px + tri->rhw.dy * py;
+    scanline->v.tc.u = tri->u.c + tri->u.dx * px + tri->u.dy * py;
+    scanline->v.tc.v = tri->v.c + tri->v.dx * px + tri->v.dy * py;
+    scanline->v.color.r = tri->red.c + tri->red.dx * px + tri->red.dy * py;
+    scanline->v.color.g = tri->green.c + tri->green.dx * px + tri->green.dy * py;
+    scanline->v.color.b = tri->blue.c + tri->blue.dx * px + tri->blue.dy * py;
+    scanline->v.light = tri->light.c + tri->light.dx * px + tri->light.dy * py;
+    scanline->step.rhw = tri->rhw.dx;
+    scanline->step.tc.u = tri->u.dx;
+    scanline->step.tc.v = tri->v.dx;
+    scanline->step.color.r = tri->red.dx;
+    scanline->step.color.g = tri->green.dx;
+    scanline->step.color.b = tri->blue.dx;
+    scanline->step.light = tri->light.dx;
+}
+
+
+//=====================================================================
+// 线程：Win32 / pthread 的最小封装，供分块光栅化的线程池使用
+//=====================================================================
+#ifdef _WIN32
+typedef HANDLE thread_t;
+typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+
+void mutex_init(mutex_t *m) { InitializeCriticalSection(m); }
+void mutex_destroy(mutex_t *m) { DeleteCriticalSection(m); }
+void mutex_lock(mutex_t *m) { EnterCriticalSection(m); }
+void mutex_unlock(mutex_t *m) { LeaveCriticalSection(m); }
+void cond_init(cond_t *c) { InitializeConditionVariable(c); }
+void cond_destroy(cond_t *c) { (void)c; }
+void cond_wait(cond_t *c, mutex_t *m) { SleepConditionVariableCS(c, m, INFINITE); }
+void cond_signal(cond_t *c) { WakeConditionVariable(c); }
+void cond_broadcast(cond_t *c) { WakeAllConditionVariable(c); }
+
+// 原子加一，返回加一之后的值
+int atomic_increment(volatile int *p) { return (int)InterlockedIncrement((volatile LONG*)p); }
+
+int thread_create(thread_t *t, DWORD (WINAPI *entry)(LPVOID), void *arg) {
+    *t = CreateThread(NULL, 0, entry, arg, 0, NULL);
+    return (*t == NULL)? -1 : 0;
+}
+
+void thread_join(thread_t t) {
+    WaitForSingleObject(t, INFINITE);
+    CloseHandle(t);
+}
+
+#define THREAD_PROC(name, arg) DWORD WINAPI name(LPVOID arg)
+#define THREAD_RETURN return 0
+#else
+typedef pthread_t thread_t;
+typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+
+void mutex_init(mutex_t *m) { pthread_mutex_init(m, NULL); }
+void mutex_destroy(mutex_t *m) { pthread_mutex_destroy(m); }
+void mutex_lock(mutex_t *m) { pthread_mutex_lock(m); }
+void mutex_unlock(mutex_t *m) { pthread_mutex_unlock(m); }
+void cond_init(cond_t *c) { pthread_cond_init(c, NULL); }
+void cond_destroy(cond_t *c) { pthread_cond_destroy(c); }
+void cond_wait(cond_t *c, mutex_t *m) { pthread_cond_wait(c, m); }
+void cond_signal(cond_t *c) { pthread_cond_signal(c); }
+void cond_broadcast(cond_t *c) { pthread_cond_broadcast(c); }
+
+// 原子加一，返回加一之后的值
+int atomic_increment(volatile int *p) { return __sync_add_and_fetch(p, 1); }
+
+int thread_create(thread_t *t, void *(*entry)(void*), void *arg) {
+    return (pthread_create(t, NULL, entry, arg) != 0)? -1 : 0;
+}
+
+void thread_join(thread_t t) {
+    pthread_join(t, NULL);
+}
+
+#define THREAD_PROC(name, arg) void *name(void *arg)
+#define THREAD_RETURN return NULL
+#endif
+
+
+//=====================================================================
+// 文件映射：只读地映射整个文件，数据在第一次访问时由缺页载入
+//=====================================================================
+#ifdef _WIN32
+// 映射文件，失败返回 NULL。映射建立之后文件和映射句柄即可关闭
+const void *file_map(const char *filename, size_t *size) {
+    HANDLE file, mapping;
+    LARGE_INTEGER length;
+    const void *ptr = NULL;
+    file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 
+        FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (file == INVALID_HANDLE_VALUE) return NULL;
+    if (GetFileSizeEx(file, &length) && length.QuadPart > 0 && 
+        (unsigned long long)length.QuadPart <= (size_t)-1) {
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping) {
+            ptr = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+        }
+        *size = (size_t)length.QuadPart;
+    }
+    CloseHandle(file);
+    return ptr;
+}
+
+void file_unmap(const void *ptr, size_t size) {
+    (void)size;
+    UnmapViewOfFile(ptr);
+}
+#else
+// 映射文件，失败返回 NULL。提示内核预读整个文件，顺序访问时缺页不必等待磁盘
+const void *file_map(const char *filename, size_t *size) {
+    struct stat st;
+    void *ptr = NULL;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) return NULL;
+    if (fstat(fd, &st) == 0 && st.st_size > 0 && 
+        (unsigned long long)st.st_size <= (size_t)-1) {
+        ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (ptr == MAP_FAILED) ptr = NULL;
+        else posix_madvise(ptr, (size_t)st.st_size, POSIX_MADV_WILLNEED);
+        *size = (size_t)st.st_size;
+    }
+    close(fd);
+    return ptr;
+}
+
+void file_unmap(const void *ptr, size_t size) {
+    munmap((void*)ptr, size);
+}
+#endif
+
+
+//=====================================================================
+// 页分配：帧缓存、深度缓存这类大块缓冲直接向系统按页申请，起点按页对齐，
+// 内容为零。不小于一个大页时尝试使用大页，逐行访问大缓冲时减少 TLB 缺失
+//=====================================================================
+#define PAGES_NORMAL        0       // 普通页
+#define PAGES_TRANSPARENT   1       // 普通页，已请求透明大页，是否合并由内核决定
+#define PAGES_HUGE          2       // 显式分配的大页
+
+#define HUGE_PAGE_SIZE      ((size_t)2 << 20)
+
+int HUGE_PAGES = 1;                 // 是否尝试使用大页
+
+#ifdef _WIN32
+// 分配 *size 字节，*size 返回实际的大小，*pages 返回页的类型，失败返回 NULL。
+// 大页需要锁定内存的权限（SeLockMemoryPrivilege），没有时使用普通页
+void *page_alloc(size_t *size, int *pages) {
+    size_t large = GetLargePageMinimum();
+    void *ptr;
+    *pages = PAGES_NORMAL;
+    if (HUGE_PAGES && large > 0 && *size >= large) {
+        size_t n = (*size + large - 1) & ~(large - 1);
+        ptr = VirtualAlloc(NULL, n, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+        if (ptr) {
+            *size = n;
+            *pages = PAGES_HUGE;
+            return ptr;
+        }
+    }
+    return VirtualAlloc(NULL, *size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
+
+void page_free(void *ptr, size_t size) {
+    (void)size;
+    VirtualFree(ptr, 0, MEM_RELEASE);
+}
+#else
+// 分配 *size 字节，*size 返回实际映射的大小，*pages 返回页的类型，失败返回 NULL。
+// 先用 MAP_HUGETLB（需要系统预留大页），失败时多映射一个大页、截掉首尾使起点按 2MB 对齐，
+// 再用 madvise(MADV_HUGEPAGE) 请求透明大页，这样整个缓冲都可以由大页覆盖
+void *page_alloc(size_t *size, int *pages) {
+    size_t n = (*size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    char *ptr;
+    *pages = PAGES_NORMAL;
+    if (HUGE_PAGES && *size >= HUGE_PAGE_SIZE) {
+#ifdef MAP_HUGETLB
+        ptr = (char*)mmap(NULL, n, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != (char*)MAP_FAILED) {
+            *size = n;
+            *pages = PAGES_HUGE;
+            return ptr;
+        }
+#endif
+#ifdef MADV_HUGEPAGE
+        ptr = (char*)mmap(NULL, n + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, 
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (ptr != (char*)MAP_FAILED) {
+            size_t head = (HUGE_PAGE_SIZE - ((size_t)ptr & (HUGE_PAGE_SIZE - 1))) & (HUGE_PAGE_SIZE - 1);
+            if (head > 0) munmap(ptr, head);
+            munmap(ptr + head + n, HUGE_PAGE_SIZE - head);
+            ptr += head;
+            if (madvise(ptr, n, MADV_HUGEPAGE) == 0) *pages = PAGES_TRANSPARENT;
+            *size = n;
+            return ptr;
+        }
+#endif
+    }
+    ptr = (char*)mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return (ptr == (char*)MAP_FAILED)? NULL : ptr;
+}
+
+void page_free(void *ptr, size_t size) {
+    munmap(ptr, size);
+}
+#endif
+
+
+//=====================================================================
+// CPU 特性检测
+//=====================================================================
+#define SIMD_SCALAR     0
+#define SIMD_SSE41      1
+#define SIMD_AVX2       2
+
+// CPU 支持的最高 SIMD 级别
+int cpu_simd_level(void) {
+#if defined(MINI3D_X86) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] >= 7) {
+        int sse41, osxsave, avx;
+        __cpuid(info, 1);
+        sse41 = (info[2] >> 19) & 1;
+        osxsave = (info[2] >> 27) & 1;
+        avx = (info[2] >> 28) & 1;
+        __cpuidex(info, 7, 0);
+        if (osxsave && avx && ((info[1] >> 5) & 1) && (_xgetbv(0) & 6) == 6) return SIMD_AVX2;
+        if (sse41) return SIMD_SSE41;
+    }
+    return SIMD_SCALAR;
+#elif defined(MINI3D_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+    if (__builtin_cpu_supports("sse4.1")) return SIMD_SSE41;
+    return SIMD_SCALAR;
+#else
+    return SIMD_SCALAR;
+#endif
+}
+
+// 扫描线内核使用的 SIMD 级别：第一次 device_init 时由 cpuid 检测，
+// 之后可以改为较低的级别（SIMD_SCALAR 即标量参考实现）用作对照
+int span_simd = -1;
+
+
+//=====================================================================
+// 光照：环境光加若干平行光 / 点光源的 Phong 模型，逐顶点计算
+//=====================================================================
+#define MAX_LIGHTS                  4
+#define LIGHT_DIRECTIONAL           0       // 平行光
+#define LIGHT_POINT                 1       // 点光源
+
+#define SPECULAR_TABLE_SIZE         1024    // 镜面反射查表的分段数
+
+typedef struct {
+    int type;                   // LIGHT_DIRECTIONAL / LIGHT_POINT
+    vector_t vec;               // 平行光为光线照射的方向，点光源为位置（世界坐标）
+    float intensity;            // 光强
+    float falloff;              // 点光源的衰减：intensity / (1 + falloff * d^2)
+}   light_t;
+
+typedef struct {
+    float ambient;              // 环境光强度
+    float diffuse;              // 漫反射系数
+    float specular;             // 镜面反射系数
+    IUINT32 shininess;          // 反射指数
+    int count;                  // 光源数量
+    light_t lights[MAX_LIGHTS];
+    int table_valid;            // specular_table 是否已经计算（反射指数 0 也是合法值）
+    IUINT32 table_shininess;    // specular_table 对应的反射指数
+    float specular_table[SPECULAR_TABLE_SIZE + 2];  // x^shininess，x 等分 [0, 1]
+}   lighting_t;
+
+// 一次绘制内不变的光照常量，全部位于摄影机坐标系（视点在原点）
+typedef struct {
+    matrix_t normal_transform;  // 法向量变换：world * view
+    int count;
+    int type[MAX_LIGHTS];
+    vector_t vec[MAX_LIGHTS];   // 平行光为指向光源的单位向量，点光源为位置
+    float intensity[MAX_LIGHTS];
+    float falloff[MAX_LIGHTS];
+    float ambient, diffuse, specular;
+    const float *table;         // lighting_t::specular_table
+}   light_setup_t;
+
+void lighting_init(lighting_t *lighting) {
+    lighting->ambient = 0.0f;
+    lighting->diffuse = 1.0f;
+    lighting->specular = 0.0f;
+    lighting->shininess = 1;
+    lighting->count = 0;
+    lighting->table_valid = 0;
+    lighting->table_shininess = 0;
+}
+
+// 添加平行光，(x, y, z) 为光线照射的方向，返回光源编号，已满时返回 -1
+int lighting_add_directional(lighting_t *lighting, float x, float y, float z, float intensity) {
+    light_t *light;
+    if (lighting->count >= MAX_LIGHTS) return -1;
+    light = &lighting->lights[lighting->count];
+    light->type = LIGHT_DIRECTIONAL;
+    light->vec.x = x, light->vec.y = y, light->vec.z = z, light->vec.w = 0.0f;
+    light->intensity = intensity;
+    light->falloff = 0.0f;
+    return lighting->count++;
+}
+
+// 添加位于 (x, y, z) 的点光源，返回光源编号，已满时返回 -1
+int lighting_add_point(lighting_t *lighting, float x, float y, float z, 
+    float intensity, float falloff) {
+    light_t *light;
+    if (lighting->count >= MAX_LIGHTS) return -1;
+    light = &lighting->lights[lighting->count];
+    light->type = LIGHT_POINT;
+    light->vec.x = x, light->vec.y = y, light->vec.z = z, light->vec.w = 1.0f;
+    light->intensity = intensity;
+    light->falloff = falloff;
+    return lighting->count++;
+}
+
+// 反射指数变化时重新计算 x^shininess 的表
+void lighting_update_table(lighting_t *lighting) {
+    int i;
+    if (lighting->table_valid && lighting->table_shininess == lighting->shininess) return;
+    for (i = 0; i <= SPECULAR_TABLE_SIZE; i++) {
+        double x = (double)i / SPECULAR_TABLE_SIZE;
+        lighting->specular_table[i] = (float)pow(x, (double)lighting->shininess);
+    }
+    lighting->specular_table[SPECULAR_TABLE_SIZE + 1] = 1.0f;   // x == 1 时插值不越界
+    lighting->table_shininess = lighting->shininess;
+    lighting->table_valid = 1;
+}
+
+// 查表并线性插值求 x^shininess，x <= 0 时为 0
+float specular_lookup(const float *table, float x) {
+    float f;
+    int i;
+    if (x <= 0.0f) return 0.0f;
+    if (x >= 1.0f) return 1.0f;
+    f = x * SPECULAR_TABLE_SIZE;
+    i = (int)f;
+    return table[i] + (table[i + 1] - table[i]) * (f - (float)i);
+}
+
+// 顶点光照：view_pos 和 normal 为摄影机坐标系中的位置和法向量（normal 未归一化）
+float light_vertex(const light_setup_t *ls, const point_t *view_pos, const vector_t *normal) {
+    vector_t n = *normal, v, l, r;
+    float light = ls->ambient, ln, att;
+    int i;
+
+    vector_normalize(&n);
+    v.x = -view_pos->x, v.y = -view_pos->y, v.z = -view_pos->z, v.w = 0.0f;
+    vector_normalize(&v);
+
+    for (i = 0; i < ls->count; i++) {
+        att = ls->intensity[i];
+        if (ls->type[i] == LIGHT_DIRECTIONAL) {
+            l = ls->vec[i];
+        }   else {
+            float d2;
+            vector_sub(&l, &ls->vec[i], view_pos);
+            d2 = vector_dotproduct(&l, &l);
+            vector_normalize(&l);
+            att = att / (1.0f + ls->falloff[i] * d2);
+        }
+        ln = vector_dotproduct(&l, &n);
+        if (ln <= 0.0f) continue;       // 背光
+        // 反射方向 r = 2(n.l)n - l，n 和 l 都是单位向量，r 也是
+        r.x = 2 * ln * n.x - l.x;
+        r.y = 2 * ln * n.y - l.y;
+        r.z = 2 * ln * n.z - l.z;
+        r.w = 0.0f;
+        light += att * (ls->diffuse * ln + 
+            ls->specular * specular_lookup(ls->table, vector_dotproduct(&r, &v)));
+    }
+
+    if (light < ls->ambient) light = ls->ambient;
+    else if (light > 1) light = 1;
+    return light;
 }
 
 
 //=====================================================================
 // 渲染设备
 //=====================================================================
+#define TEXTURE_NEAREST             0   // 只用第 0 层，最近点采样（默认）
+#define TEXTURE_MIPMAP              1   // 按 LOD 选择最接近的 mip 层，最近点采样
+#define TEXTURE_BILINEAR            2   // 按 LOD 选择最接近的 mip 层，双线性采样
+#define TEXTURE_TRILINEAR           3   // 相邻两层各做双线性采样，按 LOD 的小数部分混合
+
+#define TEXTURE_LINEAR              0   // 按行存储（传入的图像，默认）
+#define TEXTURE_TILE4               1   // 4x4 的块，每块 64 字节，正好一条缓存行
+#define TEXTURE_TILE8               2   // 8x8 的块，块内按行存储
+#define TEXTURE_MORTON              3   // Z 序（Morton 序）：x、y 的二进制位交错
+
+#define TEXTURE_RGB32               0   // 32 位 0x00RRGGBB，高 8 位忽略（默认）
+#define TEXTURE_P8                  1   // 8 位下标，256 色调色板
+#define TEXTURE_BC1                 2   // 4x4 的块 8 字节：两个 565 端点和 16 个 2 位下标（DXT1）
+#define TEXTURE_BC3                 3   // 4x4 的块 16 字节：8 字节 alpha（忽略）和 BC1 颜色块（DXT5）
+
+#define TEXTURE_MAX_LEVELS          32
+#define TEXTURE_CACHE_SIZE          4   // 解码后的 BC 块缓存的项数
+
+// 纹理的一层。纹素 (x, y) 为 bits[texel_row(t, y) + texel_col(t, x)]：
+// 按行存储时为 bits[y * pitch + x]，pitch 可以为负；分块存储时纹理按 2^tile_shift
+// 见方的块排列，pitch 为相邻两行块的间隔，块内按行或按 Z 序存储。
+// P8 与 BC 格式的纹素在 data 中，pitch 为相邻两行（BC 为两行块）的字节数，总是按行存储
+typedef struct {
+    const IUINT32 *bits;
+    long pitch;                 // 相邻两行（分块时为两行块）的间隔（IUINT32 个数）
+    int width;
+    int height;
+    int format;                 // TEXTURE_RGB32 / P8 / BC1 / BC3
+    int layout;                 // TEXTURE_LINEAR / TILE4 / TILE8 / MORTON
+    int tile_shift;             // 块的边长为 2^tile_shift，按行存储时为 0
+    const unsigned char *data;  // P8 / BC 格式的数据
+    const IUINT32 *palette;     // P8 的调色板
+    float max_u;                // width - 1
+    float max_v;                // height - 1
+}   texture_level_t;
+
+// 最近解码的 BC 块，按块坐标的奇偶直接映射，相邻的 2x2 个块可以同时留在缓存里。
+// 每次绘制三角形时在绘制线程的栈上建立，纹理在此期间不会改变，不需要加锁和失效
+typedef struct {
+    const unsigned char *block[TEXTURE_CACHE_SIZE];
+    IUINT32 texels[TEXTURE_CACHE_SIZE][16];
+}   texture_cache_t;
+
+// 一段像素的采样参数：由 device_sampler 按该段的 LOD 选择
+typedef struct {
+    const texture_level_t *level;   // 采样的层，三线性时还用到 level + 1
+    int filter;                 // TEXTURE_*
+    int blend;                  // 三线性时 level + 1 的权重（0 - 256）
+    texture_cache_t *cache;     // 第 0 层为 BC 格式时的块缓存，否则为 NULL
+}   sampler_t;
+
+// 统计的阶段：每帧各阶段的耗时（device->stats_timing 非零时才计时）
+#define STAGE_VERTEX        0       // 顶点变换与光照
+#define STAGE_SETUP         1       // 图元装配、裁剪、三角形 setup 与分箱
+#define STAGE_RASTER        2       // 光栅化：立即绘制的填充，或 device_flush
+#define STAGE_CLEAR         3       // device_clear
+#define STAGE_PRESENT       4       // 呈现，由调用者用 device_stage_end 计入
+#define STAGE_COUNT         5
+
+// 流水线统计：计数总是累加，开销只是几次整数加法。光栅化的计数由各线程
+// 分别累加，device_flush 结束时合并，因此已分箱未绘制的图元还没有计入
+typedef struct {
+    long long triangles;        // 进入图元装配的三角形
+    long long culled;           // 背面剔除的三角形（REMOVE_BACKFACE）
+    long long rejected;         // 在 cvv 之外丢弃的三角形：三个顶点在同一平面之外或裁剪后为空
+    long long trapezoids;       // setup 产生的梯形，边函数光栅化时为三角形
+    long long spans;            // 扫描线段，边函数光栅化时为 8x8 块中的行
+    long long tested;           // 做深度测试的像素，分层深度整段 / 整块跳过的不计入
+    long long depth_failed;     // 深度测试失败的像素，device_get_stats 由 tested - written 得出
+    long long written;          // 通过深度测试并写入的像素
+    IUINT64 ticks[STAGE_COUNT]; // 各阶段的耗时，单位为 stats_ticks 的计数
+    double ms[STAGE_COUNT];     // device_get_stats 由 ticks 换算的毫秒
+}   device_stats_t;
+
 typedef struct {
     transform_t transform;      // 坐标变换器
     int width;                  // 窗口宽度
     int height;                 // 窗口高度
     IUINT32 **framebuffer;      // 像素缓存：framebuffer[y] 代表第 y行
-    float **zbuffer;            // 深度缓存：zbuffer[y] 为第 y行指针
-    IUINT32 **texture;          // 纹理：同样是每行索引
-    int tex_width;              // 纹理宽度
-    int tex_height;             // 纹理高度
-    float max_u;                // 纹理最大宽度：tex_width - 1
-    float max_v;                // 纹理最大高度：tex_height - 1
+    void **zbuffer;             // 深度缓存：zbuffer[y] 为第 y行指针，元素类型由 depth_format 决定
+    int depth_format;           // 深度缓存的格式：DEPTH_*
+    int pitch;                  // 自有的颜色缓冲和深度缓存每行的像素数，16 的倍数（每行 64 字节对齐）
+    long fb_pitch;              // 当前颜色缓冲每行的像素数
+    void *planes;               // 自有的颜色缓冲和深度缓存（page_alloc），两者各占一段
+    size_t planes_size;         // planes 实际分配的大小
+    int planes_pages;           // planes 的页类型：PAGES_*
+    texture_level_t tex_levels[TEXTURE_MAX_LEVELS]; // 纹理：第 0 层为传入的图像，其余为 mip
+    int tex_level_count;        // 已生成的层数，1 为只有第 0 层
+    IUINT32 *tex_mips;          // 第 1 层及以后各层的存储
+    int tex_filter;             // 纹理过滤：TEXTURE_*
+    int tex_layout;             // 纹理的存储方式：TEXTURE_LINEAR 等
+    texture_level_t tex_image;  // 传入的第 0 层（按行存储），改变存储方式时由它重新生成
+    void *tex_tiles;            // 分块存储时各层的存储（未对齐的 malloc 指针）
     int render_state;           // 渲染状态
+    int rasterizer;             // 填充三角形的光栅化方式：RASTERIZER_*
+    int depth_write;            // 是否写入深度缓存（深度测试总是进行）
+    int hiz_test;               // 是否用分层深度提前剔除被遮挡的三角形、块和扫描线段
+    float *hiz;                 // 每个 8x8 块的最小深度值（最远深度，见 depth_key），只会偏小
+    unsigned char *hiz_state;   // 块的状态：TILE_CLEAN / TILE_DIRTY / TILE_STALE
+    int hiz_pitch;              // 每行的块数：(width + 7) / 8
+    IUINT32 *row_colors;        // device_clear 时每行的颜色
+    int row_mode;               // row_colors 对应的清屏模式，-1 为未计算
+    IUINT32 row_background;     // row_colors 对应的背景颜色
     IUINT32 background;         // 背景颜色
     IUINT32 foreground;         // 线框颜色
+    lighting_t lighting;        // 光照状态，每次绘制时解析为 light_setup_t
+    int threads;                // 光栅化线程数：0 为立即绘制，>= 1 为分块绘制
+    struct raster_pool_t *pool; // 分块绘制的分箱与线程池，立即绘制时为 NULL
+    struct cached_vertex_t *vcache; // device_draw_indexed 的变换后顶点缓存
+    int vcache_max;             // 顶点缓存的容量
+    struct command_buffer_t *commands;  // 非 NULL 时索引绘制只录制到命令缓冲
+    struct trace_writer_t *trace;   // 非 NULL 时把影响画面的调用录制到 trace 文件
+    device_stats_t stats;       // 自上次 device_stats_reset 以来的统计
+    int stats_timing;           // 是否给各阶段计时（每个三角形多读两次时钟）
 }   device_t;
 
-IUINT32 reflectIndex;//反射指数
-float ambientLightIntensity, lightIntensity, diffuseRate, specularRate;//环境光强度, 平行光源光强度, 漫反射系数, 镜面反射系数
-vector_t lightDirection, upDirection, viewDirection;//平行光源方向, 视线法向量，视线方向，变换后的视线方向
+typedef struct raster_pool_t raster_pool_t;
+
+// 经过顶点阶段（变换、光照、归一化、rhw 初始化）的顶点
+typedef struct cached_vertex_t {
+    vertex_t v;                 // pos 为屏幕坐标，pos.w 为裁剪空间的 w
+    int cvv;                    // transform_check_cvv 的结果，非 0 表示在 cvv 之外
+    const vertex_t *src;        // 原始顶点，裁剪时重新插值属性，仅在本次绘制内有效
+}   cached_vertex_t;
+
+void device_flush(device_t *device);                // 绘制所有已分箱的图元
+double timer_ms(void);                              // 单调时钟，单位毫秒
+void device_record_draw(device_t *device, const vertex_t *vertices, const vector_t *normals, 
+    int count, const int *indices, int index_count, const matrix_t *world, 
+    const color_t *color);                          // 录制到 device->commands
+void device_set_threads(device_t *device, int n);   // 设置光栅化线程数
+void trace_write_texture(device_t *device);         // 录制：当前纹理
+void trace_write_clear(device_t *device, int mode); // 录制：清屏
+void trace_write_primitive(device_t *device, const vertex_t *v1, const vertex_t *v2, 
+    const vertex_t *v3, const vector_t *normal);    // 录制：device_draw_primitive
+void trace_write_draw(device_t *device, const vertex_t *vertices, const vector_t *normals, 
+    int count, const int *indices, int index_count, const matrix_t *worlds, 
+    const color_t *colors, int instance_count);     // 录制：索引或实例化绘制
+
+vector_t upDirection, viewDirection;//视线法向量，视线方向
 point_t cameraPosition, viewPosition;//摄影机位置，视点位置
 
-// 设备初始化，fb为外部帧缓存，非 NULL 将引用外部帧缓存（每行 4字节对齐）
-void device_init(device_t *device, int width, int height, void *fb) {
-    int need = sizeof(void*) * (height * 2 + 1024) + width * height * 8;
-    char *ptr = (char*)malloc(need + 64);
-    char *framebuf, *zbuf;
+// 阶段计时的时钟：x86 上为时间戳计数器，读取只要几十个周期；其他平台为纳秒
+FORCE_INLINE IUINT64 stats_ticks(void) {
+#ifdef MINI3D_X86
+    return (IUINT64)__rdtsc();
+#else
+    return (IUINT64)(timer_ms() * 1e6);
+#endif
+}
+
+IUINT64 stats_base_ticks = 0;
+double stats_base_ms = 0;
+
+// 记下换算的起点，device_init 时调用
+void stats_clock_start(void) {
+    if (stats_base_ticks != 0) return;
+    stats_base_ms = timer_ms();
+    stats_base_ticks = stats_ticks();
+}
+
+// 每个计数对应的毫秒数：用时间戳计数器和单调时钟自起点走过的差值换算，
+// 间隔越长越准确，不足 1ms 时等待
+double stats_tick_ms(void) {
+#ifdef MINI3D_X86
+    double ms;
+    IUINT64 ticks;
+    stats_clock_start();
+    do {
+        ms = timer_ms();
+        ticks = stats_ticks();
+    }   while (ms - stats_base_ms < 1.0);
+    return (ms - stats_base_ms) / (double)(ticks - stats_base_ticks);
+#else
+    return 1e-6;
+#endif
+}
+
+// 设备初始化，fb为外部帧缓存，非 NULL 将引用外部帧缓存（每行 width 个像素）。
+// pitch 为自有的颜色缓冲和深度缓存每行的像素数，向上取整到 16 的倍数，0 为按 width 取整。
+// 颜色（fb 为 NULL 时）和深度各占一段，由 page_alloc 分配，每行起点 64 字节对齐
+void device_init_pitch(device_t *device, int width, int height, void *fb, int pitch) {
+    char *ptr = (char*)malloc(sizeof(void*) * height * 2 + 64);
+    size_t plane;
+    IUINT32 *framebuf;
+    float *zbuf;
     int j;
     assert(ptr);
+    if (pitch < width) pitch = width;
+    pitch = (pitch + 15) & ~15;
+    plane = (size_t)pitch * height * 4;
+    device->pitch = pitch;
+    device->planes_size = (fb == NULL)? plane * 2 : plane;
+    device->planes = page_alloc(&device->planes_size, &device->planes_pages);
+    assert(device->planes);
     device->framebuffer = (IUINT32**)ptr;
-    device->zbuffer = (float**)(ptr + sizeof(void*) * height);
+    device->zbuffer = (void**)(ptr + sizeof(void*) * height);
     ptr += sizeof(void*) * height * 2;
-    device->texture = (IUINT32**)ptr;
-    ptr += sizeof(void*) * 1024;
-    framebuf = (char*)ptr;
-    zbuf = (char*)ptr + width * height * 4;
-    ptr += width * height * 8;
-    if (fb != NULL) framebuf = (char*)fb;
+    framebuf = (fb != NULL)? (IUINT32*)fb : (IUINT32*)device->planes;
+    zbuf = (float*)((char*)device->planes + ((fb == NULL)? plane : 0));
+    device->fb_pitch = (fb != NULL)? width : pitch;
     for (j = 0; j < height; j++) {
-        device->framebuffer[j] = (IUINT32*)(framebuf + width * 4 * j);
-        device->zbuffer[j] = (float*)(zbuf + width * 4 * j);
-    }
-    device->texture[0] = (IUINT32*)ptr;
-    device->texture[1] = (IUINT32*)(ptr + 16);
-    memset(device->texture[0], 0, 64);
-    device->tex_width = 2;
-    device->tex_height = 2;
-    device->max_u = 1.0f;
-    device->max_v = 1.0f;
+        device->framebuffer[j] = framebuf + device->fb_pitch * j;
+        device->zbuffer[j] = zbuf + (size_t)pitch * j;
+    }
+    memset(ptr, 0, 64);         // 默认纹理：2 x 2 的黑色
+    device->tex_image.bits = (IUINT32*)ptr;
+    device->tex_image.pitch = 4;
+    device->tex_image.width = 2;
+    device->tex_image.height = 2;
+    device->tex_image.format = TEXTURE_RGB32;
+    device->tex_image.layout = TEXTURE_LINEAR;
+    device->tex_image.tile_shift = 0;
+    device->tex_image.data = NULL;
+    device->tex_image.palette = NULL;
+    device->tex_image.max_u = 1.0f;
+    device->tex_image.max_v = 1.0f;
+    device->tex_levels[0] = device->tex_image;
+    device->tex_level_count = 1;
+    device->tex_mips = NULL;
+    device->tex_filter = TEXTURE_NEAREST;
+    device->tex_layout = TEXTURE_LINEAR;
+    device->tex_tiles = NULL;
     device->width = width;
     device->height = height;
     device->background = 0xffc300;
     device->foreground = 0;
+    lighting_init(&device->lighting);
     transform_init(&device->transform, width, height);
     device->render_state = RENDER_STATE_WIREFRAME;
+    device->rasterizer = RASTERIZER_TRAPEZOID;
+    device->depth_write = 1;
+    device->depth_format = DEPTH_FLOAT32;
+    device->hiz_test = 1;
+    device->hiz_pitch = (width + 7) >> 3;
+    device->hiz = (float*)malloc((sizeof(float) + 1) * device->hiz_pitch * ((height + 7) >> 3));
+    assert(device->hiz);
+    device->hiz_state = (unsigned char*)(device->hiz + device->hiz_pitch * ((height + 7) >> 3));
+    memset(device->hiz_state, TILE_STALE, device->hiz_pitch * ((height + 7) >> 3));
+    device->row_colors = (IUINT32*)malloc(sizeof(IUINT32) * height);
+    assert(device->row_colors);
+    device->row_mode = -1;
+    if (span_simd < 0) span_simd = cpu_simd_level();
+    device->threads = 0;
+    device->pool = NULL;
+    device->vcache = NULL;
+    device->vcache_max = 0;
+    device->commands = NULL;
+    device->trace = NULL;
+    device->stats_timing = 0;
+    memset(&device->stats, 0, sizeof(device_stats_t));
+    stats_clock_start();
+}
+
+// 设备初始化，颜色缓冲和深度缓存使用默认的 pitch
+void device_init(device_t *device, int width, int height, void *fb) {
+    device_init_pitch(device, width, height, fb, 0);
 }
 
 // 删除设备
 void device_destroy(device_t *device) {
+    device_set_threads(device, 0);
+    if (device->hiz)
+        free(device->hiz);
+    device->hiz = NULL;
+    device->hiz_state = NULL;
+    if (device->row_colors)
+        free(device->row_colors);
+    device->row_colors = NULL;
+    if (device->vcache)
+        free(device->vcache);
+    device->vcache = NULL;
+    device->vcache_max = 0;
+    device->commands = NULL;
+    if (device->tex_mips)
+        free(device->tex_mips);
+    device->tex_mips = NULL;
+    if (device->tex_tiles)
+        free(device->tex_tiles);
+    device->tex_tiles = NULL;
+    device->tex_level_count = 0;
     if (device->framebuffer) 
         free(device->framebuffer);
     device->framebuffer = NULL;
     device->zbuffer = NULL;
-    device->texture = NULL;
+    if (device->planes)
+        page_free(device->planes, device->planes_size);
+    device->planes = NULL;
+}
+
+// 设置深度缓存的格式，原有的深度作废（相当于清空深度）。16 位深度在同一块存储中
+// 每行占 pitch * 2 字节，深度测试的内存流量减半，远处的精度低于浮点
+void device_set_depth_format(device_t *device, int format) {
+    char *zbuf = (char*)device->zbuffer[0];
+    size_t size = (format == DEPTH_UNORM16)? sizeof(IUINT16) : sizeof(float);
+    int j;
+    device_flush(device);
+    device->depth_format = format;
+    for (j = 0; j < device->height; j++) {
+        device->zbuffer[j] = zbuf + (size_t)device->pitch * size * j;
+    }
+    memset(device->hiz_state, TILE_STALE, device->hiz_pitch * ((device->height + 7) >> 3));
+}
+
+// 设置远平面，far <= 0 为无限远。深度缓存存的是 rhw 而不是 z，远平面只用于裁剪，
+// 与深度精度无关；DEPTH_FLOAT32 的相对精度处处相同，大场景可以不设远平面
+void device_set_far_plane(device_t *device, float far) {
+    transform_t *ts = &device->transform;
+    matrix_set_perspective(&ts->projection, 3.1415926f * 0.5f, ts->w / ts->h, NEAR_PLANE, far);
+    transform_update(ts);
+}
+
+// 把颜色缓冲换成 fb（width x height，每行相隔 pitch 个像素），用于在多个缓冲之间轮换；
+// 已分箱的图元先画到原来的缓冲。深度缓存和分层深度不变
+void device_set_framebuffer(device_t *device, IUINT32 *fb, long pitch) {
+    int j;
+    device_flush(device);
+    device->fb_pitch = pitch;
+    for (j = 0; j < device->height; j++) {
+        device->framebuffer[j] = fb + pitch * j;
+    }
+}
+
+// 开始新一帧的统计
+void device_stats_reset(device_t *device) {
+    memset(&device->stats, 0, sizeof(device_stats_t));
+}
+
+// 取得自上次 device_stats_reset 以来的统计，并换算深度测试失败的像素和各阶段的毫秒
+void device_get_stats(const device_t *device, device_stats_t *stats) {
+    double scale = 0;
+    int i;
+    *stats = device->stats;
+    stats->depth_failed = stats->tested - stats->written;
+    if (device->stats_timing) scale = stats_tick_ms();
+    for (i = 0; i < STAGE_COUNT; i++) stats->ms[i] = (double)stats->ticks[i] * scale;
+}
+
+// 阶段计时：begin 返回起点，end 把经过的时间计入 stage。不计时时只是一次判断
+FORCE_INLINE IUINT64 device_stage_begin(const device_t *device) {
+    return device->stats_timing? stats_ticks() : 0;
+}
+
+FORCE_INLINE void device_stage_end(device_t *device, int stage, IUINT64 start) {
+    if (device->stats_timing) device->stats.ticks[stage] += stats_ticks() - start;
+}
+
+unsigned int read_u16(const unsigned char *p) { return p[0] | (p[1] << 8); }
+unsigned int read_u32(const unsigned char *p) { return read_u16(p) | (read_u16(p + 2) << 16); }
+
+// 把 x 的低 16 位分散到偶数位上：Z 序下标为 spread(x) | spread(y) << 1
+FORCE_INLINE IUINT32 morton_spread(IUINT32 x) {
+    x = (x | (x << 8)) & 0x00ff00ff;
+    x = (x | (x << 4)) & 0x0f0f0f0f;
+    x = (x | (x << 2)) & 0x33333333;
+    x = (x | (x << 1)) & 0x55555555;
+    return x;
+}
+
+// 纹素所在行（分块时为所在的行块及块内的行）的起始下标
+FORCE_INLINE long texel_row(const texture_level_t *t, int y) {
+    int s = t->tile_shift, m = (1 << s) - 1;
+    if (t->layout == TEXTURE_LINEAR) return y * t->pitch;
+    if (t->layout == TEXTURE_MORTON) return (y >> s) * t->pitch + (morton_spread(y & m) << 1);
+    return (y >> s) * t->pitch + ((y & m) << s);
+}
+
+// 纹素在行内（分块时为所在的块及块内的列）的偏移
+FORCE_INLINE long texel_col(const texture_level_t *t, int x) {
+    int s = t->tile_shift, m = (1 << s) - 1;
+    if (t->layout == TEXTURE_LINEAR) return x;
+    if (t->layout == TEXTURE_MORTON) return ((long)(x >> s) << (s * 2)) + morton_spread(x & m);
+    return ((long)(x >> s) << (s * 2)) + (x & m);
+}
+
+// 565 颜色扩展为 0x00RRGGBB，低位用高位填充
+IUINT32 bc_expand(unsigned int c) {
+    IUINT32 r = (c >> 11) & 31, g = (c >> 5) & 63, b = c & 31;
+    return (((r << 3) | (r >> 2)) << 16) | (((g << 2) | (g >> 4)) << 8) | ((b << 3) | (b >> 2));
+}
+
+// 逐通道计算 (a * wa + b * wb) / d
+IUINT32 bc_mix(IUINT32 a, IUINT32 b, int wa, int wb, int d) {
+    IUINT32 r = (((a >> 16) & 255) * wa + ((b >> 16) & 255) * wb) / d;
+    IUINT32 g = (((a >> 8) & 255) * wa + ((b >> 8) & 255) * wb) / d;
+    IUINT32 bl = ((a & 255) * wa + (b & 255) * wb) / d;
+    return (r << 16) | (g << 8) | bl;
+}
+
+// BC 颜色块的 4 种颜色。c0 > c1 或者 BC3（four 非 0）时后两种为 1/3、2/3 处的插值，
+// 否则为中点和黑色（BC1 的透明色，这里没有 alpha）
+void bc_colors(IUINT32 *colors, unsigned int c0, unsigned int c1, int four) {
+    colors[0] = bc_expand(c0);
+    colors[1] = bc_expand(c1);
+    if (four || c0 > c1) {
+        colors[2] = bc_mix(colors[0], colors[1], 2, 1, 3);
+        colors[3] = bc_mix(colors[0], colors[1], 1, 2, 3);
+    }   else {
+        colors[2] = bc_mix(colors[0], colors[1], 1, 1, 2);
+        colors[3] = 0;
+    }
+}
+
+// 纹素 (x, y) 所在 BC 块的颜色部分
+FORCE_INLINE const unsigned char *bc_block(const texture_level_t *t, int x, int y) {
+    if (t->format == TEXTURE_BC1) return t->data + (y >> 2) * t->pitch + (x >> 2) * 8;
+    return t->data + (y >> 2) * t->pitch + (x >> 2) * 16 + 8;
+}
+
+// 读取非 RGB32 格式的纹素。cache 非 NULL 时 BC 块整块解码后放进缓存，
+// 双线性采样的 4 个纹素和相邻像素大多落在同一块里；否则只计算用到的那种颜色
+IUINT32 texel_decode(const texture_level_t *t, int x, int y, texture_cache_t *cache) {
+    const unsigned char *block;
+    IUINT32 colors[4];
+    unsigned int c0, c1, i;
+    if (t->format == TEXTURE_P8) return t->palette[t->data[y * t->pitch + x]] & 0xffffff;
+    block = bc_block(t, x, y);
+    if (cache) {
+        int k = ((x >> 2) & 1) | (((y >> 2) & 1) << 1);
+        if (cache->block[k] != block) {
+            IUINT32 bits = read_u32(block + 4);
+            bc_colors(colors, read_u16(block), read_u16(block + 2), t->format == TEXTURE_BC3);
+            for (i = 0; i < 16; i++, bits >>= 2) cache->texels[k][i] = colors[bits & 3];
+            cache->block[k] = block;
+        }
+        return cache->texels[k][(y & 3) * 4 + (x & 3)];
+    }
+    c0 = read_u16(block);
+    c1 = read_u16(block + 2);
+    i = (block[4 + (y & 3)] >> ((x & 3) * 2)) & 3;
+    if (i < 2) return bc_expand(i? c1 : c0);
+    bc_colors(colors, c0, c1, t->format == TEXTURE_BC3);
+    return colors[i];
+}
+
+// 读取纹素 (x, y) 的颜色（0x00RRGGBB）
+FORCE_INLINE IUINT32 texel_read(const texture_level_t *t, int x, int y, texture_cache_t *cache) {
+    if (t->format == TEXTURE_RGB32) return t->bits[texel_row(t, y) + texel_col(t, x)] & 0xffffff;
+    return texel_decode(t, x, y, cache);
+}
+
+// 第 0 层为 BC 格式并且使用 mip 时清空并返回 cache，否则返回 NULL。有 mip 时
+// 只有放大的纹理才读第 0 层，一块会被多个像素用到；TEXTURE_NEAREST 下第 0 层
+// 可能被缩小，整块解码只用到一个纹素，不如直接计算
+texture_cache_t *texture_cache_init(texture_cache_t *cache, const device_t *device) {
+    int i;
+    if (device->tex_filter == TEXTURE_NEAREST) return NULL;
+    if (device->tex_levels[0].format != TEXTURE_BC1 && 
+        device->tex_levels[0].format != TEXTURE_BC3) return NULL;
+    for (i = 0; i < TEXTURE_CACHE_SIZE; i++) cache->block[i] = NULL;
+    return cache;
+}
+
+// 由第 0 层生成 mip：每层宽高减半（不小于 1），每个纹素为上一层 2x2 纹素的平均，
+// 奇数尺寸时最后一行、一列与自身平均。纹素的高 8 位在这里丢弃，P8 / BC 格式的
+// 第 0 层在这里解码，mip 总是 RGB32
+void device_build_mips(device_t *device) {
+    texture_level_t *level = device->tex_levels;
+    size_t total = 0;
+    IUINT32 *ptr;
+    int w = level->width, h = level->height, n = 1, x, y;
+    while ((w > 1 || h > 1) && n < TEXTURE_MAX_LEVELS) {
+        w = (w > 1)? w >> 1 : 1;
+        h = (h > 1)? h >> 1 : 1;
+        total += (size_t)w * h;
+        n++;
+    }
+    if (device->tex_mips) free(device->tex_mips);
+    device->tex_mips = NULL;
+    device->tex_level_count = 1;
+    if (n == 1) return;
+    ptr = (IUINT32*)malloc(sizeof(IUINT32) * total);
+    assert(ptr);
+    device->tex_mips = ptr;
+    for (; device->tex_level_count < n; level++, device->tex_level_count++) {
+        texture_level_t *next = level + 1;
+        next->bits = ptr;
+        next->width = (level->width > 1)? level->width >> 1 : 1;
+        next->height = (level->height > 1)? level->height >> 1 : 1;
+        next->pitch = next->width;
+        next->format = TEXTURE_RGB32;
+        next->layout = TEXTURE_LINEAR;
+        next->tile_shift = 0;
+        next->max_u = (float)(next->width - 1);
+        next->max_v = (float)(next->height - 1);
+        for (y = 0; y < next->height; y++) {
+            int y0 = y * 2, y1 = (y * 2 + 1 < level->height)? y * 2 + 1 : y * 2;
+            for (x = 0; x < next->width; x++) {
+                int x0 = x * 2, x1 = (x * 2 + 1 < level->width)? x * 2 + 1 : x * 2;
+                IUINT32 c00 = texel_read(level, x0, y0, NULL), c01 = texel_read(level, x1, y0, NULL);
+                IUINT32 c10 = texel_read(level, x0, y1, NULL), c11 = texel_read(level, x1, y1, NULL);
+                IUINT32 rb = (c00 & 0xff00ff) + (c01 & 0xff00ff) + (c10 & 0xff00ff) + (c11 & 0xff00ff);
+                IUINT32 g = (c00 & 0xff00) + (c01 & 0xff00) + (c10 & 0xff00) + (c11 & 0xff00);
+                *ptr++ = (((rb + 0x20002) >> 2) & 0xff00ff) | (((g + 0x200) >> 2) & 0xff00);
+            }
+        }
+    }
+}
+
+// 计算按 layout 存储一层所需的块大小和 pitch，返回纹素个数（含补齐的部分）。
+// Z 序的块取能放进纹理的最大 2 的幂，宽高不是 2 的幂时补齐到整块
+size_t texture_layout_size(texture_level_t *t, int layout) {
+    int s = 0;
+    size_t rows;
+    if (layout == TEXTURE_TILE4) s = 2;
+    else if (layout == TEXTURE_TILE8) s = 3;
+    else if (layout == TEXTURE_MORTON) {
+        while ((1 << s) < t->width && (1 << s) < t->height) s++;
+    }
+    t->layout = layout;
+    t->tile_shift = s;
+    t->pitch = (long)(((t->width + (1 << s) - 1) >> s) << (s * 2));
+    rows = (size_t)((t->height + (1 << s) - 1) >> s);
+    return rows * (size_t)t->pitch;
+}
+
+// 由 tex_image 重新生成采样用的各层：需要时生成 mip，再按 tex_layout 重新排列。
+// 分块存储的各层放在一块按 64 字节对齐的内存里，4x4 的块与缓存行对齐
+void device_update_texture(device_t *device) {
+    texture_level_t linear[TEXTURE_MAX_LEVELS];
+    size_t total = 0, offset = 0;
+    IUINT32 *ptr;
+    int i, x, y;
+    device->tex_levels[0] = device->tex_image;
+    device->tex_level_count = 1;
+    if (device->tex_filter != TEXTURE_NEAREST) device_build_mips(device);
+    if (device->tex_tiles) free(device->tex_tiles);
+    device->tex_tiles = NULL;
+    if (device->tex_layout == TEXTURE_LINEAR) return;
+    for (i = 0; i < device->tex_level_count; i++) {
+        linear[i] = device->tex_levels[i];
+        if (linear[i].format != TEXTURE_RGB32) continue;    // 压缩格式保持原来的排列
+        total += texture_layout_size(&device->tex_levels[i], device->tex_layout);
+    }
+    assert(total <= 0x7fffffff);
+    device->tex_tiles = malloc(sizeof(IUINT32) * total + 64);
+    assert(device->tex_tiles);
+    ptr = (IUINT32*)(((size_t)device->tex_tiles + 63) & ~(size_t)63);
+    for (i = 0; i < device->tex_level_count; i++) {
+        texture_level_t *t = &device->tex_levels[i];
+        IUINT32 *bits = ptr + offset;
+        size_t size;
+        if (t->format != TEXTURE_RGB32) continue;
+        size = texture_layout_size(t, device->tex_layout);
+        memset(bits, 0, sizeof(IUINT32) * size);
+        for (y = 0; y < t->height; y++) {
+            const IUINT32 *src = linear[i].bits + linear[i].pitch * y;
+            IUINT32 *dst = bits + texel_row(t, y);
+            for (x = 0; x < t->width; x++) dst[texel_col(t, x)] = src[x];
+        }
+        t->bits = bits;
+        offset += size;
+    }
+}
+
+// 设置 format 格式的纹理：bits 为第 0 行（BC 为第一行块），pitch 为相邻两行的间隔，
+// RGB32 以 IUINT32 为单位，P8 与 BC 以字节为单位；自下而上存储的图像可以传入
+// 最后一行的地址和负的 pitch。palette 为 P8 的 256 色调色板，纹素和调色板的高 8 位忽略。
+// 数据不复制，在换掉纹理之前必须保持有效。SIMD 内核用 32 位有符号整数计算下标，
+// 纹理的跨度不能超过 2^31 个纹素（P8 与 BC 为字节）
+void device_set_texture_format(device_t *device, int format, const void *bits, long pitch, 
+    int w, int h, const IUINT32 *palette) {
+    long span = (pitch >= 0)? pitch : -pitch;
+    long row = (format == TEXTURE_BC1)? (w + 3) / 4 * 8 : 
+        ((format == TEXTURE_BC3)? (w + 3) / 4 * 16 : w);
+    int rows = (format == TEXTURE_BC1 || format == TEXTURE_BC3)? (h + 3) / 4 : h;
+    assert(w > 0 && h > 0 && span >= row);
+    assert((double)span * (rows - 1) + row <= 2147483647.0);
+    assert(format != TEXTURE_P8 || palette != NULL);
+    device_flush(device);       // 已分箱的图元仍然引用旧纹理
+    device->tex_image.format = format;
+    device->tex_image.bits = (format == TEXTURE_RGB32)? (const IUINT32*)bits : NULL;
+    device->tex_image.data = (format == TEXTURE_RGB32)? NULL : (const unsigned char*)bits;
+    device->tex_image.palette = palette;
+    device->tex_image.pitch = pitch;
+    device->tex_image.width = w;
+    device->tex_image.height = h;
+    device->tex_image.max_u = (float)(w - 1);
+    device->tex_image.max_v = (float)(h - 1);
+    device_update_texture(device);
+    if (device->trace) trace_write_texture(device);
+}
+
+// 设置当前纹理：bits 为第 0 行，pitch 为相邻两行的间隔（IUINT32 个数），
+// 自下而上存储的图像可以传入最后一行的地址和负的 pitch。纹素的高 8 位忽略
+void device_set_texture(device_t *device, void *bits, long pitch, int w, int h) {
+    device_set_texture_format(device, TEXTURE_RGB32, bits, pitch, w, h, NULL);
+}
+
+// 设置纹理过滤方式，需要 mip 而当前纹理还没有生成时在这里生成
+void device_set_texture_filter(device_t *device, int filter) {
+    device_flush(device);
+    device->tex_filter = filter;
+    if (filter != TEXTURE_NEAREST && device->tex_level_count == 1) device_update_texture(device);
+}
+
+// 设置纹理的存储方式：非 TEXTURE_LINEAR 时把各层复制一份重新排列，
+// 旋转、竖直方向走过纹理时相邻像素读取的纹素更多地落在同一条缓存行里
+void device_set_texture_layout(device_t *device, int layout) {
+    device_flush(device);
+    device->tex_layout = layout;
+    device_update_texture(device);
+}
+
+// 用颜色 c 填充 n 个像素：对齐到 16 字节后使用不经过缓存的写入，
+// 清屏写完整个 framebuffer，不需要把它先读进缓存
+void pixel_fill(IUINT32 *dst, int n, IUINT32 c) {
+#ifdef MINI3D_SSE2
+    __m128i cc = _mm_set1_epi32((int)c);
+    for (; n > 0 && (((size_t)dst) & 15) != 0; dst++, n--) dst[0] = c;
+    for (; n >= 16; dst += 16, n -= 16) {
+        _mm_stream_si128((__m128i*)dst, cc);
+        _mm_stream_si128((__m128i*)(dst + 4), cc);
+        _mm_stream_si128((__m128i*)(dst + 8), cc);
+        _mm_stream_si128((__m128i*)(dst + 12), cc);
+    }
+    for (; n >= 4; dst += 4, n -= 4) _mm_stream_si128((__m128i*)dst, cc);
+#endif
+    for (; n > 0; dst++, n--) dst[0] = c;
+}
+
+// 清空 framebuffer 和 zbuffer。每行的颜色只在模式或背景色变化时重新计算；
+// zbuffer 不在这里写：所有 8x8 块标记为 TILE_STALE，由 device_depth_prepare
+// 在图元第一次用到某个块时清零，没有被任何图元覆盖的块就不需要写
+void device_clear(device_t *device, int mode) {
+    int y, height = device->height;
+    IUINT64 start;
+    device_flush(device);
+    if (device->trace) trace_write_clear(device, mode);
+    start = device_stage_begin(device);
+    if (mode != device->row_mode || device->background != device->row_background) {
+        for (y = 0; y < height; y++) {
+            IUINT32 cc = (height - 1 - y) * 230 / (height - 1);
+            cc = (cc << 16) | (cc << 8) | cc;
+            if (mode == 0) cc = device->background;
+            device->row_colors[y] = cc;
+        }
+        device->row_mode = mode;
+        device->row_background = device->background;
+    }
+    for (y = 0; y < height; y++) {
+        pixel_fill(device->framebuffer[y], device->width, device->row_colors[y]);
+    }
+#ifdef MINI3D_SSE2
+    _mm_sfence();
+#endif
+    memset(device->hiz_state, TILE_STALE, device->hiz_pitch * ((height + 7) >> 3));
+    device_stage_end(device, STAGE_CLEAR, start);
+}
+
+// 画点
+void device_pixel(device_t *device, int x, int y, IUINT32 color) {
+    if (((IUINT32)x) < (IUINT32)device->width && ((IUINT32)y) < (IUINT32)device->height) {
+        device->framebuffer[y][x] = color;
+    }
+}
+
+// 画点，只绘制 clip 之内的像素
+void device_pixel_clip(device_t *device, const rect_t *clip, int x, int y, IUINT32 color) {
+    if (x >= clip->x0 && x < clip->x1 && y >= clip->y0 && y < clip->y1) {
+        device->framebuffer[y][x] = color;
+    }
+}
+
+// 绘制线段，只绘制 clip 之内的像素（clip 须在屏幕范围内）
+void device_draw_line_clip(device_t *device, const rect_t *clip, 
+    int x1, int y1, int x2, int y2, IUINT32 c) {
+    int x, y, rem = 0;
+    if (x1 == x2 && y1 == y2) {
+        device_pixel_clip(device, clip, x1, y1, c);
+    }   else if (x1 == x2) {
+        int inc = (y1 <= y2)? 1 : -1;
+        for (y = y1; y != y2; y += inc) device_pixel_clip(device, clip, x1, y, c);
+        device_pixel_clip(device, clip, x2, y2, c);
+    }   else if (y1 == y2) {
+        int inc = (x1 <= x2)? 1 : -1;
+        for (x = x1; x != x2; x += inc) device_pixel_clip(device, clip, x, y1, c);
+        device_pixel_clip(device, clip, x2, y2, c);
+    }   else {
+        int dx = (x1 < x2)? x2 - x1 : x1 - x2;
+        int dy = (y1 < y2)? y2 - y1 : y1 - y2;
+        if (dx >= dy) {
+            if (x2 < x1) x = x1, y = y1, x1 = x2, y1 = y2, x2 = x, y2 = y;
+            for (x = x1, y = y1; x <= x2; x++) {
+                device_pixel_clip(device, clip, x, y, c);
+                rem += dy;
+                if (rem >= dx) {
+                    rem -= dx;
+                    y += (y2 >= y1)? 1 : -1;
+                    device_pixel_clip(device, clip, x, y, c);
+                }
+            }
+            device_pixel_clip(device, clip, x2, y2, c);
+        }   else {
+            if (y2 < y1) x = x1, y = y1, x1 = x2, y1 = y2, x2 = x, y2 = y;
+            for (x = x1, y = y1; y <= y2; y++) {
+                device_pixel_clip(device, clip, x, y, c);
+                rem += dx;
+                if (rem >= dy) {
+                    rem -= dy;
+                    x += (x2 >= x1)? 1 : -1;
+                    device_pixel_clip(device, clip, x, y, c);
+                }
+            }
+            device_pixel_clip(device, clip, x2, y2, c);
+        }
+    }
+}
+
+// 绘制线段
+void device_draw_line(device_t *device, int x1, int y1, int x2, int y2, IUINT32 c) {
+    rect_t clip = { 0, 0, device->width, device->height };
+    device_draw_line_clip(device, &clip, x1, y1, x2, y2, c);
+}
+
+// 根据坐标读取纹理：最近点采样，u、v 的 [0, 1] 对应第一个和最后一个纹素的中心
+IUINT32 texture_read(const texture_level_t *t, float u, float v, texture_cache_t *cache) {
+    int x, y;
+    u = u * t->max_u;
+    v = v * t->max_v;
+    x = (int)(u + 0.5f);
+    y = (int)(v + 0.5f);
+    x = CMID(x, 0, t->width - 1);
+    y = CMID(y, 0, t->height - 1);
+    return texel_read(t, x, y, cache);
+}
+
+// 按 0 - 256 的权重 w 混合两个纹素：c1 * (256 - w) + c2 * w，
+// 红蓝两个通道在同一个 32 位整数里一起计算
+FORCE_INLINE IUINT32 texel_lerp(IUINT32 c1, IUINT32 c2, IUINT32 w) {
+    IUINT32 rb = ((c1 & 0xff00ff) * (256 - w) + (c2 & 0xff00ff) * w) >> 8;
+    IUINT32 g = ((c1 & 0xff00) * (256 - w) + (c2 & 0xff00) * w) >> 8;
+    return (rb & 0xff00ff) | (g & 0xff00);
+}
+
+// 双线性采样：坐标的约定与最近点采样相同，权重量化为 1/256
+IUINT32 texture_read_bilinear(const texture_level_t *t, float u, float v, texture_cache_t *cache) {
+    const IUINT32 *row0, *row1;
+    long c0, c1;
+    int x0, y0, x1, y1;
+    IUINT32 wx, wy;
+    u = u * t->max_u;
+    v = v * t->max_v;
+    u = (u < 0.0f)? 0.0f : ((u > t->max_u)? t->max_u : u);
+    v = (v < 0.0f)? 0.0f : ((v > t->max_v)? t->max_v : v);
+    x0 = (int)u;
+    y0 = (int)v;
+    wx = (IUINT32)((u - (float)x0) * 256.0f);
+    wy = (IUINT32)((v - (float)y0) * 256.0f);
+    x1 = (x0 + 1 < t->width)? x0 + 1 : x0;
+    y1 = (y0 + 1 < t->height)? y0 + 1 : y0;
+    if (t->format != TEXTURE_RGB32) {
+        return texel_lerp(texel_lerp(texel_decode(t, x0, y0, cache), texel_decode(t, x1, y0, cache), wx), 
+            texel_lerp(texel_decode(t, x0, y1, cache), texel_decode(t, x1, y1, cache), wx), wy);
+    }
+    row0 = t->bits + texel_row(t, y0);
+    row1 = t->bits + texel_row(t, y1);
+    c0 = texel_col(t, x0);
+    c1 = texel_col(t, x1);
+    return texel_lerp(texel_lerp(row0[c0], row0[c1], wx), 
+        texel_lerp(row1[c0], row1[c1], wx), wy);
+}
+
+// 按 sampler 采样。三线性的权重为 0 时不读 level + 1（最后一层之后没有下一层）
+IUINT32 sampler_read(const sampler_t *s, float u, float v) {
+    if (s->filter == TEXTURE_TRILINEAR && s->blend > 0) {
+        return texel_lerp(texture_read_bilinear(s->level, u, v, s->cache), 
+            texture_read_bilinear(s->level + 1, u, v, s->cache), (IUINT32)s->blend);
+    }
+    if (s->filter >= TEXTURE_BILINEAR) return texture_read_bilinear(s->level, u, v, s->cache);
+    return texture_read(s->level, u, v, s->cache);
+}
+
+// 选择屏幕上 (x, y) 处的采样参数。pu、pv、prhw 为乘过 rhw 的纹理坐标和 rhw 的
+// 屏幕空间平面，由它们求出纹理坐标对 x、y 的导数，LOD 取两个方向上纹素步长
+// 较大者的 log2。pu 为 NULL 或者没有 mip 时总是使用第 0 层
+void device_sampler(const device_t *device, sampler_t *s, const plane_t *pu, 
+    const plane_t *pv, const plane_t *prhw, float x, float y) {
+    const texture_level_t *t = device->tex_levels;
+    float rhw, w, u, v, dudx, dvdx, dudy, dvdy, rho, lod;
+    int level;
+    s->level = t;
+    s->filter = device->tex_filter;
+    s->blend = 0;
+    if (pu == NULL || device->tex_level_count < 2) return;
+    rhw = prhw->c + prhw->dx * x + prhw->dy * y;
+    if (rhw <= 0.0f) return;
+    w = 1.0f / rhw;
+    u = (pu->c + pu->dx * x + pu->dy * y) * w;
+    v = (pv->c + pv->dx * x + pv->dy * y) * w;
+    dudx = (pu->dx - u * prhw->dx) * w * (float)t->width;
+    dvdx = (pv->dx - v * prhw->dx) * w * (float)t->height;
+    dudy = (pu->dy - u * prhw->dy) * w * (float)t->width;
+    dvdy = (pv->dy - v * prhw->dy) * w * (float)t->height;
+    rho = dudx * dudx + dvdx * dvdx;
+    if (dudy * dudy + dvdy * dvdy > rho) rho = dudy * dudy + dvdy * dvdy;
+    if (rho <= 1.0f) return;    // 放大：使用第 0 层
+    lod = 0.5f * (float)(log(rho) * 1.4426950408889634);
+    if (s->filter == TEXTURE_TRILINEAR) {
+        if (lod >= (float)(device->tex_level_count - 1)) {
+            s->level = t + device->tex_level_count - 1;
+            return;
+        }
+        level = (int)lod;
+        s->level = t + level;
+        s->blend = (int)((lod - (float)level) * 256.0f);
+    }   else {
+        level = (int)(lod + 0.5f);
+        if (level > device->tex_level_count - 1) level = device->tex_level_count - 1;
+        s->level = t + level;
+    }
+}
+
+
+//=====================================================================
+// 渲染实现
+//=====================================================================
+
+// 计算像素颜色：w 为 1 / rhw，color 与 tc 为乘过 rhw 的插值结果
+IUINT32 device_shade(const sampler_t *sampler, int render_state, float w, 
+    const color_t *color, const texcoord_t *tc, float light) {
+    if (render_state & RENDER_STATE_TEXTURE) {
+        float u = tc->u * w;
+        float v = tc->v * w;
+        IUINT32 cc = sampler_read(sampler, u, v);
+        return ((int)((cc >> 16) * light) << 16) +
+               ((int)(((cc & 65535)>> 8) * light) << 8) +
+               (int)((cc & 255) * light);
+    }   else {
+        float r = color->r * w;
+        float g = color->g * w;
+        float b = color->b * w;
+        int R = (int)(r * 255.0f);
+        int G = (int)(g * 255.0f);
+        int B = (int)(b * 255.0f);
+        R = CMID(R, 0, 255);
+        G = CMID(G, 0, 255);
+        B = CMID(B, 0, 255);
+        return (R << 16) | (G << 8) | (B);
+    }
+}
+
+// 扫描线内核：按渲染状态在编译期特化，每个三角形选择一次，
+// 内层循环不再判断 render_state、屏幕边界，也不再插值用不到的属性。
+// 第 n 个像素的属性直接由 v + step * n 求出，不逐像素累加：结果与从哪里
+// 开始绘制无关（分 tile 绘制时与整行绘制逐位一致），SIMD 内核也能逐位复现
+#define SPAN_TEXTURE    1       // 纹理，否则为颜色
+#define SPAN_LIT        2       // 纹理颜色乘以光照，光照恒为 1 时省去
+#define SPAN_ZWRITE     4       // 写入深度
+#define SPAN_DEPTH16    8       // 深度缓存为 DEPTH_UNORM16，以整数比较和写入
+#define SPAN_BILINEAR   16      // 双线性采样（纹理）
+#define SPAN_TRILINEAR  32      // 三线性采样（纹理）
+
+#define DEPTH16_SCALE   (65535.0f * NEAR_PLANE)
+
+// rhw 换算为 16 位深度：截断后钳制到 [0, 65535]，与 SIMD 内核的 cvtt + min / max 相同
+FORCE_INLINE int depth16(float rhw) {
+    int d = (int)(rhw * DEPTH16_SCALE);
+    return (d < 0)? 0 : ((d > 65535)? 65535 : d);
+}
+
+// 深度缓存中保存的值，用于分层深度的比较：随 rhw 单调不减
+FORCE_INLINE float depth_key(const device_t *device, float rhw) {
+    return (device->depth_format == DEPTH_UNORM16)? (float)depth16(rhw) : rhw;
+}
+
+typedef int (*span_kernel_t)(const sampler_t *sampler, IUINT32 *framebuffer, 
+    void *zbuffer, const scanline_t *scanline, int x, int end);
+
+// 绘制扫描线上 [x, end) 的像素，调用者保证该区间在屏幕之内，返回写入的像素数
+FORCE_INLINE int span_kernel(const sampler_t *sampler, IUINT32 *framebuffer, 
+    void *zbuffer, const scanline_t *scanline, int x, int end, const int flags) {
+    const vertex_t *base = &scanline->v, *step = &scanline->step;
+    float *zf = (float*)zbuffer;
+    IUINT16 *zs = (IUINT16*)zbuffer;
+    float light = base->light;  // 光照沿扫描线不插值，取左端点的值
+    int written = 0;
+    for (; x < end; x++) {
+        float n = (float)(x - scanline->x);
+        float rhw = base->rhw + step->rhw * n;
+        int d = (flags & SPAN_DEPTH16)? depth16(rhw) : 0;
+        if ((flags & SPAN_DEPTH16)? d >= zs[x] : rhw >= zf[x]) {
+            float w = 1.0f / rhw;
+            written++;
+            if (flags & SPAN_ZWRITE) {
+                if (flags & SPAN_DEPTH16) zs[x] = (IUINT16)d;
+                else zf[x] = rhw;
+            }
+            if (flags & SPAN_TEXTURE) {
+                float u = base->tc.u + step->tc.u * n;
+                float v = base->tc.v + step->tc.v * n;
+                IUINT32 cc;
+                if ((flags & SPAN_TRILINEAR) && sampler->blend > 0) {
+                    cc = texel_lerp(texture_read_bilinear(sampler->level, u * w, v * w, sampler->cache), 
+                        texture_read_bilinear(sampler->level + 1, u * w, v * w, sampler->cache), 
+                        (IUINT32)sampler->blend);
+                }   else if (flags & (SPAN_BILINEAR | SPAN_TRILINEAR)) {
+                    cc = texture_read_bilinear(sampler->level, u * w, v * w, sampler->cache);
+                }   else {
+                    cc = texture_read(sampler->level, u * w, v * w, sampler->cache);
+                }
+                if (flags & SPAN_LIT) {
+                    framebuffer[x] = ((int)((cc >> 16) * light) << 16) +
+                                     ((int)(((cc & 65535)>> 8) * light) << 8) +
+                                     (int)((cc & 255) * light);
+                }   else {
+                    framebuffer[x] = cc;
+                }
+            }   else {
+                float r = base->color.r + step->color.r * n;
+                float g = base->color.g + step->color.g * n;
+                float b = base->color.b + step->color.b * n;
+                int R = (int)(r * w * 255.0f);
+                int G = (int)(g * w * 255.0f);
+                int B = (int)(b * w * 255.0f);
+                R = CMID(R, 0, 255);
+                G = CMID(G, 0, 255);
+                B = CMID(B, 0, 255);
+                framebuffer[x] = (R << 16) | (G << 8) | (B);
+            }
+        }
+    }
+    return written;
+}
+
+#define SPAN_KERNEL(name, flags) \
+    int name(const sampler_t *sampler, IUINT32 *framebuffer, void *zbuffer, \
+        const scanline_t *scanline, int x, int end) { \
+        return span_kernel(sampler, framebuffer, zbuffer, scanline, x, end, flags); \
+    }
+
+// 每个内核都有一个 16 位深度的版本，名字加 _16
+#define SPAN_KERNELS(name, flags) \
+    SPAN_KERNEL(name, flags) \
+    SPAN_KERNEL(name##_16, (flags) | SPAN_DEPTH16)
+
+SPAN_KERNELS(span_color, 0)
+SPAN_KERNELS(span_color_z, SPAN_ZWRITE)
+SPAN_KERNELS(span_texture, SPAN_TEXTURE)
+SPAN_KERNELS(span_texture_z, SPAN_TEXTURE | SPAN_ZWRITE)
+SPAN_KERNELS(span_texture_lit, SPAN_TEXTURE | SPAN_LIT)
+SPAN_KERNELS(span_texture_lit_z, SPAN_TEXTURE | SPAN_LIT | SPAN_ZWRITE)
+
+#define SPAN_FILTER_KERNELS(prefix, filter) \
+    SPAN_KERNELS(prefix, SPAN_TEXTURE | filter) \
+    SPAN_KERNELS(prefix##_z, SPAN_TEXTURE | SPAN_ZWRITE | filter) \
+    SPAN_KERNELS(prefix##_lit, SPAN_TEXTURE | SPAN_LIT | filter) \
+    SPAN_KERNELS(prefix##_lit_z, SPAN_TEXTURE | SPAN_LIT | SPAN_ZWRITE | filter)
+
+SPAN_FILTER_KERNELS(span_bilinear, SPAN_BILINEAR)
+SPAN_FILTER_KERNELS(span_trilinear, SPAN_TRILINEAR)
+
+// 双线性 / 三线性纹理内核，按 (SPAN_LIT | SPAN_ZWRITE | SPAN_DEPTH16) >> 1 索引
+span_kernel_t span_kernels_bilinear[8] = {
+    span_bilinear, span_bilinear_lit, span_bilinear_z, span_bilinear_lit_z,
+    span_bilinear_16, span_bilinear_lit_16, span_bilinear_z_16, span_bilinear_lit_z_16,
+};
+
+span_kernel_t span_kernels_trilinear[8] = {
+    span_trilinear, span_trilinear_lit, span_trilinear_z, span_trilinear_lit_z,
+    span_trilinear_16, span_trilinear_lit_16, span_trilinear_z_16, span_trilinear_lit_z_16,
+};
+
+// 按 SPAN_* 组合索引，颜色模式下不使用光照
+span_kernel_t span_kernels[16] = {
+    span_color, span_texture, span_color, span_texture_lit,
+    span_color_z, span_texture_z, span_color_z, span_texture_lit_z,
+    span_color_16, span_texture_16, span_color_16, span_texture_lit_16,
+    span_color_z_16, span_texture_z_16, span_color_z_16, span_texture_lit_z_16,
+};
+
+#ifdef MINI3D_X86
+// 8 个纹素的 texel_row / texel_col，按行存储时与原来的 y * pitch + x 相同
+TARGET_AVX2 FORCE_INLINE __m256i morton_spread_avx2(__m256i x) {
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 8)), _mm256_set1_epi32(0x00ff00ff));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 4)), _mm256_set1_epi32(0x0f0f0f0f));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 2)), _mm256_set1_epi32(0x33333333));
+    x = _mm256_and_si256(_mm256_or_si256(x, _mm256_slli_epi32(x, 1)), _mm256_set1_epi32(0x55555555));
+    return x;
+}
+
+TARGET_AVX2 FORCE_INLINE __m256i texel_row_avx2(const texture_level_t *t, __m256i y) {
+    const __m256i pitch = _mm256_set1_epi32((int)t->pitch);
+    const __m128i s = _mm_cvtsi32_si128(t->tile_shift);
+    __m256i lo;
+    if (t->layout == TEXTURE_LINEAR) return _mm256_mullo_epi32(y, pitch);
+    lo = _mm256_and_si256(y, _mm256_set1_epi32((1 << t->tile_shift) - 1));
+    lo = (t->layout == TEXTURE_MORTON)? _mm256_slli_epi32(morton_spread_avx2(lo), 1) : 
+        _mm256_sll_epi32(lo, s);
+    return _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srl_epi32(y, s), pitch), lo);
+}
+
+TARGET_AVX2 FORCE_INLINE __m256i texel_col_avx2(const texture_level_t *t, __m256i x) {
+    const __m128i s = _mm_cvtsi32_si128(t->tile_shift);
+    __m256i lo;
+    if (t->layout == TEXTURE_LINEAR) return x;
+    lo = _mm256_and_si256(x, _mm256_set1_epi32((1 << t->tile_shift) - 1));
+    if (t->layout == TEXTURE_MORTON) lo = morton_spread_avx2(lo);
+    return _mm256_add_epi32(_mm256_sll_epi32(_mm256_srl_epi32(x, s), 
+        _mm_cvtsi32_si128(t->tile_shift * 2)), lo);
+}
+
+// 8 个 565 颜色扩展为 0x00RRGGBB
+TARGET_AVX2 FORCE_INLINE __m256i bc_expand_avx2(__m256i c) {
+    const __m256i m5 = _mm256_set1_epi32(31), m6 = _mm256_set1_epi32(63);
+    __m256i r = _mm256_and_si256(_mm256_srli_epi32(c, 11), m5);
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(c, 5), m6);
+    __m256i b = _mm256_and_si256(c, m5);
+    r = _mm256_or_si256(_mm256_slli_epi32(r, 3), _mm256_srli_epi32(r, 2));
+    g = _mm256_or_si256(_mm256_slli_epi32(g, 2), _mm256_srli_epi32(g, 4));
+    b = _mm256_or_si256(_mm256_slli_epi32(b, 3), _mm256_srli_epi32(b, 2));
+    return _mm256_or_si256(_mm256_or_si256(_mm256_slli_epi32(r, 16), _mm256_slli_epi32(g, 8)), b);
+}
+
+// 8 个 BC 颜色块的解码：lo 为两个端点，sel 为各像素的 2 位下标，结果与 bc_colors 相同。
+// 插值在 16 位通道上计算，红蓝在同一个 32 位整数里，除以 3 为乘 0xaaab 取高 17 位
+TARGET_AVX2 FORCE_INLINE __m256i bc_decode_avx2(__m256i lo, __m256i sel, int bc3) {
+    const __m256i mrb = _mm256_set1_epi32(0xff00ff), low = _mm256_set1_epi32(255);
+    const __m256i third = _mm256_set1_epi16((short)0xaaab);
+    __m256i c0 = _mm256_and_si256(lo, _mm256_set1_epi32(0xffff)), c1 = _mm256_srli_epi32(lo, 16);
+    __m256i a = bc_expand_avx2(c0), b = bc_expand_avx2(c1);
+    __m256i four = bc3? _mm256_set1_epi32(-1) : _mm256_cmpgt_epi32(c0, c1);
+    __m256i arb = _mm256_and_si256(a, mrb), ag = _mm256_and_si256(_mm256_srli_epi32(a, 8), low);
+    __m256i brb = _mm256_and_si256(b, mrb), bg = _mm256_and_si256(_mm256_srli_epi32(b, 8), low);
+    __m256i rb2 = _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_add_epi16(_mm256_add_epi16(arb, arb), brb), third), 1);
+    __m256i g2 = _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_add_epi16(_mm256_add_epi16(ag, ag), bg), third), 1);
+    __m256i rb3 = _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_add_epi16(_mm256_add_epi16(brb, brb), arb), third), 1);
+    __m256i g3 = _mm256_srli_epi16(_mm256_mulhi_epu16(_mm256_add_epi16(_mm256_add_epi16(bg, bg), ag), third), 1);
+    __m256i half = _mm256_or_si256(_mm256_srli_epi16(_mm256_add_epi16(arb, brb), 1), 
+        _mm256_slli_epi32(_mm256_srli_epi16(_mm256_add_epi16(ag, bg), 1), 8));
+    __m256i m2 = _mm256_blendv_epi8(half, _mm256_or_si256(rb2, _mm256_slli_epi32(g2, 8)), four);
+    __m256i m3 = _mm256_and_si256(_mm256_or_si256(rb3, _mm256_slli_epi32(g3, 8)), four);
+    __m256i cc = _mm256_blendv_epi8(a, b, _mm256_cmpeq_epi32(sel, _mm256_set1_epi32(1)));
+    cc = _mm256_blendv_epi8(cc, m2, _mm256_cmpeq_epi32(sel, _mm256_set1_epi32(2)));
+    return _mm256_blendv_epi8(cc, m3, _mm256_cmpeq_epi32(sel, _mm256_set1_epi32(3)));
+}
+
+// 8 个纹素 (tx, ty) 的 texel_read，只读取 mask 中的像素。RGB32 的高 8 位留给调用者去掉
+TARGET_AVX2 FORCE_INLINE __m256i texel_fetch_avx2(const texture_level_t *t, 
+    __m256i tx, __m256i ty, __m256i mask) {
+    const __m256i zero = _mm256_setzero_si256(), pitch = _mm256_set1_epi32((int)t->pitch);
+    const __m256i three = _mm256_set1_epi32(3);
+    __m256i off, lo, hi, sel;
+    int bc3;
+    if (t->format == TEXTURE_RGB32) {
+        return _mm256_mask_i32gather_epi32(zero, (const int*)t->bits, 
+            _mm256_add_epi32(texel_row_avx2(t, ty), texel_col_avx2(t, tx)), mask, 4);
+    }
+    if (t->format == TEXTURE_P8) {
+        // gather 一次读 4 字节，这里读取包含该字节的对齐的 4 字节：对齐的读取不会跨页，
+        // 不会因为最后一个纹素之后的 3 个字节越过映射或分配的末尾而出错
+        const int *base = (const int*)((size_t)t->data & ~(size_t)3);
+        __m256i index;
+        off = _mm256_add_epi32(_mm256_set1_epi32((int)((size_t)t->data & 3)), 
+            _mm256_add_epi32(_mm256_mullo_epi32(ty, pitch), tx));
+        lo = _mm256_mask_i32gather_epi32(zero, base, _mm256_srai_epi32(off, 2), mask, 4);
+        index = _mm256_and_si256(_mm256_srlv_epi32(lo, 
+            _mm256_slli_epi32(_mm256_and_si256(off, three), 3)), _mm256_set1_epi32(255));
+        return _mm256_mask_i32gather_epi32(zero, (const int*)t->palette, index, mask, 4);
+    }
+    bc3 = (t->format == TEXTURE_BC3);
+    off = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_srai_epi32(ty, 2), pitch), 
+        _mm256_sll_epi32(_mm256_srai_epi32(tx, 2), _mm_cvtsi32_si128(bc3? 4 : 3)));
+    lo = _mm256_mask_i32gather_epi32(zero, (const int*)(t->data + (bc3? 8 : 0)), off, mask, 1);
+    hi = _mm256_mask_i32gather_epi32(zero, (const int*)(t->data + (bc3? 12 : 4)), off, mask, 1);
+    sel = _mm256_add_epi32(_mm256_slli_epi32(_mm256_and_si256(ty, three), 3), 
+        _mm256_slli_epi32(_mm256_and_si256(tx, three), 1));
+    sel = _mm256_and_si256(_mm256_srlv_epi32(hi, sel), three);
+    return bc_decode_avx2(lo, sel, bc3);
+}
+
+// 8 个 32 位整数之和
+TARGET_AVX2 FORCE_INLINE int lane_sum_avx2(__m256i v) {
+    __m128i s = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(1, 0, 3, 2)));
+    s = _mm_add_epi32(s, _mm_shuffle_epi32(s, _MM_SHUFFLE(2, 3, 0, 1)));
+    return _mm_cvtsi128_si32(s);
+}
+
+// 8 个像素的 depth16
+TARGET_AVX2 FORCE_INLINE __m256i depth16_avx2(__m256 rhw) {
+    __m256i d = _mm256_cvttps_epi32(_mm256_mul_ps(rhw, _mm256_set1_ps(DEPTH16_SCALE)));
+    return _mm256_min_epi32(_mm256_max_epi32(d, _mm256_setzero_si256()), _mm256_set1_epi32(65535));
+}
+
+// 读取 n 个 16 位深度（不足 8 个时其余为 0）。AVX2 没有 16 位的掩码读写，
+// 尾部按 32 位读取成对的深度，奇数个时最后一个单独读取，不会越过 zs + n
+TARGET_AVX2 FORCE_INLINE __m128i depth16_load_avx2(const IUINT16 *zs, int n) {
+    const __m128i lane = _mm_set_epi32(3, 2, 1, 0), half = _mm_set1_epi32(n >> 1);
+    __m128i v;
+    if (n >= 8) return _mm_loadu_si128((const __m128i*)zs);
+    v = _mm_maskload_epi32((const int*)zs, _mm_cmpgt_epi32(half, lane));
+    if (n & 1) v = _mm_blendv_epi8(v, _mm_set1_epi32(zs[n - 1]), _mm_cmpeq_epi32(half, lane));
+    return v;
+}
+
+// 写入 n 个 16 位深度，同样不会越过 zs + n
+TARGET_AVX2 FORCE_INLINE void depth16_store_avx2(IUINT16 *zs, int n, __m128i v) {
+    const __m128i lane = _mm_set_epi32(3, 2, 1, 0), half = _mm_set1_epi32(n >> 1);
+    if (n >= 8) {
+        _mm_storeu_si128((__m128i*)zs, v);
+        return;
+    }
+    _mm_maskstore_epi32((int*)zs, _mm_cmpgt_epi32(half, lane), v);
+    if (n & 1) {
+        __m256i last = _mm256_permutevar8x32_epi32(_mm256_castsi128_si256(v), 
+            _mm256_castsi128_si256(half));
+        zs[n - 1] = (IUINT16)_mm_cvtsi128_si32(_mm256_castsi256_si128(last));
+    }
+}
+
+// 8 个像素的深度测试，返回 live 中通过测试的通道。16 位深度时 d、z 返回像素和
+// 缓存中的深度值，供 depth_write_avx2 使用
+TARGET_AVX2 FORCE_INLINE __m256i depth_test_avx2(void *zbuffer, int x, int end, 
+    __m256 rhw, __m256i live, __m256i *d, __m256i *z, const int flags) {
+    if (flags & SPAN_DEPTH16) {
+        *d = depth16_avx2(rhw);
+        *z = _mm256_cvtepu16_epi32(depth16_load_avx2((const IUINT16*)zbuffer + x, end - x));
+        return _mm256_andnot_si256(_mm256_cmpgt_epi32(*z, *d), live);
+    }
+    return _mm256_and_si256(live, _mm256_castps_si256(_mm256_cmp_ps(rhw, 
+        _mm256_maskload_ps((const float*)zbuffer + x, live), _CMP_GE_OQ)));
+}
+
+// 写入 depth_test_avx2 中通过测试的像素的深度
+TARGET_AVX2 FORCE_INLINE void depth_write_avx2(void *zbuffer, int x, int end, 
+    __m256 rhw, __m256i mask, __m256i d, __m256i z, const int flags) {
+    if (flags & SPAN_DEPTH16) {
+        __m256i v = _mm256_blendv_epi8(z, d, mask);
+        depth16_store_avx2((IUINT16*)zbuffer + x, end - x, 
+            _mm_packus_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1)));
+        return;
+    }
+    _mm256_maskstore_ps((float*)zbuffer + x, mask, rhw);
+}
+
+// AVX2 纹理内核：一次处理 8 个像素，透视校正、纹理坐标钳制、gather 读取纹理、
+// 乘光照、深度比较与掩码写入均为向量运算，运算顺序与标量内核相同，结果逐位一致。
+// 写入的像素数按通道累加（掩码为 -1），结束时求和
+TARGET_AVX2 FORCE_INLINE int span_texture_avx2(const sampler_t *sampler, 
+    IUINT32 *framebuffer, void *zbuffer, const scanline_t *scanline, 
+    int x, int end, const int flags) {
+    const texture_level_t *t = sampler->level;
+    const vertex_t *base = &scanline->v, *step = &scanline->step;
+    const __m256i lane = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m256 brhw = _mm256_set1_ps(base->rhw), srhw = _mm256_set1_ps(step->rhw);
+    const __m256 bu = _mm256_set1_ps(base->tc.u), su = _mm256_set1_ps(step->tc.u);
+    const __m256 bv = _mm256_set1_ps(base->tc.v), sv = _mm256_set1_ps(step->tc.v);
+    const __m256 maxu = _mm256_set1_ps(t->max_u), maxv = _mm256_set1_ps(t->max_v);
+    const __m256 half = _mm256_set1_ps(0.5f), one = _mm256_set1_ps(1.0f);
+    const __m256 light = _mm256_set1_ps(base->light);
+    const __m256i tw = _mm256_set1_epi32(t->width - 1);
+    const __m256i th = _mm256_set1_epi32(t->height - 1);
+    const __m256i zero = _mm256_setzero_si256(), low = _mm256_set1_epi32(255);
+    const __m256i rgb = _mm256_set1_epi32(0xffffff);
+    __m256i written = _mm256_setzero_si256(), d = written, z = written;
+    for (; x < end; x += 8) {
+        __m256 n = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(x - scanline->x), lane));
+        __m256 rhw = _mm256_add_ps(brhw, _mm256_mul_ps(srhw, n));
+        __m256i live = _mm256_cmpgt_epi32(_mm256_set1_epi32(end - x), lane);
+        __m256i mask = depth_test_avx2(zbuffer, x, end, rhw, live, &d, &z, flags);
+        __m256 w, u, v;
+        __m256i tx, ty, cc;
+        if (_mm256_testz_si256(mask, mask)) continue;
+        w = _mm256_div_ps(one, rhw);
+        u = _mm256_mul_ps(_mm256_add_ps(bu, _mm256_mul_ps(su, n)), w);
+        v = _mm256_mul_ps(_mm256_add_ps(bv, _mm256_mul_ps(sv, n)), w);
+        tx = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(u, maxu), half));
+        ty = _mm256_cvttps_epi32(_mm256_add_ps(_mm256_mul_ps(v, maxv), half));
+        tx = _mm256_min_epi32(_mm256_max_epi32(tx, zero), tw);
+        ty = _mm256_min_epi32(_mm256_max_epi32(ty, zero), th);
+        cc = texel_fetch_avx2(t, tx, ty, mask);
+        cc = _mm256_and_si256(cc, rgb);
+        if (flags & SPAN_LIT) {
+            __m256i r = _mm256_cvttps_epi32(_mm256_mul_ps(
+                _mm256_cvtepi32_ps(_mm256_srli_epi32(cc, 16)), light));
+            __m256i g = _mm256_cvttps_epi32(_mm256_mul_ps(
+                _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(cc, 8), low)), light));
+            __m256i b = _mm256_cvttps_epi32(_mm256_mul_ps(
+                _mm256_cvtepi32_ps(_mm256_and_si256(cc, low)), light));
+            cc = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(r, 16), 
+                _mm256_slli_epi32(g, 8)), b);
+        }
+        _mm256_maskstore_epi32((int*)framebuffer + x, mask, cc);
+        if (flags & SPAN_ZWRITE) depth_write_avx2(zbuffer, x, end, rhw, mask, d, z, flags);
+        written = _mm256_sub_epi32(written, mask);
+    }
+    return lane_sum_avx2(written);
+}
+
+// 8 个像素的 texel_lerp，w 为各自的权重
+TARGET_AVX2 FORCE_INLINE __m256i texel_lerp_avx2(__m256i c1, __m256i c2, __m256i w) {
+    const __m256i mrb = _mm256_set1_epi32(0xff00ff), mg = _mm256_set1_epi32(0xff00);
+    __m256i iw = _mm256_sub_epi32(_mm256_set1_epi32(256), w);
+    __m256i rb = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(c1, mrb), iw), 
+        _mm256_mullo_epi32(_mm256_and_si256(c2, mrb), w));
+    __m256i g = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_and_si256(c1, mg), iw), 
+        _mm256_mullo_epi32(_mm256_and_si256(c2, mg), w));
+    return _mm256_or_si256(_mm256_and_si256(_mm256_srli_epi32(rb, 8), mrb), 
+        _mm256_and_si256(_mm256_srli_epi32(g, 8), mg));
+}
+
+// 8 个像素的 texture_read_bilinear：u、v 为透视校正后的纹理坐标，只读取 mask 中的像素
+TARGET_AVX2 FORCE_INLINE __m256i texture_bilinear_avx2(const texture_level_t *t, 
+    __m256 u, __m256 v, __m256i mask) {
+    const int *tex = (const int*)t->bits;
+    const __m256 maxu = _mm256_set1_ps(t->max_u), maxv = _mm256_set1_ps(t->max_v);
+    const __m256 zero = _mm256_setzero_ps(), scale = _mm256_set1_ps(256.0f);
+    const __m256i one = _mm256_set1_epi32(1), none = _mm256_setzero_si256();
+    __m256i x0, y0, x1, y1, wx, wy, r0, r1, k0, k1, c00, c01, c10, c11;
+    u = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(u, maxu), zero), maxu);
+    v = _mm256_min_ps(_mm256_max_ps(_mm256_mul_ps(v, maxv), zero), maxv);
+    x0 = _mm256_cvttps_epi32(u);
+    y0 = _mm256_cvttps_epi32(v);
+    wx = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(u, _mm256_cvtepi32_ps(x0)), scale));
+    wy = _mm256_cvttps_epi32(_mm256_mul_ps(_mm256_sub_ps(v, _mm256_cvtepi32_ps(y0)), scale));
+    x1 = _mm256_min_epi32(_mm256_add_epi32(x0, one), _mm256_set1_epi32(t->width - 1));
+    y1 = _mm256_min_epi32(_mm256_add_epi32(y0, one), _mm256_set1_epi32(t->height - 1));
+    if (t->format != TEXTURE_RGB32) {
+        c00 = texel_fetch_avx2(t, x0, y0, mask);
+        c01 = texel_fetch_avx2(t, x1, y0, mask);
+        c10 = texel_fetch_avx2(t, x0, y1, mask);
+        c11 = texel_fetch_avx2(t, x1, y1, mask);
+        return texel_lerp_avx2(texel_lerp_avx2(c00, c01, wx), texel_lerp_avx2(c10, c11, wx), wy);
+    }
+    r0 = texel_row_avx2(t, y0);
+    r1 = texel_row_avx2(t, y1);
+    k0 = texel_col_avx2(t, x0);
+    k1 = texel_col_avx2(t, x1);
+    c00 = _mm256_mask_i32gather_epi32(none, tex, _mm256_add_epi32(r0, k0), mask, 4);
+    c01 = _mm256_mask_i32gather_epi32(none, tex, _mm256_add_epi32(r0, k1), mask, 4);
+    c10 = _mm256_mask_i32gather_epi32(none, tex, _mm256_add_epi32(r1, k0), mask, 4);
+    c11 = _mm256_mask_i32gather_epi32(none, tex, _mm256_add_epi32(r1, k1), mask, 4);
+    return texel_lerp_avx2(texel_lerp_avx2(c00, c01, wx), texel_lerp_avx2(c10, c11, wx), wy);
+}
+
+// AVX2 双线性 / 三线性纹理内核：每个像素 4 次（三线性 8 次）gather，
+// 权重与混合使用与标量 texel_lerp 相同的整数运算，结果逐位一致
+TARGET_AVX2 FORCE_INLINE int span_filter_avx2(const sampler_t *sampler, 
+    IUINT32 *framebuffer, void *zbuffer, const scanline_t *scanline, 
+    int x, int end, const int flags) {
+    const vertex_t *base = &scanline->v, *step = &scanline->step;
+    const int blend = (flags & SPAN_TRILINEAR)? sampler->blend : 0;
+    const __m256i lane = _mm256_set_epi32(7, 6, 5, 4, 3, 2, 1, 0);
+    const __m256 brhw = _mm256_set1_ps(base->rhw), srhw = _mm256_set1_ps(step->rhw);
+    const __m256 bu = _mm256_set1_ps(base->tc.u), su = _mm256_set1_ps(step->tc.u);
+    const __m256 bv = _mm256_set1_ps(base->tc.v), sv = _mm256_set1_ps(step->tc.v);
+    const __m256 one = _mm256_set1_ps(1.0f), light = _mm256_set1_ps(base->light);
+    const __m256i low = _mm256_set1_epi32(255), wl = _mm256_set1_epi32(blend);
+    __m256i written = _mm256_setzero_si256(), d = written, z = written;
+    for (; x < end; x += 8) {
+        __m256 n = _mm256_cvtepi32_ps(_mm256_add_epi32(_mm256_set1_epi32(x - scanline->x), lane));
+        __m256 rhw = _mm256_add_ps(brhw, _mm256_mul_ps(srhw, n));
+        __m256i live = _mm256_cmpgt_epi32(_mm256_set1_epi32(end - x), lane);
+        __m256i mask = depth_test_avx2(zbuffer, x, end, rhw, live, &d, &z, flags);
+        __m256 w, u, v;
+        __m256i cc;
+        if (_mm256_testz_si256(mask, mask)) continue;
+        w = _mm256_div_ps(one, rhw);
+        u = _mm256_mul_ps(_mm256_add_ps(bu, _mm256_mul_ps(su, n)), w);
+        v = _mm256_mul_ps(_mm256_add_ps(bv, _mm256_mul_ps(sv, n)), w);
+        cc = texture_bilinear_avx2(sampler->level, u, v, mask);
+        if (blend > 0) cc = texel_lerp_avx2(cc, texture_bilinear_avx2(sampler->level + 1, u, v, mask), wl);
+        if (flags & SPAN_LIT) {
+            __m256i r = _mm256_cvttps_epi32(_mm256_mul_ps(
+                _mm256_cvtepi32_ps(_mm256_srli_epi32(cc, 16)), light));
+            __m256i g = _mm256_cvttps_epi32(_mm256_mul_ps(
+                _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(cc, 8), low)), light));
+            __m256i b = _mm256_cvttps_epi32(_mm256_mul_ps(
+                _mm256_cvtepi32_ps(_mm256_and_si256(cc, low)), light));
+            cc = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(r, 16), 
+                _mm256_slli_epi32(g, 8)), b);
+        }
+        _mm256_maskstore_epi32((int*)framebuffer + x, mask, cc);
+        if (flags & SPAN_ZWRITE) depth_write_avx2(zbuffer, x, end, rhw, mask, d, z, flags);
+        written = _mm256_sub_epi32(written, mask);
+    }
+    return lane_sum_avx2(written);
+}
+
+// 4 个纹素的 texel_row / texel_col
+TARGET_SSE41 FORCE_INLINE __m128i morton_spread_sse41(__m128i x) {
+    x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 8)), _mm_set1_epi32(0x00ff00ff));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 4)), _mm_set1_epi32(0x0f0f0f0f));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 2)), _mm_set1_epi32(0x33333333));
+    x = _mm_and_si128(_mm_or_si128(x, _mm_slli_epi32(x, 1)), _mm_set1_epi32(0x55555555));
+    return x;
+}
+
+TARGET_SSE41 FORCE_INLINE __m128i texel_row_sse41(const texture_level_t *t, __m128i y) {
+    const __m128i pitch = _mm_set1_epi32((int)t->pitch);
+    const __m128i s = _mm_cvtsi32_si128(t->tile_shift);
+    __m128i lo;
+    if (t->layout == TEXTURE_LINEAR) return _mm_mullo_epi32(y, pitch);
+    lo = _mm_and_si128(y, _mm_set1_epi32((1 << t->tile_shift) - 1));
+    lo = (t->layout == TEXTURE_MORTON)? _mm_slli_epi32(morton_spread_sse41(lo), 1) : 
+        _mm_sll_epi32(lo, s);
+    return _mm_add_epi32(_mm_mullo_epi32(_mm_srl_epi32(y, s), pitch), lo);
+}
+
+TARGET_SSE41 FORCE_INLINE __m128i texel_col_sse41(const texture_level_t *t, __m128i x) {
+    const __m128i s = _mm_cvtsi32_si128(t->tile_shift);
+    __m128i lo;
+    if (t->layout == TEXTURE_LINEAR) return x;
+    lo = _mm_and_si128(x, _mm_set1_epi32((1 << t->tile_shift) - 1));
+    if (t->layout == TEXTURE_MORTON) lo = morton_spread_sse41(lo);
+    return _mm_add_epi32(_mm_sll_epi32(_mm_srl_epi32(x, s), 
+        _mm_cvtsi32_si128(t->tile_shift * 2)), lo);
+}
+
+// SSE4.1 纹理内核：一次处理 4 个像素，没有 gather 指令，纹理逐个读取；
+// 不足 4 个像素的尾部交给标量内核
+TARGET_SSE41 FORCE_INLINE int span_texture_sse41(const sampler_t *sampler, 
+    IUINT32 *framebuffer, void *zbuffer, const scanline_t *scanline, 
+    int x, int end, const int flags) {
+    const texture_level_t *t = sampler->level;
+    const vertex_t *base = &scanline->v, *step = &scanline->step;
+    const __m128i lane = _mm_set_epi32(3, 2, 1, 0);
+    const __m128 brhw = _mm_set1_ps(base->rhw), srhw = _mm_set1_ps(step->rhw);
+    const __m128 bu = _mm_set1_ps(base->tc.u), su = _mm_set1_ps(step->tc.u);
+    const __m128 bv = _mm_set1_ps(base->tc.v), sv = _mm_set1_ps(step->tc.v);
+    const __m128 maxu = _mm_set1_ps(t->max_u), maxv = _mm_set1_ps(t->max_v);
+    const __m128 half = _mm_set1_ps(0.5f), one = _mm_set1_ps(1.0f);
+    const __m128 light = _mm_set1_ps(base->light);
+    const __m128i tw = _mm_set1_epi32(t->width - 1);
+    const __m128i th = _mm_set1_epi32(t->height - 1);
+    const __m128i zero = _mm_setzero_si128(), low = _mm_set1_epi32(255);
+    const __m128i rgb = _mm_set1_epi32(0xffffff);
+    __m128i written = _mm_setzero_si128();
+    for (; x + 4 <= end; x += 4) {
+        __m128 n = _mm_cvtepi32_ps(_mm_add_epi32(_mm_set1_epi32(x - scanline->x), lane));
+        __m128 rhw = _mm_add_ps(brhw, _mm_mul_ps(srhw, n));
+        __m128 z, mask, w, u, v;
+        __m128i tx, ty, cc, d, z16;
+        int index[4];
+        if (flags & SPAN_DEPTH16) {
+            d = _mm_cvttps_epi32(_mm_mul_ps(rhw, _mm_set1_ps(DEPTH16_SCALE)));
+            d = _mm_min_epi32(_mm_max_epi32(d, zero), _mm_set1_epi32(65535));
+            z16 = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i*)((IUINT16*)zbuffer + x)));
+            mask = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_max_epi32(d, z16), d));
+        }   else {
+            z = _mm_loadu_ps((float*)zbuffer + x);
+            mask = _mm_cmpge_ps(rhw, z);
+        }
+        if (_mm_movemask_ps(mask) == 0) continue;
+        w = _mm_div_ps(one, rhw);
+        u = _mm_mul_ps(_mm_add_ps(bu, _mm_mul_ps(su, n)), w);
+        v = _mm_mul_ps(_mm_add_ps(bv, _mm_mul_ps(sv, n)), w);
+        tx = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(u, maxu), half));
+        ty = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(v, maxv), half));
+        tx = _mm_min_epi32(_mm_max_epi32(tx, zero), tw);
+        ty = _mm_min_epi32(_mm_max_epi32(ty, zero), th);
+        _mm_storeu_si128((__m128i*)index, _mm_add_epi32(texel_row_sse41(t, ty), texel_col_sse41(t, tx)));
+        cc = _mm_set_epi32((int)t->bits[index[3]], (int)t->bits[index[2]],
+            (int)t->bits[index[1]], (int)t->bits[index[0]]);
+        cc = _mm_and_si128(cc, rgb);
+        if (flags & SPAN_LIT) {
+            __m128i r = _mm_cvttps_epi32(_mm_mul_ps(
+                _mm_cvtepi32_ps(_mm_srli_epi32(cc, 16)), light));
+            __m128i g = _mm_cvttps_epi32(_mm_mul_ps(
+                _mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(cc, 8), low)), light));
+            __m128i b = _mm_cvttps_epi32(_mm_mul_ps(
+                _mm_cvtepi32_ps(_mm_and_si128(cc, low)), light));
+            cc = _mm_add_epi32(_mm_add_epi32(_mm_slli_epi32(r, 16), _mm_slli_epi32(g, 8)), b);
+        }
+        _mm_storeu_si128((__m128i*)(framebuffer + x), _mm_blendv_epi8(
+            _mm_loadu_si128((const __m128i*)(framebuffer + x)), cc, _mm_castps_si128(mask)));
+        if ((flags & SPAN_ZWRITE) && (flags & SPAN_DEPTH16)) {
+            __m128i nz = _mm_blendv_epi8(z16, d, _mm_castps_si128(mask));
+            _mm_storel_epi64((__m128i*)((IUINT16*)zbuffer + x), _mm_packus_epi32(nz, nz));
+        }   else if (flags & SPAN_ZWRITE) {
+            _mm_storeu_ps((float*)zbuffer + x, _mm_blendv_ps(z, rhw, mask));
+        }
+        written = _mm_sub_epi32(written, _mm_castps_si128(mask));
+    }
+    written = _mm_add_epi32(written, _mm_shuffle_epi32(written, _MM_SHUFFLE(1, 0, 3, 2)));
+    written = _mm_add_epi32(written, _mm_shuffle_epi32(written, _MM_SHUFFLE(2, 3, 0, 1)));
+    if (x < end) return _mm_cvtsi128_si32(written) + 
+        span_kernel(sampler, framebuffer, zbuffer, scanline, x, end, flags | SPAN_TEXTURE);
+    return _mm_cvtsi128_si32(written);
+}
+
+#define SPAN_KERNEL_SIMD(name, body, target, flags) \
+    target int name(const sampler_t *sampler, IUINT32 *framebuffer, void *zbuffer, \
+        const scanline_t *scanline, int x, int end) { \
+        return body(sampler, framebuffer, zbuffer, scanline, x, end, flags); \
+    }
+
+// 每个 SIMD 内核也有 16 位深度的版本，名字加 _16
+#define SPAN_KERNELS_SIMD(name, body, target, flags) \
+    SPAN_KERNEL_SIMD(name, body, target, flags) \
+    SPAN_KERNEL_SIMD(name##_16, body, target, (flags) | SPAN_DEPTH16)
+
+#define SPAN_KERNEL_GROUP_SIMD(prefix, body, target, flags) \
+    SPAN_KERNELS_SIMD(prefix##_n, body, target, flags) \
+    SPAN_KERNELS_SIMD(prefix##_z, body, target, (flags) | SPAN_ZWRITE) \
+    SPAN_KERNELS_SIMD(prefix##_lit, body, target, (flags) | SPAN_LIT) \
+    SPAN_KERNELS_SIMD(prefix##_lit_z, body, target, (flags) | SPAN_LIT | SPAN_ZWRITE)
+
+SPAN_KERNEL_GROUP_SIMD(span_texture_sse41, span_texture_sse41, TARGET_SSE41, 0)
+SPAN_KERNEL_GROUP_SIMD(span_texture_avx2, span_texture_avx2, TARGET_AVX2, 0)
+SPAN_KERNEL_GROUP_SIMD(span_bilinear_avx2, span_filter_avx2, TARGET_AVX2, 0)
+SPAN_KERNEL_GROUP_SIMD(span_trilinear_avx2, span_filter_avx2, TARGET_AVX2, SPAN_TRILINEAR)
+
+span_kernel_t span_kernels_sse41[16] = {
+    span_color, span_texture_sse41_n, span_color, span_texture_sse41_lit,
+    span_color_z, span_texture_sse41_z, span_color_z, span_texture_sse41_lit_z,
+    span_color_16, span_texture_sse41_n_16, span_color_16, span_texture_sse41_lit_16,
+    span_color_z_16, span_texture_sse41_z_16, span_color_z_16, span_texture_sse41_lit_z_16,
+};
+
+span_kernel_t span_kernels_avx2[16] = {
+    span_color, span_texture_avx2_n, span_color, span_texture_avx2_lit,
+    span_color_z, span_texture_avx2_z, span_color_z, span_texture_avx2_lit_z,
+    span_color_16, span_texture_avx2_n_16, span_color_16, span_texture_avx2_lit_16,
+    span_color_z_16, span_texture_avx2_z_16, span_color_z_16, span_texture_avx2_lit_z_16,
+};
+
+// 双线性 / 三线性没有 SSE4.1 版本（没有 gather，逐个读取 16 个纹素并不比标量快）
+span_kernel_t span_kernels_bilinear_avx2[8] = {
+    span_bilinear_avx2_n, span_bilinear_avx2_lit, span_bilinear_avx2_z, span_bilinear_avx2_lit_z,
+    span_bilinear_avx2_n_16, span_bilinear_avx2_lit_16, 
+    span_bilinear_avx2_z_16, span_bilinear_avx2_lit_z_16,
+};
+
+span_kernel_t span_kernels_trilinear_avx2[8] = {
+    span_trilinear_avx2_n, span_trilinear_avx2_lit, span_trilinear_avx2_z, span_trilinear_avx2_lit_z,
+    span_trilinear_avx2_n_16, span_trilinear_avx2_lit_16, 
+    span_trilinear_avx2_z_16, span_trilinear_avx2_lit_z_16,
+};
+#endif
+
+// 为三角形选择扫描线内核：纹理优先于颜色，lit 为零时三个顶点的光照均为 1
+span_kernel_t span_kernel_select(const device_t *device, int render_state, int lit) {
+    int flags = 0;
+    if (render_state & RENDER_STATE_TEXTURE) flags |= SPAN_TEXTURE;
+    if (lit) flags |= SPAN_LIT;
+    if (device->depth_write) flags |= SPAN_ZWRITE;
+    if (device->depth_format == DEPTH_UNORM16) flags |= SPAN_DEPTH16;
+    if ((flags & SPAN_TEXTURE) && device->tex_filter >= TEXTURE_BILINEAR) {
+        int trilinear = (device->tex_filter == TEXTURE_TRILINEAR);
+#ifdef MINI3D_X86
+        if (span_simd == SIMD_AVX2) {
+            return trilinear? span_kernels_trilinear_avx2[flags >> 1] : 
+                span_kernels_bilinear_avx2[flags >> 1];
+        }
+#endif
+        return trilinear? span_kernels_trilinear[flags >> 1] : span_kernels_bilinear[flags >> 1];
+    }
+#ifdef MINI3D_X86
+    if (span_simd == SIMD_AVX2) return span_kernels_avx2[flags];
+    // SSE4.1 内核逐个读取 32 位纹素，P8 / BC 格式使用标量内核
+    if (span_simd == SIMD_SSE41 && device->tex_levels[0].format == TEXTURE_RGB32) 
+        return span_kernels_sse41[flags];
+#endif
+    return span_kernels[flags];
+}
+
+//---------------------------------------------------------------------
+// 分层深度：zbuffer 中 rhw 越大越近，并且只会增大（直到 device_clear），
+// 所以每个 8x8 块记录的最小 rhw 即使过时也仍然是下界。一段像素的最大 rhw
+// 小于所在块的最小 rhw 时，其中每个像素都不能通过深度测试，可以整段跳过。
+// 16 位深度时比较的是 depth_key 换算后的整数深度，同样随 rhw 单调
+//---------------------------------------------------------------------
+
+// 查询块 (tx, ty) 的最小深度值，块被写过时重新计算
+float device_hiz_tile(device_t *device, int tx, int ty) {
+    int index = ty * device->hiz_pitch + tx;
+    if (device->hiz_state[index] == TILE_DIRTY) {
+        int x0 = tx << 3, y0 = ty << 3, x, y;
+        int x1 = (x0 + 8 < device->width)? x0 + 8 : device->width;
+        int y1 = (y0 + 8 < device->height)? y0 + 8 : device->height;
+        float z;
+        if (device->depth_format == DEPTH_UNORM16) {
+            int d = 65535;
+            y = y0;
+#ifdef MINI3D_SSE2
+            if (x1 - x0 == 8) {
+                // SSE2 只有有符号的 16 位 min，先把无符号数平移到有符号范围
+                const __m128i bias = _mm_set1_epi16((short)0x8000);
+                __m128i m = _mm_set1_epi16(0x7fff);
+                for (y = y0; y < y1; y++) {
+                    const IUINT16 *zbuffer = (const IUINT16*)device->zbuffer[y];
+                    __m128i v = _mm_loadu_si128((const __m128i*)(zbuffer + x0));
+                    m = _mm_min_epi16(m, _mm_xor_si128(v, bias));
+                }
+                m = _mm_min_epi16(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(1, 0, 3, 2)));
+                m = _mm_min_epi16(m, _mm_shuffle_epi32(m, _MM_SHUFFLE(2, 3, 0, 1)));
+                m = _mm_min_epi16(m, _mm_srli_epi32(m, 16));
+                d = _mm_cvtsi128_si32(_mm_xor_si128(m, bias)) & 0xffff;
+            }
+#endif
+            for (; y < y1; y++) {
+                const IUINT16 *zbuffer = (const IUINT16*)device->zbuffer[y];
+                for (x = x0; x < x1; x++) {
+                    if (zbuffer[x] < d) d = zbuffer[x];
+                }
+            }
+            device->hiz[index] = (float)d;
+            device->hiz_state[index] = TILE_CLEAN;
+            return device->hiz[index];
+        }
+        z = ((const float*)device->zbuffer[y0])[x0];
+        for (y = y0; y < y1; y++) {
+            const float *zbuffer = (const float*)device->zbuffer[y];
+#ifdef MINI3D_SSE2
+            if (x1 - x0 == 8) {
+                __m128 m = _mm_min_ps(_mm_loadu_ps(zbuffer + x0), _mm_loadu_ps(zbuffer + x0 + 4));
+                m = _mm_min_ps(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(1, 0, 3, 2)));
+                m = _mm_min_ss(m, _mm_shuffle_ps(m, m, _MM_SHUFFLE(2, 3, 0, 1)));
+                if (_mm_cvtss_f32(m) < z) z = _mm_cvtss_f32(m);
+                continue;
+            }
+#endif
+            for (x = x0; x < x1; x++) {
+                if (zbuffer[x] < z) z = zbuffer[x];
+            }
+        }
+        device->hiz[index] = z;
+        device->hiz_state[index] = TILE_CLEAN;
+    }
+    return device->hiz[index];
+}
+
+// 清零矩形 r 内 device_clear 之后还没有用过的块，图元读写深度之前调用。
+// 同一行中连续的块合并为一次 memset
+void device_depth_prepare(device_t *device, const rect_t *r) {
+    int tx, ty, y, end = (r->x1 - 1) >> 3;
+    size_t size = (device->depth_format == DEPTH_UNORM16)? sizeof(IUINT16) : sizeof(float);
+    for (ty = r->y0 >> 3; ty <= (r->y1 - 1) >> 3; ty++) {
+        unsigned char *state = device->hiz_state + ty * device->hiz_pitch;
+        float *hiz = device->hiz + ty * device->hiz_pitch;
+        int y1 = (ty * 8 + 8 < device->height)? ty * 8 + 8 : device->height;
+        for (tx = r->x0 >> 3; tx <= end; tx++) {
+            if (state[tx] == TILE_STALE) {
+                int t0 = tx, x0, x1;
+                for (; tx <= end && state[tx] == TILE_STALE; tx++) {
+                    state[tx] = TILE_CLEAN;
+                    hiz[tx] = 0.0f;
+                }
+                x0 = t0 << 3;
+                x1 = (tx << 3 < device->width)? tx << 3 : device->width;
+                for (y = ty << 3; y < y1; y++) 
+                    memset((char*)device->zbuffer[y] + size * x0, 0, size * (x1 - x0));
+            }
+        }
+    }
+}
+
+// 第 y 行 [x0, x1) 的像素写入了深度
+void device_hiz_touch(device_t *device, int y, int x0, int x1) {
+    unsigned char *state = device->hiz_state + (y >> 3) * device->hiz_pitch;
+    int tx;
+    for (tx = x0 >> 3; tx <= (x1 - 1) >> 3; tx++) state[tx] = TILE_DIRTY;
+}
+
+#define HIZ_VISIBLE     0       // 矩形内没有块能遮挡
+#define HIZ_PARTIAL     1       // 部分块遮挡，需要逐块、逐段检查
+#define HIZ_OCCLUDED    2       // 所有块都遮挡
+
+#define HIZ_MIN_AREA    1024    // 包围盒小于该像素数的三角形不做分层深度检查
+
+// 用矩形 r 内各块的最小深度同最近深度 rhw 比较
+int device_hiz_classify(device_t *device, const rect_t *r, float rhw) {
+    int tx, ty, occluded = 0, visible = 0;
+    rhw = depth_key(device, rhw);
+    for (ty = r->y0 >> 3; ty <= (r->y1 - 1) >> 3; ty++) {
+        for (tx = r->x0 >> 3; tx <= (r->x1 - 1) >> 3; tx++) {
+            if (rhw < device_hiz_tile(device, tx, ty)) occluded = 1;
+            else visible = 1;
+            if (occluded && visible) return HIZ_PARTIAL;
+        }
+    }
+    return occluded? HIZ_OCCLUDED : HIZ_VISIBLE;
+}
+
+// 绘制扫描线中位于 [x0, x1) 之内的部分。hiz 非零时按 8 像素对齐分段，
+// 段内 rhw 线性变化，最大值在两端之一，与内核逐像素计算的值完全相同；
+// 被遮挡的段跳过，其余连续的段合并为一次内核调用。计数累加到 stats
+void device_draw_scanline(device_t *device, const scanline_t *scanline, int x0, int x1, 
+    span_kernel_t kernel, const sampler_t *sampler, int hiz, device_stats_t *stats) {
+    IUINT32 *framebuffer = device->framebuffer[scanline->y];
+    void *zbuffer = device->zbuffer[scanline->y];
+    int x = (scanline->x > x0)? scanline->x : x0;
+    int end = scanline->x + scanline->w;
+    if (end > x1) end = x1;
+    if (x >= end) return;
+    stats->spans++;
+    if (hiz) {
+        const float *row = device->hiz + (scanline->y >> 3) * device->hiz_pitch;
+        float base = scanline->v.rhw, step = scanline->step.rhw;
+        int start = x, a, b;
+        for (a = x; a < end; a = b) {
+            float r0 = base + step * (float)(a - scanline->x), r1;
+            b = (a & ~7) + 8;
+            if (b > end) b = end;
+            r1 = base + step * (float)(b - 1 - scanline->x);
+            if (depth_key(device, (r0 > r1)? r0 : r1) < row[a >> 3]) {
+                if (start < a) {
+                    stats->written += kernel(sampler, framebuffer, zbuffer, scanline, start, a);
+                    stats->tested += a - start;
+                }
+                start = b;
+            }
+        }
+        if (start < end) {
+            stats->written += kernel(sampler, framebuffer, zbuffer, scanline, start, end);
+            stats->tested += end - start;
+        }
+    }   else {
+        stats->written += kernel(sampler, framebuffer, zbuffer, scanline, x, end);
+        stats->tested += end - x;
+    }
+    if (device->depth_write && device->hiz_test) device_hiz_touch(device, scanline->y, x, end);
+}
+
+// 主渲染函数：绘制梯形位于 clip 之内的部分（clip 须在屏幕范围内）。
+// 覆盖的行为像素中心 j + 0.5 落在 [top, bottom) 之内的行，与 edge_step_t 的左右规则
+// 一起构成 top-left 填充规则。左右边从第一行起按整数步进，tri 提供属性平面；
+// mip 非零时每条扫描线按其中点（与 clip 无关）选择 mip 层
+void device_render_trap(device_t *device, const trapezoid_t *trap, const halfspace_t *tri,
+    const rect_t *clip, span_kernel_t kernel, int mip, int hiz, device_stats_t *stats) {
+    edge_step_t left, right;
+    scanline_t scanline;
+    sampler_t sampler;
+    texture_cache_t cache;
+    int j, top, bottom;
+    top = (trap->top + 7) >> 4;         // ceil((top - 8) / 16)
+    bottom = (trap->bottom + 7) >> 4;
+    if (top < clip->y0) top = clip->y0;
+    if (bottom > clip->y1) bottom = clip->y1;
+    if (top >= bottom) return;
+    device_sampler(device, &sampler, NULL, NULL, NULL, 0, 0);
+    sampler.cache = texture_cache_init(&cache, device);
+    edge_step_init(&left, &trap->left, top);
+    edge_step_init(&right, &trap->right, top);
+    for (j = top; j < bottom; j++, edge_step_next(&left), edge_step_next(&right)) {
+        if (left.x >= right.x || left.x >= clip->x1 || right.x <= clip->x0) continue;
+        trapezoid_init_scan_line(tri, &scanline, left.x, j, right.x - left.x);
+        if (mip) {
+            device_sampler(device, &sampler, &tri->u, &tri->v, &tri->rhw, 
+                (float)scanline.x + (float)scanline.w * 0.5f, (float)j + 0.5f);
+        }
+        device_draw_scanline(device, &scanline, clip->x0, clip->x1, kernel, &sampler, hiz, stats);
+    }
+}
+
+// 绘制 8x8 块中 [x0, x1) x [y0, y1) 的像素，full 表示整块都在三角形内部。
+// 边函数、rhw 与深度测试每次计算 4 个像素，通过测试的像素再逐个着色；
+// 16 位深度在算出 rhw 之后逐个比较
+void device_render_block(device_t *device, const halfspace_t *tri, int render_state,
+    const sampler_t *sampler, int x0, int y0, int x1, int y1, int full, device_stats_t *stats) {
+    static const char bits[16] = { 0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4 };
+    int unorm16 = (device->depth_format == DEPTH_UNORM16);
+    int x, y, i, k;
+    stats->spans += y1 - y0;
+    for (y = y0; y < y1; y++) {
+        IUINT32 *framebuffer = device->framebuffer[y];
+        float *zbuffer = (float*)device->zbuffer[y];
+        IUINT16 *zs = (IUINT16*)device->zbuffer[y];
+        float py = (float)y + 0.5f;
+        for (x = x0; x < x1; x += 4) {
+            float rhw[4];
+            int n = (x1 - x < 4)? x1 - x : 4, mask = 0, covered = 0;
+#ifdef MINI3D_SSE2
+            __m128 px = _mm_add_ps(_mm_set1_ps((float)x + 0.5f), _mm_set_ps(3, 2, 1, 0));
+            __m128 vy = _mm_set1_ps(py);
+            __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+            __m128 r, z;
+            if (!full) {
+                for (k = 0; k < 3; k++) {
+                    __m128 e = _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(tri->a[k]), px), 
+                        _mm_mul_ps(_mm_set1_ps(tri->b[k]), vy)), _mm_set1_ps(tri->c[k]));
+                    inside = _mm_and_ps(inside, tri->topleft[k]? 
+                        _mm_cmpge_ps(e, _mm_setzero_ps()) : _mm_cmpgt_ps(e, _mm_setzero_ps()));
+                }
+            }
+            r = _mm_add_ps(_mm_add_ps(_mm_set1_ps(tri->rhw.c), _mm_mul_ps(_mm_set1_ps(tri->rhw.dx), px)),
+                _mm_mul_ps(_mm_set1_ps(tri->rhw.dy), vy));
+            _mm_storeu_ps(rhw, r);
+            covered = _mm_movemask_ps(inside) & ((1 << n) - 1);
+            if (unorm16) {
+                for (i = 0; i < n; i++) {
+                    if (depth16(rhw[i]) >= zs[x + i]) mask |= 1 << i;
+                }
+                mask &= covered;
+            }   else {
+                if (n == 4) {
+                    z = _mm_loadu_ps(zbuffer + x);
+                }   else {
+                    float zz[4] = { 0, 0, 0, 0 };
+                    for (i = 0; i < n; i++) zz[i] = zbuffer[x + i];
+                    z = _mm_loadu_ps(zz);
+                }
+                mask = _mm_movemask_ps(_mm_and_ps(inside, _mm_cmpge_ps(r, z))) & ((1 << n) - 1);
+            }
+#else
+            for (i = 0; i < n; i++) {
+                float fx = (float)(x + i) + 0.5f;
+                int inside = 1;
+                for (k = 0; k < 3 && !full; k++) {
+                    float e = tri->a[k] * fx + tri->b[k] * py + tri->c[k];
+                    if (e < 0.0f || (e == 0.0f && !tri->topleft[k])) inside = 0;
+                }
+                rhw[i] = tri->rhw.c + tri->rhw.dx * fx + tri->rhw.dy * py;
+                if (inside) covered |= 1 << i;
+                if (inside && (unorm16? depth16(rhw[i]) >= zs[x + i] : rhw[i] >= zbuffer[x + i]))
+                    mask |= 1 << i;
+            }
+#endif
+            stats->tested += bits[covered];
+            stats->written += bits[mask];
+            for (i = 0; mask != 0; i++, mask >>= 1) {
+                if (mask & 1) {
+                    float fx = (float)(x + i) + 0.5f;
+                    float w = 1.0f / rhw[i];
+                    color_t color;
+                    texcoord_t tc;
+                    float light = tri->light.c + tri->light.dx * fx + tri->light.dy * py;
+                    tc.u = tri->u.c + tri->u.dx * fx + tri->u.dy * py;
+                    tc.v = tri->v.c + tri->v.dx * fx + tri->v.dy * py;
+                    color.r = tri->red.c + tri->red.dx * fx + tri->red.dy * py;
+                    color.g = tri->green.c + tri->green.dx * fx + tri->green.dy * py;
+                    color.b = tri->blue.c + tri->blue.dx * fx + tri->blue.dy * py;
+                    if (device->depth_write && unorm16) zs[x + i] = (IUINT16)depth16(rhw[i]);
+                    else if (device->depth_write) zbuffer[x + i] = rhw[i];
+                    framebuffer[x + i] = device_shade(sampler, render_state, w, &color, &tc, light);
+                }
+            }
+        }
+    }
+}
+
+// 边函数光栅化：按 8x8 对齐的块遍历包围盒，用块的角点整块剔除或整块接受，
+// 只有跨越边界的块才逐像素计算覆盖。块的划分与 clip 无关，分 tile 绘制时结果一致。
+// 使用 mip 时每块按块的中心选择 mip 层
+void device_render_halfspace(device_t *device, const halfspace_t *tri, 
+    const rect_t *clip, int render_state, int hiz, device_stats_t *stats) {
+    int x0 = (tri->bound.x0 > clip->x0)? tri->bound.x0 : clip->x0;
+    int y0 = (tri->bound.y0 > clip->y0)? tri->bound.y0 : clip->y0;
+    int x1 = (tri->bound.x1 < clip->x1)? tri->bound.x1 : clip->x1;
+    int y1 = (tri->bound.y1 < clip->y1)? tri->bound.y1 : clip->y1;
+    int mip = (render_state & RENDER_STATE_TEXTURE) && device->tex_filter != TEXTURE_NEAREST;
+    int bx, by, bx0, by0, bx1, by1, k;
+    sampler_t sampler;
+    texture_cache_t cache;
+    device_sampler(device, &sampler, NULL, NULL, NULL, 0, 0);
+    sampler.cache = texture_cache_init(&cache, device);
+    for (by = y0 & ~7; by < y1; by += 8) {
+        for (bx = x0 & ~7; bx < x1; bx += 8) {
+            int outside = 0, full = 1;
+            for (k = 0; k < 3; k++) {
+                // 块内像素中心的边函数极值在角点 (bx + 0.5 或 bx + 7.5) 取得
+                float a = tri->a[k], b = tri->b[k];
+                float e = a * ((float)bx + 0.5f) + b * ((float)by + 0.5f) + tri->c[k];
+                float emax = e + ((a > 0.0f)? a * 7.0f : 0.0f) + ((b > 0.0f)? b * 7.0f : 0.0f);
+                float emin = e + ((a < 0.0f)? a * 7.0f : 0.0f) + ((b < 0.0f)? b * 7.0f : 0.0f);
+                if (emax < 0.0f) outside = 1;
+                if (emin <= 0.0f) full = 0;
+            }
+            if (outside) continue;
+            bx0 = (bx > x0)? bx : x0, by0 = (by > y0)? by : y0;
+            bx1 = (bx + 8 < x1)? bx + 8 : x1, by1 = (by + 8 < y1)? by + 8 : y1;
+            if (hiz) {
+                // rhw 平面在块内像素中心的最大值在四个角之一，按 device_render_block 的顺序计算
+                float px0 = (float)bx0 + 0.5f, px1 = (float)bx1 - 0.5f;
+                float py0 = (float)by0 + 0.5f, py1 = (float)by1 - 0.5f;
+                float r0 = tri->rhw.c + tri->rhw.dx * px0 + tri->rhw.dy * py0;
+                float r1 = tri->rhw.c + tri->rhw.dx * px1 + tri->rhw.dy * py0;
+                float r2 = tri->rhw.c + tri->rhw.dx * px0 + tri->rhw.dy * py1;
+                float r3 = tri->rhw.c + tri->rhw.dx * px1 + tri->rhw.dy * py1;
+                r0 = (r0 > r1)? r0 : r1;
+                r2 = (r2 > r3)? r2 : r3;
+                r0 = depth_key(device, (r0 > r2)? r0 : r2);
+                if (r0 < device_hiz_tile(device, bx >> 3, by >> 3)) continue;
+            }
+            if (mip) {
+                device_sampler(device, &sampler, &tri->u, &tri->v, &tri->rhw, 
+                    (float)bx + 4.0f, (float)by + 4.0f);
+            }
+            device_render_block(device, tri, render_state, &sampler, bx0, by0, bx1, by1, full, stats);
+            if (device->depth_write && device->hiz_test) {
+                for (k = by0; k < by1; k++) device_hiz_touch(device, k, bx0, bx1);
+            }
+        }
+    }
+}
+
+
+//=====================================================================
+// 分块光栅化：三角形完成 setup 后按 tile 分箱，device_flush 时由线程池
+// 并行绘制。每个 tile 同一时刻只由一个线程绘制，该线程独占 tile 内的
+// framebuffer / zbuffer，因此不需要加锁；tile 内按提交顺序绘制，
+// 结果与立即绘制逐位一致
+//=====================================================================
+#define RASTER_TILE_SIZE    64      // 须为 8 的整数倍（边函数光栅化的块大小）
+
+typedef struct {
+    halfspace_t tri;            // 边函数与属性平面，梯形扫描线也从这些平面取属性
+    trapezoid_t traps[2];       // RASTERIZER_TRAPEZOID：三角形拆分得到的梯形
+    int ntrap;                  // 梯形数量，边函数光栅化时为 0 或 1
+    int rasterizer;             // 填充使用的光栅化方式
+    span_kernel_t kernel;       // 梯形扫描线使用的内核
+    int mip;                    // 梯形扫描线是否按 tri 的 u、v、rhw 平面选择 mip 层
+    int state;                  // 提交时的 render_state
+    IUINT32 color;              // 线框颜色
+    int line[6];                // 线框三个顶点的屏幕坐标 x, y
+    int edges;                  // 需要绘制的线框边，见 device_draw_screen_triangle
+    float max_rhw;              // 三个顶点中最大的 rhw（最近的深度）
+    rect_t bound;               // 屏幕包围盒，用于分箱
+}   raster_prim_t;
+
+typedef struct {
+    int *items;                 // 与该 tile 相交的图元序号，保持提交顺序
+    int count;
+    int capacity;
+}   raster_bin_t;
+
+typedef struct {
+    device_t *device;
+    thread_t thread;
+    device_stats_t stats;       // 本线程的光栅化计数，device_flush 结束时合并
+}   raster_worker_t;
+
+struct raster_pool_t {
+    int threads;                // 线程总数，包括调用 device_flush 的线程
+    int tiles_x, tiles_y;       // tile 网格大小
+    raster_bin_t *bins;         // 每个 tile 一个分箱
+    raster_prim_t *prims;       // 等待绘制的图元
+    int prim_count;
+    int prim_capacity;
+    raster_worker_t *workers;   // threads - 1 个工作线程
+    device_stats_t stats;       // 调用 device_flush 的线程的光栅化计数
+    mutex_t lock;
+    cond_t wake;                // 通知工作线程开始新的一批
+    cond_t done;                // 通知调用线程本批已经完成
+    int generation;             // 批次编号
+    int running;                // 本批次中仍在绘制的工作线程数
+    int quit;                   // 通知工作线程退出
+    volatile int next_tile;     // 下一个待领取的 tile
+};
+
+// 图元在矩形 r 内的像素上 rhw 的上界，用于分层深度剔除整个三角形。
+// 梯形按取整到 28.4 定点的顶点判断覆盖，rhw 却取自浮点顶点的平面，三角形外
+// 最多 1/32 像素处的外推值可以超过 max_rhw；再与平面在 r 四角像素中心的最大值
+// 取较小者，最后留出平面求值舍入的余量
+float raster_max_rhw(const raster_prim_t *prim, const rect_t *r) {
+    const plane_t *p = &prim->tri.rhw;
+    float dx = (p->dx < 0.0f)? -p->dx : p->dx, dy = (p->dy < 0.0f)? -p->dy : p->dy;
+    float bound = prim->max_rhw + (dx + dy) * (1.0f / 32.0f);
+    float px0 = (float)r->x0 + 0.5f, px1 = (float)r->x1 - 0.5f;
+    float py0 = (float)r->y0 + 0.5f, py1 = (float)r->y1 - 0.5f;
+    float r0 = p->c + p->dx * px0 + p->dy * py0;
+    float r1 = p->c + p->dx * px1 + p->dy * py0;
+    float r2 = p->c + p->dx * px0 + p->dy * py1;
+    float r3 = p->c + p->dx * px1 + p->dy * py1;
+    r0 = (r0 > r1)? r0 : r1;
+    r2 = (r2 > r3)? r2 : r3;
+    r0 = (r0 > r2)? r0 : r2;
+    if (r0 < bound) bound = r0;
+    return bound * 1.001f;
+}
+
+// 绘制图元位于 clip 之内的部分，扫描线和像素的计数累加到 stats
+void raster_draw_prim(device_t *device, const raster_prim_t *prim, const rect_t *clip, 
+    device_stats_t *stats) {
+    const int *p = prim->line;
+    int fill = prim->state & (RENDER_STATE_TEXTURE | RENDER_STATE_COLOR), i, hiz = 0;
+    rect_t r = prim->bound;
+    if (r.x0 < clip->x0) r.x0 = clip->x0;
+    if (r.y0 < clip->y0) r.y0 = clip->y0;
+    if (r.x1 > clip->x1) r.x1 = clip->x1;
+    if (r.y1 > clip->y1) r.y1 = clip->y1;
+    if (r.x0 >= r.x1 || r.y0 >= r.y1) return;
+    if (fill) device_depth_prepare(device, &r);
+    if (fill && device->hiz_test && prim->ntrap > 0) {
+        // 整个三角形在分层深度之后时跳过填充，只有部分遮挡时才逐块、逐段检查。
+        // 小三角形的检查开销比能省下的像素还多
+        if ((r.x1 - r.x0) * (r.y1 - r.y0) >= HIZ_MIN_AREA)
+            hiz = device_hiz_classify(device, &r, raster_max_rhw(prim, &r));
+        if (hiz == HIZ_OCCLUDED) fill = 0;
+    }
+    if (fill) {
+        if (prim->rasterizer == RASTERIZER_HALFSPACE) {
+            if (prim->ntrap > 0) 
+                device_render_halfspace(device, &prim->tri, clip, prim->state, hiz, stats);
+        }   else {
+            for (i = 0; i < prim->ntrap; i++) 
+                device_render_trap(device, &prim->traps[i], &prim->tri, clip, prim->kernel, 
+                    prim->mip, hiz, stats);
+        }
+    }
+    if (prim->state & RENDER_STATE_WIREFRAME) {
+        if (prim->edges & 1) device_draw_line_clip(device, clip, p[0], p[1], p[2], p[3], prim->color);
+        if (prim->edges & 2) device_draw_line_clip(device, clip, p[0], p[1], p[4], p[5], prim->color);
+        if (prim->edges & 4) device_draw_line_clip(device, clip, p[4], p[5], p[2], p[3], prim->color);
+    }
+}
+
+// 把图元加入与其包围盒相交的所有 tile
+void raster_bin_prim(device_t *device, const raster_prim_t *prim) {
+    raster_pool_t *pool = device->pool;
+    rect_t b = prim->bound;
+    int x, y, index;
+    if (b.x0 < 0) b.x0 = 0;
+    if (b.y0 < 0) b.y0 = 0;
+    if (b.x1 > device->width) b.x1 = device->width;
+    if (b.y1 > device->height) b.y1 = device->height;
+    if (b.x0 >= b.x1 || b.y0 >= b.y1) return;
+    if (pool->prim_count >= pool->prim_capacity) {
+        pool->prim_capacity = (pool->prim_capacity > 0)? pool->prim_capacity * 2 : 256;
+        pool->prims = (raster_prim_t*)realloc(pool->prims, 
+            sizeof(raster_prim_t) * pool->prim_capacity);
+        assert(pool->prims);
+    }
+    index = pool->prim_count++;
+    pool->prims[index] = *prim;
+    for (y = b.y0 / RASTER_TILE_SIZE; y <= (b.y1 - 1) / RASTER_TILE_SIZE; y++) {
+        for (x = b.x0 / RASTER_TILE_SIZE; x <= (b.x1 - 1) / RASTER_TILE_SIZE; x++) {
+            raster_bin_t *bin = &pool->bins[y * pool->tiles_x + x];
+            if (bin->count >= bin->capacity) {
+                bin->capacity = (bin->capacity > 0)? bin->capacity * 2 : 64;
+                bin->items = (int*)realloc(bin->items, sizeof(int) * bin->capacity);
+                assert(bin->items);
+            }
+            bin->items[bin->count++] = index;
+        }
+    }
+}
+
+// 按提交顺序绘制一个 tile 中的图元
+void raster_draw_tile(device_t *device, int tile, device_stats_t *stats) {
+    raster_pool_t *pool = device->pool;
+    const raster_bin_t *bin = &pool->bins[tile];
+    rect_t clip;
+    int i;
+    clip.x0 = (tile % pool->tiles_x) * RASTER_TILE_SIZE;
+    clip.y0 = (tile / pool->tiles_x) * RASTER_TILE_SIZE;
+    clip.x1 = clip.x0 + RASTER_TILE_SIZE;
+    clip.y1 = clip.y0 + RASTER_TILE_SIZE;
+    if (clip.x1 > device->width) clip.x1 = device->width;
+    if (clip.y1 > device->height) clip.y1 = device->height;
+    for (i = 0; i < bin->count; i++) 
+        raster_draw_prim(device, &pool->prims[bin->items[i]], &clip, stats);
+}
+
+// 不断领取 tile 并绘制，直到本批次的 tile 全部领完
+void raster_run_tiles(device_t *device, device_stats_t *stats) {
+    raster_pool_t *pool = device->pool;
+    int ntile = pool->tiles_x * pool->tiles_y;
+    while (1) {
+        int tile = atomic_increment(&pool->next_tile) - 1;
+        if (tile >= ntile) break;
+        if (pool->bins[tile].count > 0) raster_draw_tile(device, tile, stats);
+    }
+}
+
+THREAD_PROC(raster_worker_main, arg) {
+    raster_worker_t *worker = (raster_worker_t*)arg;
+    raster_pool_t *pool = worker->device->pool;
+    int generation = 0;
+    mutex_lock(&pool->lock);
+    while (1) {
+        while (pool->quit == 0 && pool->generation == generation) 
+            cond_wait(&pool->wake, &pool->lock);
+        if (pool->quit) break;
+        generation = pool->generation;
+        mutex_unlock(&pool->lock);
+        raster_run_tiles(worker->device, &worker->stats);
+        mutex_lock(&pool->lock);
+        if (--pool->running == 0) cond_signal(&pool->done);
+    }
+    mutex_unlock(&pool->lock);
+    THREAD_RETURN;
+}
+
+// 把 src 的光栅化计数加到 dst 并清零 src
+void raster_stats_merge(device_stats_t *dst, device_stats_t *src) {
+    dst->spans += src->spans;
+    dst->tested += src->tested;
+    dst->written += src->written;
+    src->spans = src->tested = src->written = 0;
+}
+
+// 绘制所有已分箱的图元：调用线程和工作线程一起领取 tile，全部完成后返回
+void device_flush(device_t *device) {
+    raster_pool_t *pool = device->pool;
+    IUINT64 start;
+    int i;
+    if (pool == NULL || pool->prim_count == 0) return;
+    start = device_stage_begin(device);
+    mutex_lock(&pool->lock);
+    pool->next_tile = 0;
+    pool->running = pool->threads - 1;
+    pool->generation++;
+    cond_broadcast(&pool->wake);
+    mutex_unlock(&pool->lock);
+    raster_run_tiles(device, &pool->stats);
+    mutex_lock(&pool->lock);
+    while (pool->running > 0) cond_wait(&pool->done, &pool->lock);
+    mutex_unlock(&pool->lock);
+    for (i = pool->tiles_x * pool->tiles_y - 1; i >= 0; i--) pool->bins[i].count = 0;
+    pool->prim_count = 0;
+    raster_stats_merge(&device->stats, &pool->stats);
+    for (i = 0; i < pool->threads - 1; i++) raster_stats_merge(&device->stats, &pool->workers[i].stats);
+    device_stage_end(device, STAGE_RASTER, start);
+}
+
+// 设置光栅化线程数：0 为提交时立即绘制（默认），n >= 1 时分块绘制，
+// 共使用 n 个线程（包括调用 device_flush 的线程）
+void device_set_threads(device_t *device, int n) {
+    raster_pool_t *pool = device->pool;
+    int i;
+    if (pool) {
+        device_flush(device);
+        mutex_lock(&pool->lock);
+        pool->quit = 1;
+        cond_broadcast(&pool->wake);
+        mutex_unlock(&pool->lock);
+        for (i = 0; i < pool->threads - 1; i++) thread_join(pool->workers[i].thread);
+        for (i = 0; i < pool->tiles_x * pool->tiles_y; i++) free(pool->bins[i].items);
+        mutex_destroy(&pool->lock);
+        cond_destroy(&pool->wake);
+        cond_destroy(&pool->done);
+        free(pool->workers);
+        free(pool->bins);
+        free(pool->prims);
+        free(pool);
+        device->pool = NULL;
+    }
+    device->threads = (n > 0)? n : 0;
+    if (n <= 0) return;
+    pool = (raster_pool_t*)calloc(1, sizeof(raster_pool_t));
+    assert(pool);
+    pool->threads = n;
+    pool->tiles_x = (device->width + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    pool->tiles_y = (device->height + RASTER_TILE_SIZE - 1) / RASTER_TILE_SIZE;
+    pool->bins = (raster_bin_t*)calloc(pool->tiles_x * pool->tiles_y, sizeof(raster_bin_t));
+    pool->workers = (raster_worker_t*)calloc(n, sizeof(raster_worker_t));
+    assert(pool->bins && pool->workers);
+    mutex_init(&pool->lock);
+    cond_init(&pool->wake);
+    cond_init(&pool->done);
+    device->pool = pool;
+    for (i = 0; i < n - 1; i++) {
+        pool->workers[i].device = device;
+        if (thread_create(&pool->workers[i].thread, raster_worker_main, &pool->workers[i]) != 0) {
+            pool->threads = i + 1;      // 创建失败时用已有的线程继续工作
+            break;
+        }
+    }
+}
+
+// 把光照状态解析为本次绘制的常量：法向量变换矩阵，摄影机坐标系中的光源
+void device_light_setup(device_t *device, light_setup_t *ls) {
+    lighting_t *lighting = &device->lighting;
+    int i;
+    lighting_update_table(lighting);
+    //变换图元法向量(旋转变换+摄影机变换)
+    matrix_mul(&ls->normal_transform, &device->transform.world, &device->transform.view);
+    ls->count = lighting->count;
+    ls->ambient = lighting->ambient;
+    ls->diffuse = lighting->diffuse;
+    ls->specular = lighting->specular;
+    ls->table = lighting->specular_table;
+    for (i = 0; i < lighting->count; i++) {
+        const light_t *light = &lighting->lights[i];
+        ls->type[i] = light->type;
+        ls->intensity[i] = light->intensity;
+        ls->falloff[i] = light->falloff;
+        matrix_apply(&ls->vec[i], &light->vec, &device->transform.view);
+        if (light->type == LIGHT_DIRECTIONAL) {
+            // 光照计算使用指向光源的方向
+            ls->vec[i].x = -ls->vec[i].x;
+            ls->vec[i].y = -ls->vec[i].y;
+            ls->vec[i].z = -ls->vec[i].z;
+            vector_normalize(&ls->vec[i]);
+        }
+    }
+}
+
+// 由屏幕坐标 screen（w 为裁剪空间的 w）和光照填写缓存顶点
+void device_cache_vertex(cached_vertex_t *out, const vertex_t *v, 
+    const point_t *screen, int cvv, float light) {
+    out->v = *v;
+    out->v.pos = *screen;
+    out->v.light = light;
+    out->cvv = cvv;
+    out->src = v;
+    vertex_rhw_init(&out->v);   // 初始化 w
+}
+
+// 顶点阶段：变换、光照、归一化，结果写入 out（屏幕坐标，w 为裁剪空间 w）
+void device_process_vertex(const device_t *device, cached_vertex_t *out, 
+    const vertex_t *v, const vector_t *normal, const light_setup_t *ls) {
+    vector_t trans_normal;
+    point_t p, c;
+    float light;
+
+    //变换法向量与摄影机空间的位置，计算光照
+    matrix_apply(&trans_normal, normal, &ls->normal_transform);
+    matrix_apply(&p, &v->pos, &device->transform.view);
+    light = light_vertex(ls, &p, &trans_normal);
+
+    // 按照 Transform 变化，记录 cvv 检查结果，由图元装配决定是否丢弃
+    transform_apply(&device->transform, &c, &v->pos);
+
+    // 归一化
+    transform_homogenize(&device->transform, &p, &c);
+    p.w = c.w;
+    device_cache_vertex(out, v, &p, transform_check_cvv(&c), light);
+}
+
+// 由三个屏幕空间的顶点生成图元，并立即绘制或分箱。edges 为需要绘制的线框边：
+// 1 为 v1-v2，2 为 v1-v3，4 为 v3-v2，裁剪产生的内部边不画。
+// 背面剔除时返回 0，由调用者按提交的三角形计数
+int device_draw_screen_triangle(device_t *device, const vertex_t *v1, 
+    const vertex_t *v2, const vertex_t *v3, int edges) {
+    const point_t *p1 = &v1->pos, *p2 = &v2->pos, *p3 = &v3->pos;
+    int render_state = device->render_state;
+    float minx, miny, maxx, maxy;
+    raster_prim_t prim;
+
+    // 在屏幕空间进行背面消除：y 轴向下，正面的三个顶点按逆时针排列
+    if (REMOVE_BACKFACE) {
+        float area = (p2->x - p1->x) * (p3->y - p1->y) - (p2->y - p1->y) * (p3->x - p1->x);
+        if (area >= 0) return 0;
+    }
+
+    prim.ntrap = 0;
+    prim.mip = 0;
+    prim.rasterizer = device->rasterizer;
+    prim.state = render_state;
+    prim.color = device->foreground;
+    prim.edges = edges;
+    prim.max_rhw = (v1->rhw > v2->rhw)? v1->rhw : v2->rhw;
+    prim.max_rhw = (prim.max_rhw > v3->rhw)? prim.max_rhw : v3->rhw;
+
+    // 纹理或者色彩绘制
+    if (render_state & (RENDER_STATE_TEXTURE | RENDER_STATE_COLOR)) {
+        if (prim.rasterizer == RASTERIZER_HALFSPACE) {
+            prim.ntrap = halfspace_init_triangle(&prim.tri, v1, v2, v3);
+        }   else {
+            // 拆分三角形为0-2个梯形，并且返回可用梯形数量。
+            // 不覆盖任何一行的小三角形到此为止，不计算属性平面
+            prim.ntrap = trapezoid_init_triangle(prim.traps, v1, v2, v3);
+            if (prim.ntrap > 0 && !halfspace_init_triangle(&prim.tri, v1, v2, v3)) prim.ntrap = 0;
+            prim.kernel = span_kernel_select(device, render_state, 
+                !(v1->light == 1.0f && v2->light == 1.0f && v3->light == 1.0f));
+            prim.mip = (render_state & RENDER_STATE_TEXTURE) && device->tex_filter != TEXTURE_NEAREST;
+        }
+    }
+
+    // 线框顶点
+    prim.line[0] = (int)p1->x, prim.line[1] = (int)p1->y;
+    prim.line[2] = (int)p2->x, prim.line[3] = (int)p2->y;
+    prim.line[4] = (int)p3->x, prim.line[5] = (int)p3->y;
+
+    // 包围盒：顶点取整到 28.4 定点时最多移动 1/32 像素，这里各留出一个像素的余量
+    minx = (p1->x < p2->x)? p1->x : p2->x, minx = (minx < p3->x)? minx : p3->x;
+    maxx = (p1->x > p2->x)? p1->x : p2->x, maxx = (maxx > p3->x)? maxx : p3->x;
+    miny = (p1->y < p2->y)? p1->y : p2->y, miny = (miny < p3->y)? miny : p3->y;
+    maxy = (p1->y > p2->y)? p1->y : p2->y, maxy = (maxy > p3->y)? maxy : p3->y;
+    prim.bound.x0 = (int)floor(minx) - 1;
+    prim.bound.y0 = (int)floor(miny) - 1;
+    prim.bound.x1 = (int)floor(maxx) + 2;
+    prim.bound.y1 = (int)floor(maxy) + 2;
+    device->stats.trapezoids += prim.ntrap;
+
+    if (device->pool) {
+        raster_bin_prim(device, &prim);
+    }   else {
+        rect_t clip = { 0, 0, device->width, device->height };
+        IUINT64 start = device_stage_begin(device);
+        raster_draw_prim(device, &prim, &clip, &device->stats);
+        device_stage_end(device, STAGE_RASTER, start);
+    }
+    return 1;
+}
+
+// 顶点到第 plane 个裁剪平面的有向距离，>= 0 为内侧。
+// 平面依次为：近、远、保护带的左、右、下、上
+float clip_distance(const point_t *c, int plane) {
+    switch (plane) {
+    case 0: return c->z;
+    case 1: return c->w - c->z;
+    case 2: return c->x + GUARD_BAND * c->w;
+    case 3: return GUARD_BAND * c->w - c->x;
+    case 4: return c->y + GUARD_BAND * c->w;
+    default: return GUARD_BAND * c->w - c->y;
+    }
+}
+
+// 跨越近/远平面或超出保护带的三角形：在裁剪空间依次对需要的平面做
+// Sutherland-Hodgman 裁剪，结果是一个凸多边形，再按扇形拆成三角形绘制
+void device_clip_triangle(device_t *device, const cached_vertex_t *v1, 
+    const cached_vertex_t *v2, const cached_vertex_t *v3) {
+    const cached_vertex_t *src[3];
+    vertex_t poly[2][12], *in = poly[0], *out = poly[1], *t;
+    float d[12];
+    int i, k, n = 3, m, planes = 0, drawn = 0;
+    src[0] = v1, src[1] = v2, src[2] = v3;
+    for (i = 0; i < 3; i++) {
+        in[i] = *src[i]->src;
+        in[i].light = src[i]->v.light;
+        transform_apply(&device->transform, &in[i].pos, &src[i]->src->pos);
+        for (k = 0; k < 6; k++) {
+            if (clip_distance(&in[i].pos, k) < 0.0f) planes |= 1 << k;
+        }
+    }
+    for (k = 0; k < 6; k++) {
+        if ((planes & (1 << k)) == 0) continue;
+        for (i = 0; i < n; i++) d[i] = clip_distance(&in[i].pos, k);
+        for (i = 0, m = 0; i < n; i++) {
+            int j = (i + 1 < n)? i + 1 : 0;
+            if (d[i] >= 0.0f) out[m++] = in[i];
+            if ((d[i] >= 0.0f) != (d[j] >= 0.0f)) {
+                // 交点：vertex_interp 会把 w 置 1，这里单独插值裁剪空间的 w
+                float s = d[i] / (d[i] - d[j]);
+                vertex_interp(&out[m], &in[i], &in[j], s);
+                out[m++].pos.w = interp(in[i].pos.w, in[j].pos.w, s);
+            }
+        }
+        t = in, in = out, out = t;
+        n = m;
+        if (n < 3) {
+            device->stats.rejected++;
+            return;
+        }
+    }
+    // 归一化，得到屏幕坐标
+    for (i = 0; i < n; i++) {
+        point_t p;
+        transform_homogenize(&device->transform, &p, &in[i].pos);
+        p.w = in[i].pos.w;
+        in[i].pos = p;
+        vertex_rhw_init(&in[i]);
+    }
+    for (i = 1; i + 1 < n; i++) {
+        int edges = 4;
+        if (i == 1) edges |= 1;
+        if (i + 2 == n) edges |= 2;
+        drawn |= device_draw_screen_triangle(device, &in[0], &in[i], &in[i + 1], edges);
+    }
+    // 裁剪得到的各个三角形绕序相同，全部被剔除时按一个背面三角形计数
+    if (!drawn) device->stats.culled++;
+}
+
+// 屏幕坐标是否在保护带内：|x / w| <= GUARD_BAND 对应的屏幕范围
+int device_in_guard_band(const device_t *device, const point_t *p) {
+    float x0 = (1.0f - GUARD_BAND) * 0.5f * device->width;
+    float x1 = (1.0f + GUARD_BAND) * 0.5f * device->width;
+    float y0 = (1.0f - GUARD_BAND) * 0.5f * device->height;
+    float y1 = (1.0f + GUARD_BAND) * 0.5f * device->height;
+    return (p->x >= x0 && p->x <= x1 && p->y >= y0 && p->y <= y1);
+}
+
+// 不在三个顶点都位于同一平面之外时，能否不经裁剪直接用屏幕坐标绘制：全部在 cvv 内，
+// 或者都在近/远平面之间（近平面为 1，远平面为 2，与 transform_check_cvv 相同）并且在保护带内
+int device_triangle_direct(const device_t *device, const cached_vertex_t *v1, 
+    const cached_vertex_t *v2, const cached_vertex_t *v3) {
+    if ((v1->cvv | v2->cvv | v3->cvv) == 0) return 1;
+    return ((v1->cvv | v2->cvv | v3->cvv) & 3) == 0 && device_in_guard_band(device, &v1->v.pos) &&
+        device_in_guard_band(device, &v2->v.pos) && device_in_guard_band(device, &v3->v.pos);
+}
+
+// 三角形是否一定不会画出任何像素：三个顶点在同一平面之外，或者直接绘制时是背面。
+// 顶点阶段据此跳过只属于这些三角形的顶点的光照
+int device_triangle_rejected(const device_t *device, const cached_vertex_t *v1, 
+    const cached_vertex_t *v2, const cached_vertex_t *v3) {
+    const point_t *p1 = &v1->v.pos, *p2 = &v2->v.pos, *p3 = &v3->v.pos;
+    if ((v1->cvv & v2->cvv & v3->cvv) != 0) return 1;
+    if (REMOVE_BACKFACE && device_triangle_direct(device, v1, v2, v3)) {
+        // 与 device_draw_screen_triangle 相同的面积计算
+        float area = (p2->x - p1->x) * (p3->y - p1->y) - (p2->y - p1->y) * (p3->x - p1->x);
+        if (area >= 0) return 1;
+    }
+    return 0;
+}
+
+// 图元装配：由三个已经过顶点阶段的顶点生成图元。全部在 cvv 内的直接绘制；
+// 超出屏幕但在保护带内的也直接绘制，由光栅化按裁剪矩形截断扫描线；
+// 跨越近/远平面或超出保护带的先做齐次裁剪
+void device_draw_triangle(device_t *device, const cached_vertex_t *v1, 
+    const cached_vertex_t *v2, const cached_vertex_t *v3) {
+    // 三个顶点都在同一个平面之外
+    if ((v1->cvv & v2->cvv & v3->cvv) != 0) {
+        device->stats.rejected++;
+        return;
+    }
+    if (device_triangle_direct(device, v1, v2, v3)) {
+        if (!device_draw_screen_triangle(device, &v1->v, &v2->v, &v3->v, 7)) 
+            device->stats.culled++;
+        return;
+    }
+    device_clip_triangle(device, v1, v2, v3);
+}
+
+// 根据 render_state 绘制原始三角形，三个顶点共用面法向量 normal
+void device_draw_primitive(device_t *device, const vertex_t *v1, 
+    const vertex_t *v2, const vertex_t *v3, const vector_t *normal) {
+    cached_vertex_t t1, t2, t3;
+    light_setup_t ls;
+    IUINT64 start, raster;
+    if (device->trace) trace_write_primitive(device, v1, v2, v3, normal);
+    start = device_stage_begin(device);
+    device_light_setup(device, &ls);
+    device_process_vertex(device, &t1, v1, normal, &ls);
+    device_process_vertex(device, &t2, v2, normal, &ls);
+    device_process_vertex(device, &t3, v3, normal, &ls);
+    device_stage_end(device, STAGE_VERTEX, start);
+    start = device_stage_begin(device);
+    raster = device->stats.ticks[STAGE_RASTER];
+    device->stats.triangles++;
+    device_draw_triangle(device, &t1, &t2, &t3);
+    // 立即绘制时光栅化在 setup 之内进行，已经计入 STAGE_RASTER 的部分不重复计入
+    device_stage_end(device, STAGE_SETUP, start + (device->stats.ticks[STAGE_RASTER] - raster));
+}
+
+// 顶点缓存中的 SoA 流：pos / nor 为模型空间的输入，在一次绘制中只拆分一次；
+// 其余为每个实例变换的结果。tinted 存放乘上实例颜色后的顶点，裁剪时从这里重新插值
+typedef struct {
+    vector_stream_t pos, nor;
+    vector_stream_t view, normal, screen;
+    int *cvv;
+    int *lit;                       // 非 0：顶点属于可能画出的三角形，需要光照
+    cached_vertex_t *cache;
+    vertex_t *tinted;
+}   vertex_streams_t;
+
+// 为 count 个顶点准备顶点缓存，并把顶点位置和法向量拆分为 SoA 的流
+void device_vertex_streams(device_t *device, vertex_streams_t *vs, 
+    const vertex_t *vertices, const vector_t *normals, int count) {
+    float *stream;
+    int i;
+    if (count > device->vcache_max) {
+        int max = (device->vcache_max > 0)? device->vcache_max : 64;
+        while (max < count) max *= 2;
+        free(device->vcache);
+        device->vcache = (cached_vertex_t*)malloc((sizeof(cached_vertex_t) + 
+            sizeof(vertex_t) + sizeof(float) * 20 + sizeof(int) * 2) * max);
+        assert(device->vcache);
+        device->vcache_max = max;
+    }
+    vs->cache = device->vcache;
+    vs->tinted = (vertex_t*)(vs->cache + device->vcache_max);
+    stream = (float*)(vs->tinted + device->vcache_max);
+    vs->pos.x = stream, vs->pos.y = vs->pos.x + count;
+    vs->pos.z = vs->pos.y + count, vs->pos.w = vs->pos.z + count;
+    vs->nor.x = vs->pos.w + count, vs->nor.y = vs->nor.x + count;
+    vs->nor.z = vs->nor.y + count, vs->nor.w = vs->nor.z + count;
+    vs->view.x = vs->nor.w + count, vs->view.y = vs->view.x + count;
+    vs->view.z = vs->view.y + count, vs->view.w = vs->view.z + count;
+    vs->normal.x = vs->view.w + count, vs->normal.y = vs->normal.x + count;
+    vs->normal.z = vs->normal.y + count, vs->normal.w = vs->normal.z + count;
+    vs->screen.x = vs->normal.w + count, vs->screen.y = vs->screen.x + count;
+    vs->screen.z = vs->screen.y + count, vs->screen.w = vs->screen.z + count;
+    vs->cvv = (int*)(vs->screen.w + count);
+    vs->lit = vs->cvv + count;
+    for (i = 0; i < count; i++) {
+        vector_stream_set(&vs->pos, i, &vertices[i].pos);
+        vector_stream_set(&vs->nor, i, &normals[i]);
+    }
+}
+
+// 三角形 t[0..2] 的索引是否都在 [0, count) 之内。索引可能来自映射的网格文件，
+// 发布版本中同样要检查，越界的三角形跳过不画
+FORCE_INLINE int triangle_indices_valid(const int *t, int count) {
+    return (unsigned)t[0] < (unsigned)count && (unsigned)t[1] < (unsigned)count && 
+        (unsigned)t[2] < (unsigned)count;
+}
+
+// 以 device->transform 和 ls->normal_transform 批量完成变换、cvv 检查、归一化和
+// 逐顶点光照，结果写入顶点缓存。indices 不为 NULL 时先找出一定被剔除的三角形，
+// 只属于它们的顶点不做光照（光照值不会被读取）。这需要多走一遍索引，
+// 只对反复绘制、顶点缓存留在一级缓存里的小网格划算
+void device_transform_vertices(device_t *device, const vertex_streams_t *vs, 
+    const light_setup_t *ls, const vertex_t *vertices, int count, 
+    const int *indices, int index_count) {
+    cached_vertex_t *cache = vs->cache;
+    vector_t p, n;
+    float light;
+    int i;
+    transform_apply_stream(&device->transform, &vs->pos, &vs->screen, vs->cvv, count);
+    matrix_apply_stream(&device->transform.view, &vs->pos, &vs->view, count);
+    matrix_apply_stream(&ls->normal_transform, &vs->nor, &vs->normal, count);
+    if (indices == NULL) {
+        for (i = 0; i < count; i++) {
+            vector_stream_get(&vs->view, i, &p);
+            vector_stream_get(&vs->normal, i, &n);
+            light = light_vertex(ls, &p, &n);
+            vector_stream_get(&vs->screen, i, &p);
+            device_cache_vertex(&cache[i], &vertices[i], &p, vs->cvv[i], light);
+        }
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        vector_stream_get(&vs->screen, i, &p);
+        device_cache_vertex(&cache[i], &vertices[i], &p, vs->cvv[i], 0.0f);
+        vs->lit[i] = 0;
+    }
+    for (i = 0; i + 2 < index_count; i += 3) {
+        const int *t = indices + i;
+        if (!triangle_indices_valid(t, count)) continue;
+        if (!device_triangle_rejected(device, &cache[t[0]], &cache[t[1]], &cache[t[2]])) {
+            vs->lit[t[0]] = vs->lit[t[1]] = vs->lit[t[2]] = 1;
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (vs->lit[i] == 0) continue;
+        vector_stream_get(&vs->view, i, &p);
+        vector_stream_get(&vs->normal, i, &n);
+        cache[i].v.light = light_vertex(ls, &p, &n);
+    }
+}
+
+// 绘制索引三角形列表：vertices / normals 各 count 个（法向量逐顶点），
+// indices 每 3 个组成一个三角形。每个顶点在本次绘制中只做一次变换和光照，
+// 结果保存在设备的顶点缓存里，图元装配直接从缓存取顶点
+void device_draw_indexed(device_t *device, const vertex_t *vertices, 
+    const vector_t *normals, int count, const int *indices, int index_count) {
+    vertex_streams_t vs;
+    light_setup_t ls;
+    IUINT64 start, raster;
+    int i;
+    if (device->commands) {
+        device_record_draw(device, vertices, normals, count, indices, index_count, 
+            &device->transform.world, NULL);
+        return;
+    }
+    if (device->trace) {
+        trace_write_draw(device, vertices, normals, count, indices, index_count, NULL, NULL, 0);
+    }
+    start = device_stage_begin(device);
+    device_vertex_streams(device, &vs, vertices, normals, count);
+    device_light_setup(device, &ls);
+    device_transform_vertices(device, &vs, &ls, vertices, count, NULL, 0);
+    device_stage_end(device, STAGE_VERTEX, start);
+    start = device_stage_begin(device);
+    raster = device->stats.ticks[STAGE_RASTER];
+    device->stats.triangles += index_count / 3;
+    for (i = 0; i + 2 < index_count; i += 3) {
+        if (!triangle_indices_valid(indices + i, count)) continue;
+        device_draw_triangle(device, &vs.cache[indices[i]], &vs.cache[indices[i + 1]], 
+            &vs.cache[indices[i + 2]]);
+    }
+    device_stage_end(device, STAGE_SETUP, start + (device->stats.ticks[STAGE_RASTER] - raster));
+}
+
+// 实例化绘制：同一个网格以 worlds[0 .. instance_count) 为世界矩阵各画一次，
+// colors 不为 NULL 时第 i 个实例的顶点颜色乘上 colors[i]。顶点拆分和光源变换
+// 每次调用只做一次，每个实例只剩两次矩阵乘法和顶点阶段，并借助共用的
+// 索引跳过背面和视锥外三角形的顶点光照。结果与逐个设置 world 后调用
+// device_draw_indexed 逐位一致（包括跳过索引越界的三角形）
+void device_draw_instanced(device_t *device, const vertex_t *vertices, 
+    const vector_t *normals, int count, const int *indices, int index_count, 
+    const matrix_t *worlds, const color_t *colors, int instance_count) {
+    transform_t *ts = &device->transform;
+    vertex_streams_t vs;
+    light_setup_t ls;
+    IUINT64 start, raster;
+    int i, k;
+    if (device->commands) {
+        for (k = 0; k < instance_count; k++) {
+            device_record_draw(device, vertices, normals, count, indices, index_count, 
+                &worlds[k], colors? &colors[k] : NULL);
+        }
+        return;
+    }
+    if (instance_count <= 0) return;
+    if (device->trace) {
+        trace_write_draw(device, vertices, normals, count, indices, index_count, 
+            worlds, colors, instance_count);
+    }
+    start = device_stage_begin(device);
+    device_vertex_streams(device, &vs, vertices, normals, count);
+    device_light_setup(device, &ls);
+    device_stage_end(device, STAGE_VERTEX, start);
+    for (k = 0; k < instance_count; k++) {
+        const vertex_t *src = vertices;
+        start = device_stage_begin(device);
+        // 与 transform_update 相同的乘法顺序，world * view 同时用作法向量的变换
+        ts->world = worlds[k];
+        matrix_mul(&ls.normal_transform, &ts->world, &ts->view);
+        matrix_mul(&ts->transform, &ls.normal_transform, &ts->projection);
+        if (colors) {
+            for (i = 0; i < count; i++) {
+                vs.tinted[i] = vertices[i];
+                vs.tinted[i].color.r *= colors[k].r;
+                vs.tinted[i].color.g *= colors[k].g;
+                vs.tinted[i].color.b *= colors[k].b;
+            }
+            src = vs.tinted;
+        }
+        device_transform_vertices(device, &vs, &ls, src, count, indices, index_count);
+        device_stage_end(device, STAGE_VERTEX, start);
+        start = device_stage_begin(device);
+        raster = device->stats.ticks[STAGE_RASTER];
+        device->stats.triangles += index_count / 3;
+        for (i = 0; i + 2 < index_count; i += 3) {
+            if (!triangle_indices_valid(indices + i, count)) continue;
+            device_draw_triangle(device, &vs.cache[indices[i]], &vs.cache[indices[i + 1]], 
+                &vs.cache[indices[i + 2]]);
+        }
+        device_stage_end(device, STAGE_SETUP, start + (device->stats.ticks[STAGE_RASTER] - raster));
+    }
+}
+
+
+//=====================================================================
+// 网格：映射 mesh_header_t 格式的网格文件（由 obj2mesh 从 OBJ 转换），
+// 顶点、法向量、索引直接指向映射的内存，载入时只检查文件头
+//=====================================================================
+typedef struct {
+    const void *base;               // 映射的起始地址
+    size_t size;                    // 映射的长度
+    const mesh_header_t *header;
+    const vertex_t *vertices;
+    const vector_t *normals;
+    const int *indices;
+    int vertex_count;
+    int index_count;
+}   mesh_t;
+
+// 段 [offset, offset + count * size) 是否位于长度为 total 的文件内并且对齐
+int mesh_section_valid(unsigned long long offset, unsigned long long count, 
+    unsigned long long size, unsigned long long total) {
+    if (offset % 16 != 0 || offset > total) return 0;
+    return count * size <= total - offset;
+}
+
+// 载入网格文件，成功返回 0，无法打开返回 -1，格式不符返回 -2。
+// 索引的范围不在这里检查（那需要读入整个索引段），由转换工具保证
+int mesh_load(mesh_t *mesh, const char *filename) {
+    const mesh_header_t *h;
+    const char *base;
+    memset(mesh, 0, sizeof(mesh_t));
+    mesh->base = file_map(filename, &mesh->size);
+    if (mesh->base == NULL) return -1;
+    base = (const char*)mesh->base;
+    h = (const mesh_header_t*)base;
+    if (mesh->size < sizeof(mesh_header_t) || h->magic != MESH_MAGIC || 
+        h->version != MESH_VERSION || h->vertex_size != sizeof(vertex_t) || 
+        h->normal_size != sizeof(vector_t) || h->file_size != mesh->size || 
+        h->vertex_count > 0x7fffffff || h->index_count > 0x7fffffff ||
+        !mesh_section_valid(h->vertex_offset, h->vertex_count, sizeof(vertex_t), mesh->size) ||
+        !mesh_section_valid(h->normal_offset, h->vertex_count, sizeof(vector_t), mesh->size) ||
+        !mesh_section_valid(h->index_offset, h->index_count, sizeof(int), mesh->size)) {
+        file_unmap(mesh->base, mesh->size);
+        mesh->base = NULL;
+        return -2;
+    }
+    mesh->header = h;
+    mesh->vertices = (const vertex_t*)(base + h->vertex_offset);
+    mesh->normals = (const vector_t*)(base + h->normal_offset);
+    mesh->indices = (const int*)(base + h->index_offset);
+    mesh->vertex_count = (int)h->vertex_count;
+    mesh->index_count = (int)h->index_count;
+    return 0;
+}
+
+// 释放网格的映射
+void mesh_free(mesh_t *mesh) {
+    if (mesh->base) file_unmap(mesh->base, mesh->size);
+    memset(mesh, 0, sizeof(mesh_t));
+}
+
+// 以当前的变换绘制网格
+void device_draw_mesh(device_t *device, const mesh_t *mesh) {
+    device_draw_indexed(device, mesh->vertices, mesh->normals, mesh->vertex_count, 
+        mesh->indices, mesh->index_count);
+}
+
+
+//=====================================================================
+// 场景：带世界矩阵和包围盒的物体组织成 BVH，绘制前用视锥剔除整棵子树，
+// 不可见的物体不做顶点变换和光照
+//=====================================================================
+#define SCENE_LEAF_SIZE     4       // 叶子节点最多包含的物体数
+#define SCENE_BATCH_SIZE    64      // 共用几何数据的可见物体合并为一次实例化绘制的上限
+
+typedef struct {
+    matrix_t world;                 // 世界矩阵
+    const vertex_t *vertices;       // 几何数据只引用不复制
+    const vector_t *normals;
+    const int *indices;
+    int vertex_count;
+    int index_count;
+    vector_t local_min, local_max;  // 模型空间的包围盒
+    vector_t bound_min, bound_max;  // 世界空间的包围盒
+}   scene_object_t;
+
+typedef struct {
+    vector_t bound_min, bound_max;  // 子树中所有物体的包围盒
+    int right;                      // 内部节点的右子节点，左子节点紧跟在本节点之后
+    int first, count;               // 叶子：物体在 order 中的范围，count 为 0 时是内部节点
+    int axis;                       // 内部节点的划分轴
+}   bvh_node_t;
+
+typedef struct {
+    scene_object_t *objects;
+    int count, capacity;
+    int *order;                     // 按叶子排列的物体下标
+    bvh_node_t *nodes;
+    int node_count;
+    int dirty;                      // 1：增加了物体需要重建，2：只移动了物体，重新计算节点包围盒
+}   scene_t;
+
+// 视锥：裁剪空间 -w <= x, y <= w、0 <= z <= w 的 6 个平面换算到世界空间，
+// 平面 (x, y, z, w) 上的点 p 满足 p.x * x + p.y * y + p.z * z + w >= 0 时在内侧
+typedef struct {
+    vector_t plane[6];
+    vector_t front;                 // 世界空间的视线方向，用于由近及远遍历
+}   frustum_t;
+
+void scene_init(scene_t *scene) {
+    memset(scene, 0, sizeof(scene_t));
+}
+
+void scene_destroy(scene_t *scene) {
+    if (scene->objects) free(scene->objects);
+    if (scene->order) free(scene->order);
+    if (scene->nodes) free(scene->nodes);
+    memset(scene, 0, sizeof(scene_t));
+}
+
+// 将模型空间的包围盒按世界矩阵变换，得到仍与坐标轴对齐的包围盒
+void scene_object_bound(scene_object_t *obj) {
+    const float *lo = &obj->local_min.x, *hi = &obj->local_max.x;
+    float *bmin = &obj->bound_min.x, *bmax = &obj->bound_max.x;
+    int i, j;
+    for (j = 0; j < 3; j++) {
+        bmin[j] = bmax[j] = obj->world.m[3][j];
+        for (i = 0; i < 3; i++) {
+            float a = obj->world.m[i][j] * lo[i], b = obj->world.m[i][j] * hi[i];
+            bmin[j] += (a < b)? a : b;
+            bmax[j] += (a < b)? b : a;
+        }
+    }
+    obj->bound_min.w = obj->bound_max.w = 1.0f;
+}
+
+// 加入一个物体，返回下标，内存不足时返回 -1。包围盒由顶点算出，
+// 几何数据在场景销毁前必须保持有效
+int scene_add(scene_t *scene, const vertex_t *vertices, const vector_t *normals, 
+    int vertex_count, const int *indices, int index_count, const matrix_t *world) {
+    scene_object_t *obj;
+    int i;
+    if (scene->count == scene->capacity) {
+        int capacity = (scene->capacity > 0)? scene->capacity * 2 : 64;
+        scene_object_t *objects = (scene_object_t*)realloc(scene->objects, 
+            sizeof(scene_object_t) * capacity);
+        if (objects == NULL) return -1;
+        scene->objects = objects;
+        scene->capacity = capacity;
+    }
+    obj = &scene->objects[scene->count];
+    obj->world = *world;
+    obj->vertices = vertices;
+    obj->normals = normals;
+    obj->indices = indices;
+    obj->vertex_count = vertex_count;
+    obj->index_count = index_count;
+    memset(&obj->local_min, 0, sizeof(vector_t));
+    if (vertex_count > 0) obj->local_min = vertices[0].pos;
+    obj->local_max = obj->local_min;
+    for (i = 1; i < vertex_count; i++) {
+        const point_t *p = &vertices[i].pos;
+        if (p->x < obj->local_min.x) obj->local_min.x = p->x;
+        if (p->y < obj->local_min.y) obj->local_min.y = p->y;
+        if (p->z < obj->local_min.z) obj->local_min.z = p->z;
+        if (p->x > obj->local_max.x) obj->local_max.x = p->x;
+        if (p->y > obj->local_max.y) obj->local_max.y = p->y;
+        if (p->z > obj->local_max.z) obj->local_max.z = p->z;
+    }
+    scene_object_bound(obj);
+    scene->dirty = 1;
+    return scene->count++;
+}
+
+// 修改物体的世界矩阵，BVH 的结构不变，绘制前只更新节点的包围盒
+void scene_set_world(scene_t *scene, int index, const matrix_t *world) {
+    scene_object_t *obj = &scene->objects[index];
+    obj->world = *world;
+    scene_object_bound(obj);
+    if (scene->dirty == 0) scene->dirty = 2;
+}
+
+// 由 [first, first + count) 中物体的包围盒计算节点的包围盒
+void scene_node_bound(scene_t *scene, bvh_node_t *node, int first, int count) {
+    int i, j;
+    node->bound_min = scene->objects[scene->order[first]].bound_min;
+    node->bound_max = scene->objects[scene->order[first]].bound_max;
+    for (i = first + 1; i < first + count; i++) {
+        const scene_object_t *obj = &scene->objects[scene->order[i]];
+        for (j = 0; j < 3; j++) {
+            if ((&obj->bound_min.x)[j] < (&node->bound_min.x)[j]) 
+                (&node->bound_min.x)[j] = (&obj->bound_min.x)[j];
+            if ((&obj->bound_max.x)[j] > (&node->bound_max.x)[j]) 
+                (&node->bound_max.x)[j] = (&obj->bound_max.x)[j];
+        }
+    }
+}
+
+// 物体包围盒中心在 axis 轴上的坐标（的两倍）
+FORCE_INLINE float scene_centroid(const scene_t *scene, int index, int axis) {
+    const scene_object_t *obj = &scene->objects[index];
+    return (&obj->bound_min.x)[axis] + (&obj->bound_max.x)[axis];
+}
+
+// 重排 order[first, last)，使第 nth 个为按 axis 轴中心排序后的中位数，左边不大于、右边不小于它
+void scene_select(scene_t *scene, int first, int last, int nth, int axis) {
+    int *order = scene->order;
+    while (last - first > 1) {
+        float pivot = scene_centroid(scene, order[(first + last) / 2], axis);
+        int i = first, j = last - 1;
+        while (i <= j) {
+            while (scene_centroid(scene, order[i], axis) < pivot) i++;
+            while (scene_centroid(scene, order[j], axis) > pivot) j--;
+            if (i <= j) {
+                int t = order[i];
+                order[i++] = order[j];
+                order[j--] = t;
+            }
+        }
+        if (nth <= j) last = j + 1;
+        else if (nth >= i) first = i;
+        else break;
+    }
+}
+
+// 递归建立 [first, first + count) 的子树，按中心包围盒最长的轴在中位数处一分为二，返回节点下标
+int scene_build_node(scene_t *scene, int first, int count) {
+    int index = scene->node_count++;
+    bvh_node_t *node = &scene->nodes[index];
+    scene_node_bound(scene, node, first, count);
+    node->first = first;
+    node->count = count;
+    node->right = 0;
+    node->axis = 0;
+    if (count > SCENE_LEAF_SIZE) {
+        float cmin[3], cmax[3], size = -1.0f;
+        int i, j, half = count / 2;
+        for (j = 0; j < 3; j++) {
+            cmin[j] = cmax[j] = scene_centroid(scene, scene->order[first], j);
+        }
+        for (i = first + 1; i < first + count; i++) {
+            for (j = 0; j < 3; j++) {
+                float c = scene_centroid(scene, scene->order[i], j);
+                if (c < cmin[j]) cmin[j] = c;
+                if (c > cmax[j]) cmax[j] = c;
+            }
+        }
+        for (j = 0; j < 3; j++) {
+            if (cmax[j] - cmin[j] > size) size = cmax[j] - cmin[j], node->axis = j;
+        }
+        scene_select(scene, first, first + count, first + half, node->axis);
+        node->count = 0;
+        scene_build_node(scene, first, half);
+        scene->nodes[index].right = scene_build_node(scene, first + half, count - half);
+    }
+    return index;
+}
+
+// 重建 BVH，成功返回 0，内存不足返回 -1
+int scene_build(scene_t *scene) {
+    int i;
+    if (scene->order) free(scene->order);
+    if (scene->nodes) free(scene->nodes);
+    scene->order = NULL;
+    scene->nodes = NULL;
+    scene->node_count = 0;
+    if (scene->count == 0) {
+        scene->dirty = 0;
+        return 0;
+    }
+    scene->order = (int*)malloc(sizeof(int) * scene->count);
+    scene->nodes = (bvh_node_t*)malloc(sizeof(bvh_node_t) * (scene->count * 2 - 1));
+    if (scene->order == NULL || scene->nodes == NULL) return -1;
+    for (i = 0; i < scene->count; i++) scene->order[i] = i;
+    scene_build_node(scene, 0, scene->count);
+    scene->dirty = 0;
+    return 0;
+}
+
+// 物体移动后自底向上更新节点的包围盒：子节点的下标总是大于父节点
+void scene_refit(scene_t *scene) {
+    int i, j;
+    for (i = scene->node_count - 1; i >= 0; i--) {
+        bvh_node_t *node = &scene->nodes[i];
+        if (node->count > 0) {
+            scene_node_bound(scene, node, node->first, node->count);
+        }   else {
+            const bvh_node_t *a = node + 1, *b = &scene->nodes[node->right];
+            for (j = 0; j < 3; j++) {
+                float *lo = &node->bound_min.x, *hi = &node->bound_max.x;
+                lo[j] = ((&a->bound_min.x)[j] < (&b->bound_min.x)[j])? 
+                    (&a->bound_min.x)[j] : (&b->bound_min.x)[j];
+                hi[j] = ((&a->bound_max.x)[j] > (&b->bound_max.x)[j])? 
+                    (&a->bound_max.x)[j] : (&b->bound_max.x)[j];
+            }
+        }
+    }
+    scene->dirty = 0;
+}
+
+// 从 view * projection 中取出视锥的 6 个平面（行向量约定，裁剪坐标的分量是矩阵的列）
+void frustum_init(frustum_t *f, const transform_t *ts) {
+    static const int column[6] = { 0, 0, 1, 1, 2, 2 };
+    static const float sign[6] = { 1, -1, 1, -1, 1, -1 };
+    matrix_t m;
+    int k, i;
+    matrix_mul(&m, &ts->view, &ts->projection);
+    for (k = 0; k < 6; k++) {
+        float *p = &f->plane[k].x;
+        for (i = 0; i < 4; i++) {
+            if (k == 4) p[i] = m.m[i][2];                   // z >= 0
+            else p[i] = m.m[i][3] + sign[k] * m.m[i][column[k]];
+        }
+    }
+    f->front.x = ts->view.m[0][2];
+    f->front.y = ts->view.m[1][2];
+    f->front.z = ts->view.m[2][2];
+    f->front.w = 0.0f;
+}
+
+// 包围盒与视锥求交。mask 的第 k 位为 1 表示还需要检查第 k 个平面；
+// 完全在外时返回 -1，否则返回包围盒仍然跨越的平面，0 表示完全在视锥内
+int frustum_test_box(const frustum_t *f, const vector_t *bmin, const vector_t *bmax, int mask) {
+    int k;
+    for (k = 0; k < 6; k++) {
+        const vector_t *p = &f->plane[k];
+        float far_d, near_d;
+        if ((mask & (1 << k)) == 0) continue;
+        far_d = p->w + p->x * ((p->x > 0)? bmax->x : bmin->x) + 
+            p->y * ((p->y > 0)? bmax->y : bmin->y) + p->z * ((p->z > 0)? bmax->z : bmin->z);
+        if (far_d < 0.0f) return -1;
+        near_d = p->w + p->x * ((p->x > 0)? bmin->x : bmax->x) + 
+            p->y * ((p->y > 0)? bmin->y : bmax->y) + p->z * ((p->z > 0)? bmin->z : bmax->z);
+        if (near_d >= 0.0f) mask &= ~(1 << k);
+    }
+    return mask;
+}
+
+// 以物体自己的世界矩阵绘制
+void device_draw_object(device_t *device, const scene_object_t *obj) {
+    device->transform.world = obj->world;
+    transform_update(&device->transform);
+    device_draw_indexed(device, obj->vertices, obj->normals, obj->vertex_count, 
+        obj->indices, obj->index_count);
+}
+
+// 等待合并绘制的可见物体：都与 first 共用同一份几何数据
+typedef struct {
+    const scene_object_t *first;
+    matrix_t worlds[SCENE_BATCH_SIZE];
+    int count;
+}   scene_batch_t;
+
+void scene_batch_flush(device_t *device, scene_batch_t *batch) {
+    const scene_object_t *obj = batch->first;
+    if (batch->count == 0) return;
+    device_draw_instanced(device, obj->vertices, obj->normals, obj->vertex_count, 
+        obj->indices, obj->index_count, batch->worlds, NULL, batch->count);
+    batch->count = 0;
+}
+
+void scene_batch_add(device_t *device, scene_batch_t *batch, const scene_object_t *obj) {
+    const scene_object_t *first = batch->first;
+    if (batch->count == SCENE_BATCH_SIZE || (batch->count > 0 && 
+        (obj->vertices != first->vertices || obj->normals != first->normals || 
+        obj->indices != first->indices || obj->vertex_count != first->vertex_count || 
+        obj->index_count != first->index_count))) {
+        scene_batch_flush(device, batch);
+    }
+    if (batch->count == 0) batch->first = obj;
+    batch->worlds[batch->count++] = obj->world;
+}
+
+// 用当前的 view / projection 绘制场景：遍历 BVH，与视锥不相交的子树整棵跳过，
+// 完全在视锥内的子树不再检查平面；两个子节点按视线方向由近及远访问，
+// 让分层深度剔除尽早生效。相邻的可见物体共用几何数据时合并为实例化绘制。
+// 返回绘制的物体数，内存不足无法建立 BVH 时返回 -1
+int device_draw_scene(device_t *device, scene_t *scene) {
+    frustum_t frustum;
+    scene_batch_t batch;
+    int stack[64][2], top = 0, drawn = 0, i;
+    if (scene->dirty == 1 && scene_build(scene) != 0) return -1;
+    if (scene->dirty == 2) scene_refit(scene);
+    if (scene->node_count == 0) return 0;
+    frustum_init(&frustum, &device->transform);
+    batch.first = NULL;
+    batch.count = 0;
+    stack[top][0] = 0;
+    stack[top][1] = 63;
+    top++;
+    while (top > 0) {
+        const bvh_node_t *node;
+        int index, mask;
+        top--;
+        index = stack[top][0];
+        node = &scene->nodes[index];
+        mask = stack[top][1];
+        if (mask) mask = frustum_test_box(&frustum, &node->bound_min, &node->bound_max, mask);
+        if (mask < 0) continue;
+        if (node->count == 0) {             // 先压入远的子节点
+            int near_first = ((&frustum.front.x)[node->axis] >= 0.0f);
+            stack[top][0] = near_first? node->right : index + 1;
+            stack[top][1] = mask;
+            top++;
+            stack[top][0] = near_first? index + 1 : node->right;
+            stack[top][1] = mask;
+            top++;
+            continue;
+        }
+        for (i = node->first; i < node->first + node->count; i++) {
+            const scene_object_t *obj = &scene->objects[scene->order[i]];
+            if (mask && frustum_test_box(&frustum, &obj->bound_min, &obj->bound_max, mask) < 0) 
+                continue;
+            scene_batch_add(device, &batch, obj);
+            drawn++;
+        }
+    }
+    scene_batch_flush(device, &batch);
+    return drawn;
+}
+
+
+//=====================================================================
+// 命令缓冲：录制一帧的绘制，结束时按渲染状态、纹理排序，同一状态内按
+// 观察空间深度由近及远，让深度测试（rhw >= zbuffer[x]）和分层深度剔除
+// 尽早拒绝被遮挡的像素。录制的命令可以反复执行，用于基准测试
+//=====================================================================
+#define COMMAND_BATCH_SIZE  64      // 相邻的同一网格命令合并为一次实例化绘制的上限
+
+typedef struct {
+    int render_state;               // 录制时的 device->render_state
+    texture_level_t texture;        // 录制时的第 0 层纹理（device->tex_image）
+    const vertex_t *vertices;       // 几何数据只引用不复制，执行前必须保持有效
+    const vector_t *normals;
+    const int *indices;
+    int vertex_count;
+    int index_count;
+    matrix_t world;
+    color_t color;                  // 实例颜色，tinted 为 0 时不使用
+    int tinted;
+    float depth;                    // 世界矩阵的原点在观察空间的 z
+    int index;                      // 录制的顺序，深度相同时保持原来的先后
+}   draw_command_t;
+
+typedef struct command_buffer_t {
+    draw_command_t *commands;
+    int count, capacity;
+}   command_buffer_t;
+
+void command_buffer_init(command_buffer_t *cb) {
+    memset(cb, 0, sizeof(command_buffer_t));
+}
+
+void command_buffer_destroy(command_buffer_t *cb) {
+    if (cb->commands) free(cb->commands);
+    memset(cb, 0, sizeof(command_buffer_t));
+}
+
+// 开始录制：清空 cb，之后 device_draw_indexed / device_draw_instanced（以及
+// 经由它们的 device_draw_mesh、device_draw_scene）只记录命令不绘制。
+// device_draw_primitive 引用的是调用者栈上的顶点，仍然立即绘制
+void device_begin_commands(device_t *device, command_buffer_t *cb) {
+    assert(device->commands == NULL);
+    cb->count = 0;
+    device->commands = cb;
+}
+
+// 录制一次绘制，内存不足时立即绘制
+void device_record_draw(device_t *device, const vertex_t *vertices, const vector_t *normals, 
+    int count, const int *indices, int index_count, const matrix_t *world, const color_t *color) {
+    command_buffer_t *cb = device->commands;
+    draw_command_t *cmd;
+    if (cb->count == cb->capacity) {
+        int capacity = (cb->capacity > 0)? cb->capacity * 2 : 256;
+        draw_command_t *commands = (draw_command_t*)realloc(cb->commands, 
+            sizeof(draw_command_t) * capacity);
+        if (commands == NULL) {
+            device->commands = NULL;
+            device->transform.world = *world;
+            transform_update(&device->transform);
+            device_draw_instanced(device, vertices, normals, count, indices, index_count, 
+                world, color, 1);
+            device->commands = cb;
+            return;
+        }
+        cb->commands = commands;
+        cb->capacity = capacity;
+    }
+    cmd = &cb->commands[cb->count];
+    cmd->render_state = device->render_state;
+    cmd->texture = device->tex_image;
+    cmd->vertices = vertices;
+    cmd->normals = normals;
+    cmd->indices = indices;
+    cmd->vertex_count = count;
+    cmd->index_count = index_count;
+    cmd->world = *world;
+    cmd->tinted = (color != NULL);
+    if (color) cmd->color = *color;
+    cmd->depth = 0.0f;
+    cmd->index = cb->count++;
+}
+
+// 纹理的标识：第 0 层的数据指针
+FORCE_INLINE size_t command_texture_key(const texture_level_t *t) {
+    return (t->format == TEXTURE_RGB32)? (size_t)t->bits : (size_t)t->data;
+}
+
+// 两个纹理是否相同：执行时相同的不必重新设置（重新设置会重建 mip）
+int command_texture_equal(const texture_level_t *a, const texture_level_t *b) {
+    return a->format == b->format && a->bits == b->bits && a->data == b->data && 
+        a->pitch == b->pitch && a->width == b->width && a->height == b->height && 
+        a->palette == b->palette;
+}
+
+int command_compare(const void *pa, const void *pb) {
+    const draw_command_t *a = (const draw_command_t*)pa, *b = (const draw_command_t*)pb;
+    size_t ta = command_texture_key(&a->texture), tb = command_texture_key(&b->texture);
+    if (a->render_state != b->render_state) return (a->render_state < b->render_state)? -1 : 1;
+    if (ta != tb) return (ta < tb)? -1 : 1;
+    if (a->depth != b->depth) return (a->depth < b->depth)? -1 : 1;
+    return a->index - b->index;
+}
+
+// 按渲染状态、纹理、由近及远排序。深度用 ts 的 view 计算，摄影机移动后重新播放前可以再调用
+void command_buffer_sort(command_buffer_t *cb, const transform_t *ts) {
+    const matrix_t *v = &ts->view;
+    int i;
+    for (i = 0; i < cb->count; i++) {
+        draw_command_t *cmd = &cb->commands[i];
+        const float *o = cmd->world.m[3];
+        cmd->depth = o[0] * v->m[0][2] + o[1] * v->m[1][2] + o[2] * v->m[2][2] + v->m[3][2];
+    }
+    qsort(cb->commands, cb->count, sizeof(draw_command_t), command_compare);
+}
+
+// 结束录制并排序
+void device_end_commands(device_t *device) {
+    command_buffer_t *cb = device->commands;
+    assert(cb != NULL);
+    device->commands = NULL;
+    command_buffer_sort(cb, &device->transform);
+}
+
+// 两条命令能否合并为一次实例化绘制
+int command_same_batch(const draw_command_t *a, const draw_command_t *b) {
+    return a->vertices == b->vertices && a->normals == b->normals && a->indices == b->indices &&
+        a->vertex_count == b->vertex_count && a->index_count == b->index_count &&
+        a->render_state == b->render_state && command_texture_equal(&a->texture, &b->texture);
+}
+
+// 按顺序执行录制的命令，只在渲染状态或纹理改变时重新设置；相邻的同一网格
+// 合并为 device_draw_instanced。使用设备当前的 view / projection 和光照，
+// 执行后设备保留最后一条命令的渲染状态和纹理
+void device_execute_commands(device_t *device, const command_buffer_t *cb) {
+    matrix_t worlds[COMMAND_BATCH_SIZE];
+    color_t colors[COMMAND_BATCH_SIZE];
+    int i = 0, k, n;
+    assert(device->commands == NULL);
+    while (i < cb->count) {
+        const draw_command_t *cmd = &cb->commands[i];
+        const texture_level_t *t = &cmd->texture;
+        int tinted = cmd->tinted;
+        for (n = 1; i + n < cb->count && n < COMMAND_BATCH_SIZE; n++) {
+            if (!command_same_batch(cmd, &cb->commands[i + n])) break;
+            tinted |= cb->commands[i + n].tinted;
+        }
+        device->render_state = cmd->render_state;
+        if (t->width > 0 && !command_texture_equal(&device->tex_image, t)) {
+            device_set_texture_format(device, t->format, (t->format == TEXTURE_RGB32)? 
+                (const void*)t->bits : (const void*)t->data, t->pitch, t->width, t->height, 
+                t->palette);
+        }
+        if (n == 1 && !tinted) {    // 单个的大网格不值得实例化绘制多走一遍索引
+            device->transform.world = cmd->world;
+            transform_update(&device->transform);
+            device_draw_indexed(device, cmd->vertices, cmd->normals, cmd->vertex_count, 
+                cmd->indices, cmd->index_count);
+        }   else {
+            for (k = 0; k < n; k++) {
+                const draw_command_t *c = &cb->commands[i + k];
+                static const color_t white = { 1.0f, 1.0f, 1.0f };
+                worlds[k] = c->world;
+                colors[k] = c->tinted? c->color : white;
+            }
+            device_draw_instanced(device, cmd->vertices, cmd->normals, cmd->vertex_count, 
+                cmd->indices, cmd->index_count, worlds, tinted? colors : NULL, n);
+        }
+        i += n;
+    }
+}
+
+
+//=====================================================================
+// 录制与重放：把影响画面的调用（设备尺寸、纹理、变换与渲染状态、光照、
+// 清屏、绘制）写入二进制的 trace 文件，无窗口地重新执行。同样的网格和纹理
+// 只写一次；每帧结束时记下帧缓存的散列，重放时逐帧比较，同一个文件既是
+// 性能测试的输入，也是逐位一致的参考图像
+//=====================================================================
+#define TRACE_MAGIC         0x5444334d  // "M3DT"
+#define TRACE_VERSION       2
+#define TRACE_ALIGN         16          // 记录及记录内各数组的对齐
+
+#define TRACE_STATE         1           // trace_state_t
+#define TRACE_CLEAR         2           // id 为 device_clear 的 mode
+#define TRACE_TEXTURE_DATA  3           // 定义第 id 个纹理：trace_texture_t、调色板、各行数据
+#define TRACE_TEXTURE       4           // 换成第 id 个纹理
+#define TRACE_GEOMETRY      5           // 定义第 id 个网格：顶点数与索引数、顶点、法向量、索引
+#define TRACE_PRIMITIVE     6           // device_draw_primitive：三个顶点和面法向量
+#define TRACE_INDEXED       7           // device_draw_indexed 绘制第 id 个网格
+#define TRACE_INSTANCED     8           // device_draw_instanced：count 个世界矩阵，记录更长时后跟颜色
+#define TRACE_FRAME         9           // 一帧结束：帧缓存的散列
+
+typedef struct {
+    unsigned int magic;             // TRACE_MAGIC，字节序不同时不匹配
+    unsigned int version;           // TRACE_VERSION
+    unsigned int vertex_size;       // sizeof(vertex_t)，与当前编译的布局不同时拒绝载入
+    unsigned int state_size;        // sizeof(trace_state_t)
+    int width, height;              // device_init 的尺寸
+    int reserved[2];
+}   trace_header_t;
+
+typedef struct {
+    unsigned int op;                // TRACE_*
+    unsigned int size;              // 记录的总长度，包括本头部，为 TRACE_ALIGN 的整数倍
+    int id;                         // 纹理、网格的编号，或 op 的参数
+    int count;                      // TRACE_INSTANCED 的实例数
+}   trace_record_t;
+
+// 绘制时读取的设备状态，与上一次写出的不同时才写入
+typedef struct {
+    matrix_t world, view, projection, transform;    // transform 原样保存，不重新相乘
+    int render_state;
+    int rasterizer;
+    int depth_write;
+    int depth_format;               // DEPTH_*，改变时原有的深度作废
+    int cull;                       // REMOVE_BACKFACE
+    int tex_filter;
+    int tex_layout;
+    IUINT32 background;
+    IUINT32 foreground;
+    float ambient, diffuse, specular;
+    IUINT32 shininess;
+    int light_count;
+    light_t lights[MAX_LIGHTS];     // 多出的光源清零
+}   trace_state_t;
+
+typedef struct {
+    int format;                     // TEXTURE_*
+    int width, height;
+    int row;                        // 每行（BC 为每行块）的字节数，各行紧密排列
+}   trace_texture_t;
+
+// 已经写出的纹理或网格：按内容的散列识别，与指针无关
+typedef struct {
+    IUINT64 hash;
+    int count[3];
+}   trace_entry_t;
+
+typedef struct trace_writer_t {
+    FILE *fp;
+    trace_state_t state;            // 最近写出的状态
+    int has_state;
+    trace_entry_t *geometries;
+    int geometry_count, geometry_capacity;
+    trace_entry_t *textures;
+    int texture_count, texture_capacity;
+    int frames;
+    int error;                      // 写入失败
+}   trace_writer_t;
+
+// 按 32 位字计算的 FNV-1a
+IUINT64 trace_hash(IUINT64 h, const void *data, size_t size) {
+    const unsigned char *p = (const unsigned char*)data;
+    size_t i;
+    for (i = 0; i + 4 <= size; i += 4) {
+        IUINT32 w;
+        memcpy(&w, p + i, 4);
+        h = (h ^ w) * 1099511628211ULL;
+    }
+    for (; i < size; i++) h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
+
+#define TRACE_HASH_INIT     14695981039346656037ULL
+
+// 帧缓存的散列，重放时据此判断是否逐位一致
+IUINT64 trace_frame_hash(const device_t *device) {
+    IUINT64 h = TRACE_HASH_INIT;
+    int y;
+    for (y = 0; y < device->height; y++) 
+        h = trace_hash(h, device->framebuffer[y], sizeof(IUINT32) * device->width);
+    return h;
+}
+
+size_t trace_align(size_t size) {
+    return (size + TRACE_ALIGN - 1) & ~(size_t)(TRACE_ALIGN - 1);
+}
+
+// 纹理第 0 层每行的字节数与行数（BC 为块）
+void trace_texture_size(int format, int w, int h, long *row, int *rows) {
+    *row = (format == TEXTURE_BC1)? (w + 3) / 4 * 8 : ((format == TEXTURE_BC3)? 
+        (w + 3) / 4 * 16 : ((format == TEXTURE_P8)? w : w * 4));
+    *rows = (format == TEXTURE_BC1 || format == TEXTURE_BC3)? (h + 3) / 4 : h;
+}
+
+// 已经写入 size 字节后补齐到 TRACE_ALIGN
+void trace_pad(trace_writer_t *tw, size_t size) {
+    static const char zero[TRACE_ALIGN] = { 0 };
+    size_t pad = trace_align(size) - size;
+    if (pad > 0 && fwrite(zero, 1, pad, tw->fp) != pad) tw->error = 1;
+}
+
+// 写入 size 字节并补齐
+void trace_write(trace_writer_t *tw, const void *data, size_t size) {
+    if (size > 0 && fwrite(data, 1, size, tw->fp) != size) tw->error = 1;
+    trace_pad(tw, size);
+}
+
+// 写入记录头，payload 为头部之后的字节数（各段已经补齐）
+void trace_write_record(trace_writer_t *tw, int op, size_t payload, int id, int count) {
+    trace_record_t r;
+    if (payload > 0xffffffffu - sizeof(trace_record_t)) {
+        tw->error = 1;
+        payload = 0;
+    }
+    r.op = op;
+    r.size = (unsigned int)(sizeof(trace_record_t) + payload);
+    r.id = id;
+    r.count = count;
+    trace_write(tw, &r, sizeof(r));
+}
+
+// 在 entries 中查找散列和数量都相同的一项，没有时加入，*found 表示是否已经存在
+int trace_entry_find(trace_entry_t **entries, int *count, int *capacity, 
+    IUINT64 hash, int c0, int c1, int c2, int *found) {
+    trace_entry_t *e;
+    int i;
+    for (i = 0; i < *count; i++) {
+        e = &(*entries)[i];
+        if (e->hash == hash && e->count[0] == c0 && e->count[1] == c1 && e->count[2] == c2) {
+            *found = 1;
+            return i;
+        }
+    }
+    if (*count == *capacity) {
+        int n = (*capacity > 0)? *capacity * 2 : 16;
+        e = (trace_entry_t*)realloc(*entries, sizeof(trace_entry_t) * n);
+        if (e == NULL) return -1;
+        *entries = e;
+        *capacity = n;
+    }
+    e = &(*entries)[*count];
+    e->hash = hash;
+    e->count[0] = c0, e->count[1] = c1, e->count[2] = c2;
+    *found = 0;
+    return (*count)++;
+}
+
+void trace_get_state(const device_t *device, trace_state_t *s) {
+    const lighting_t *lighting = &device->lighting;
+    memset(s, 0, sizeof(trace_state_t));
+    s->world = device->transform.world;
+    s->view = device->transform.view;
+    s->projection = device->transform.projection;
+    s->transform = device->transform.transform;
+    s->render_state = device->render_state;
+    s->rasterizer = device->rasterizer;
+    s->depth_write = device->depth_write;
+    s->depth_format = device->depth_format;
+    s->cull = REMOVE_BACKFACE;
+    s->tex_filter = device->tex_filter;
+    s->tex_layout = device->tex_layout;
+    s->background = device->background;
+    s->foreground = device->foreground;
+    s->ambient = lighting->ambient;
+    s->diffuse = lighting->diffuse;
+    s->specular = lighting->specular;
+    s->shininess = lighting->shininess;
+    s->light_count = lighting->count;
+    memcpy(s->lights, lighting->lights, sizeof(light_t) * lighting->count);
+}
+
+void trace_set_state(device_t *device, const trace_state_t *s) {
+    lighting_t *lighting = &device->lighting;
+    device->transform.world = s->world;
+    device->transform.view = s->view;
+    device->transform.projection = s->projection;
+    device->transform.transform = s->transform;
+    device->render_state = s->render_state;
+    device->rasterizer = s->rasterizer;
+    device->depth_write = s->depth_write;
+    REMOVE_BACKFACE = s->cull;
+    device->background = s->background;
+    device->foreground = s->foreground;
+    lighting->ambient = s->ambient;
+    lighting->diffuse = s->diffuse;
+    lighting->specular = s->specular;
+    lighting->shininess = s->shininess;
+    lighting->count = s->light_count;
+    memcpy(lighting->lights, s->lights, sizeof(light_t) * s->light_count);
+    if (device->tex_filter != s->tex_filter) device_set_texture_filter(device, s->tex_filter);
+    if (device->tex_layout != s->tex_layout) device_set_texture_layout(device, s->tex_layout);
+    if (device->depth_format != s->depth_format) device_set_depth_format(device, s->depth_format);
+}
+
+// 状态与上次写出的不同时写入
+void trace_write_state(device_t *device) {
+    trace_writer_t *tw = device->trace;
+    trace_state_t s;
+    trace_get_state(device, &s);
+    if (tw->has_state && memcmp(&s, &tw->state, sizeof(s)) == 0) return;
+    trace_write_record(tw, TRACE_STATE, trace_align(sizeof(s)), 0, 0);
+    trace_write(tw, &s, sizeof(s));
+    tw->state = s;
+    tw->has_state = 1;
+}
+
+// 录制当前纹理（device->tex_image），内容相同的纹理只写一次数据
+void trace_write_texture(device_t *device) {
+    trace_writer_t *tw = device->trace;
+    const texture_level_t *t = &device->tex_image;
+    const unsigned char *bits = (t->format == TEXTURE_RGB32)? 
+        (const unsigned char*)t->bits : t->data;
+    long pitch = (t->format == TEXTURE_RGB32)? t->pitch * 4 : t->pitch, row;
+    IUINT64 hash = TRACE_HASH_INIT;
+    int rows, y, id, found;
+    trace_texture_size(t->format, t->width, t->height, &row, &rows);
+    for (y = 0; y < rows; y++) hash = trace_hash(hash, bits + pitch * y, row);
+    if (t->format == TEXTURE_P8) hash = trace_hash(hash, t->palette, sizeof(IUINT32) * 256);
+    id = trace_entry_find(&tw->textures, &tw->texture_count, &tw->texture_capacity, 
+        hash, t->format, t->width, t->height, &found);
+    if (id < 0) {
+        tw->error = 1;
+        return;
+    }
+    if (!found) {
+        trace_texture_t info;
+        size_t size = trace_align(sizeof(info)) + trace_align((size_t)row * rows);
+        info.format = t->format;
+        info.width = t->width;
+        info.height = t->height;
+        info.row = (int)row;
+        if (t->format == TEXTURE_P8) size += trace_align(sizeof(IUINT32) * 256);
+        trace_write_record(tw, TRACE_TEXTURE_DATA, size, id, 0);
+        trace_write(tw, &info, sizeof(info));
+        if (t->format == TEXTURE_P8) trace_write(tw, t->palette, sizeof(IUINT32) * 256);
+        for (y = 0; y < rows; y++) {
+            if (fwrite(bits + pitch * y, 1, row, tw->fp) != (size_t)row) tw->error = 1;
+        }
+        trace_pad(tw, (size_t)row * rows);
+    }
+    trace_write_record(tw, TRACE_TEXTURE, 0, id, 0);
+}
+
+void trace_write_clear(device_t *device, int mode) {
+    trace_write_state(device);
+    trace_write_record(device->trace, TRACE_CLEAR, 0, mode, 0);
+}
+
+void trace_write_primitive(device_t *device, const vertex_t *v1, const vertex_t *v2, 
+    const vertex_t *v3, const vector_t *normal) {
+    trace_writer_t *tw = device->trace;
+    vertex_t v[3];
+    v[0] = *v1, v[1] = *v2, v[2] = *v3;
+    trace_write_state(device);
+    trace_write_record(tw, TRACE_PRIMITIVE, trace_align(sizeof(v)) + 
+        trace_align(sizeof(vector_t)), 0, 0);
+    trace_write(tw, v, sizeof(v));
+    trace_write(tw, normal, sizeof(vector_t));
+}
+
+// 录制索引绘制（worlds 为 NULL）或实例化绘制，网格按内容只写一次
+void trace_write_draw(device_t *device, const vertex_t *vertices, const vector_t *normals, 
+    int count, const int *indices, int index_count, const matrix_t *worlds, 
+    const color_t *colors, int instance_count) {
+    trace_writer_t *tw = device->trace;
+    IUINT64 hash = TRACE_HASH_INIT;
+    int id, found, size[4];
+    hash = trace_hash(hash, vertices, sizeof(vertex_t) * count);
+    hash = trace_hash(hash, normals, sizeof(vector_t) * count);
+    hash = trace_hash(hash, indices, sizeof(int) * index_count);
+    id = trace_entry_find(&tw->geometries, &tw->geometry_count, &tw->geometry_capacity, 
+        hash, count, index_count, 0, &found);
+    if (id < 0) {
+        tw->error = 1;
+        return;
+    }
+    if (!found) {
+        size[0] = count, size[1] = index_count, size[2] = size[3] = 0;
+        trace_write_record(tw, TRACE_GEOMETRY, trace_align(sizeof(size)) + 
+            trace_align(sizeof(vertex_t) * count) + trace_align(sizeof(vector_t) * count) + 
+            trace_align(sizeof(int) * index_count), id, 0);
+        trace_write(tw, size, sizeof(size));
+        trace_write(tw, vertices, sizeof(vertex_t) * count);
+        trace_write(tw, normals, sizeof(vector_t) * count);
+        trace_write(tw, indices, sizeof(int) * index_count);
+    }
+    trace_write_state(device);
+    if (worlds == NULL) {
+        trace_write_record(tw, TRACE_INDEXED, 0, id, 0);
+        return;
+    }
+    trace_write_record(tw, TRACE_INSTANCED, trace_align(sizeof(matrix_t) * instance_count) + 
+        (colors? trace_align(sizeof(color_t) * instance_count) : 0), id, instance_count);
+    trace_write(tw, worlds, sizeof(matrix_t) * instance_count);
+    if (colors) trace_write(tw, colors, sizeof(color_t) * instance_count);
+}
+
+// 开始录制到 filename：写入文件头和当前纹理，之后的绘制状态在第一次绘制时写入。
+// 成功返回 0，无法创建文件返回 -1
+int trace_begin(device_t *device, trace_writer_t *tw, const char *filename) {
+    trace_header_t header;
+    memset(tw, 0, sizeof(trace_writer_t));
+    tw->fp = fopen(filename, "wb");
+    if (tw->fp == NULL) return -1;
+    memset(&header, 0, sizeof(header));
+    header.magic = TRACE_MAGIC;
+    header.version = TRACE_VERSION;
+    header.vertex_size = sizeof(vertex_t);
+    header.state_size = sizeof(trace_state_t);
+    header.width = device->width;
+    header.height = device->height;
+    trace_write(tw, &header, sizeof(header));
+    device->trace = tw;
+    trace_write_texture(device);
+    return 0;
+}
+
+// 一帧结束：画完已分箱的图元，记下帧缓存的散列
+void trace_frame(device_t *device) {
+    trace_writer_t *tw = device->trace;
+    IUINT64 hash[2];
+    if (tw == NULL) return;
+    device_flush(device);
+    hash[0] = trace_frame_hash(device);
+    hash[1] = 0;
+    trace_write_record(tw, TRACE_FRAME, sizeof(hash), 0, 0);
+    trace_write(tw, hash, sizeof(hash));
+    tw->frames++;
+}
+
+// 结束录制，成功返回 0，写入失败返回 -1
+int trace_end(device_t *device) {
+    trace_writer_t *tw = device->trace;
+    int hr;
+    if (tw == NULL) return 0;
+    if (fclose(tw->fp) != 0) tw->error = 1;
+    hr = tw->error? -1 : 0;
+    free(tw->geometries);
+    free(tw->textures);
+    tw->geometries = tw->textures = NULL;
+    device->trace = NULL;
+    return hr;
+}
+
+// 载入的 trace：映射整个文件，纹理和网格直接引用映射的内存
+typedef struct {
+    const void *base;
+    size_t size;
+    const trace_header_t *header;
+    const trace_record_t **textures;    // 第 id 个纹理的 TRACE_TEXTURE_DATA 记录
+    const trace_record_t **geometries;  // 第 id 个网格的 TRACE_GEOMETRY 记录
+    int texture_count;
+    int geometry_count;
+    int frame_count;
+}   trace_t;
+
+// 检查一条记录的内容，纹理和网格的定义加入索引，合法返回 0
+int trace_check_record(trace_t *trace, const trace_record_t *r) {
+    const char *p = (const char*)(r + 1);
+    size_t payload = r->size - sizeof(trace_record_t);
+    switch (r->op) {
+    case TRACE_STATE: {
+        const trace_state_t *s = (const trace_state_t*)p;
+        if (payload < sizeof(trace_state_t)) return -1;
+        if (s->light_count < 0 || s->light_count > MAX_LIGHTS) return -1;
+        if (s->tex_filter < 0 || s->tex_filter > TEXTURE_TRILINEAR) return -1;
+        if (s->tex_layout < 0 || s->tex_layout > TEXTURE_MORTON) return -1;
+        if (s->depth_format != DEPTH_FLOAT32 && s->depth_format != DEPTH_UNORM16) return -1;
+        if (s->rasterizer != RASTERIZER_TRAPEZOID && s->rasterizer != RASTERIZER_HALFSPACE) 
+            return -1;
+        return 0;
+    }
+    case TRACE_CLEAR:
+    case TRACE_FRAME:
+        return (r->op == TRACE_FRAME && payload < sizeof(IUINT64) * 2)? -1 : 0;
+    case TRACE_TEXTURE_DATA: {
+        const trace_texture_t *t = (const trace_texture_t*)p;
+        size_t need = trace_align(sizeof(trace_texture_t));
+        long row;
+        int rows;
+        if (payload < need || r->id != trace->texture_count) return -1;
+        if (t->format != TEXTURE_RGB32 && t->format != TEXTURE_P8 && 
+            t->format != TEXTURE_BC1 && t->format != TEXTURE_BC3) return -1;
+        if (t->width <= 0 || t->height <= 0) return -1;
+        trace_texture_size(t->format, t->width, t->height, &row, &rows);
+        if (row != t->row) return -1;
+        if (t->format == TEXTURE_P8) need += trace_align(sizeof(IUINT32) * 256);
+        if ((double)row * rows + (double)need > (double)payload) return -1;
+        trace->textures[trace->texture_count++] = r;
+        return 0;
+    }
+    case TRACE_TEXTURE:
+        return (r->id >= 0 && r->id < trace->texture_count)? 0 : -1;
+    case TRACE_GEOMETRY: {
+        const int *size = (const int*)p;
+        const int *indices;
+        double need;
+        int i;
+        if (payload < sizeof(int) * 4 || r->id != trace->geometry_count) return -1;
+        if (size[0] < 0 || size[1] < 0) return -1;
+        need = (double)trace_align(sizeof(int) * 4) + 
+            (double)trace_align(sizeof(vertex_t) * (size_t)size[0]) + 
+            (double)trace_align(sizeof(vector_t) * (size_t)size[0]) + (double)sizeof(int) * size[1];
+        if (need > (double)payload) return -1;
+        indices = (const int*)(p + trace_align(sizeof(int) * 4) + 
+            trace_align(sizeof(vertex_t) * size[0]) + trace_align(sizeof(vector_t) * size[0]));
+        for (i = 0; i < size[1]; i++) {
+            if (indices[i] < 0 || indices[i] >= size[0]) return -1;
+        }
+        trace->geometries[trace->geometry_count++] = r;
+        return 0;
+    }
+    case TRACE_PRIMITIVE:
+        return (payload < trace_align(sizeof(vertex_t) * 3) + sizeof(vector_t))? -1 : 0;
+    case TRACE_INDEXED:
+        return (r->id >= 0 && r->id < trace->geometry_count)? 0 : -1;
+    case TRACE_INSTANCED: {
+        double worlds = (double)trace_align(sizeof(matrix_t) * (size_t)r->count);
+        if (r->id < 0 || r->id >= trace->geometry_count || r->count < 0) return -1;
+        if (worlds > (double)payload) return -1;
+        if (worlds < (double)payload && worlds + (double)sizeof(color_t) * r->count > 
+            (double)payload) return -1;
+        return 0;
+    }
+    }
+    return -1;
+}
+
+void trace_free(trace_t *trace) {
+    if (trace->base) file_unmap(trace->base, trace->size);
+    free(trace->textures);
+    free(trace->geometries);
+    memset(trace, 0, sizeof(trace_t));
+}
+
+// 载入 trace 文件并检查所有记录，成功返回 0，无法打开返回 -1，格式不符返回 -2
+int trace_load(trace_t *trace, const char *filename) {
+    const trace_header_t *h;
+    size_t offset, records = 0;
+    memset(trace, 0, sizeof(trace_t));
+    trace->base = file_map(filename, &trace->size);
+    if (trace->base == NULL) return -1;
+    h = (const trace_header_t*)trace->base;
+    if (trace->size < sizeof(trace_header_t) || h->magic != TRACE_MAGIC || 
+        h->version != TRACE_VERSION || h->vertex_size != sizeof(vertex_t) || 
+        h->state_size != sizeof(trace_state_t) || h->width < 2 || h->height < 2) {
+        trace_free(trace);
+        return -2;
+    }
+    trace->header = h;
+    // 纹理和网格的数量不超过记录数
+    for (offset = sizeof(trace_header_t); offset + sizeof(trace_record_t) <= trace->size; ) {
+        const trace_record_t *r = (const trace_record_t*)((const char*)trace->base + offset);
+        if (r->size < sizeof(trace_record_t) || r->size % TRACE_ALIGN != 0 || 
+            r->size > trace->size - offset) break;
+        offset += r->size;
+        records++;
+    }
+    trace->textures = (const trace_record_t**)malloc(sizeof(void*) * (records + 1));
+    trace->geometries = (const trace_record_t**)malloc(sizeof(void*) * (records + 1));
+    if (offset != trace->size || trace->textures == NULL || trace->geometries == NULL) {
+        trace_free(trace);
+        return -2;
+    }
+    for (offset = sizeof(trace_header_t); offset < trace->size; ) {
+        const trace_record_t *r = (const trace_record_t*)((const char*)trace->base + offset);
+        if (trace_check_record(trace, r) != 0) {
+            trace_free(trace);
+            return -2;
+        }
+        if (r->op == TRACE_FRAME) trace->frame_count++;
+        offset += r->size;
+    }
+    if (trace->frame_count == 0) {
+        trace_free(trace);
+        return -2;
+    }
+    return 0;
+}
+
+// 从 offset 开始重放到下一个 TRACE_FRAME（含），返回之后的位置；到达文件末尾时
+// 从头开始。设备须为文件头中的尺寸。*hash 为录制时这一帧的散列，调用者
+// device_flush 之后与 trace_frame_hash 比较（不计入重放的时间）
+size_t trace_play(device_t *device, const trace_t *trace, size_t offset, IUINT64 *hash) {
+    if (offset < sizeof(trace_header_t) || offset >= trace->size) offset = sizeof(trace_header_t);
+    assert(device->width == trace->header->width && device->height == trace->header->height);
+    while (offset < trace->size) {
+        const trace_record_t *r = (const trace_record_t*)((const char*)trace->base + offset);
+        const char *p = (const char*)(r + 1);
+        offset += r->size;
+        switch (r->op) {
+        case TRACE_STATE:
+            trace_set_state(device, (const trace_state_t*)p);
+            break;
+        case TRACE_CLEAR:
+            device_clear(device, r->id);
+            break;
+        case TRACE_TEXTURE: {
+            const trace_record_t *d = trace->textures[r->id];
+            const trace_texture_t *t = (const trace_texture_t*)(d + 1);
+            const char *q = (const char*)(d + 1) + trace_align(sizeof(trace_texture_t));
+            const IUINT32 *palette = NULL;
+            if (t->format == TEXTURE_P8) {
+                palette = (const IUINT32*)q;
+                q += trace_align(sizeof(IUINT32) * 256);
+            }
+            device_set_texture_format(device, t->format, q, 
+                (t->format == TEXTURE_RGB32)? t->width : t->row, t->width, t->height, palette);
+            break;
+        }
+        case TRACE_PRIMITIVE: {
+            const vertex_t *v = (const vertex_t*)p;
+            device_draw_primitive(device, &v[0], &v[1], &v[2], 
+                (const vector_t*)(p + trace_align(sizeof(vertex_t) * 3)));
+            break;
+        }
+        case TRACE_INDEXED:
+        case TRACE_INSTANCED: {
+            const trace_record_t *g = trace->geometries[r->id];
+            const int *size = (const int*)(g + 1);
+            const char *q = (const char*)(g + 1) + trace_align(sizeof(int) * 4);
+            const vertex_t *vertices = (const vertex_t*)q;
+            const vector_t *normals = (const vector_t*)(q + trace_align(sizeof(vertex_t) * size[0]));
+            const int *indices = (const int*)((const char*)normals + 
+                trace_align(sizeof(vector_t) * size[0]));
+            if (r->op == TRACE_INDEXED) {
+                device_draw_indexed(device, vertices, normals, size[0], indices, size[1]);
+            }   else {
+                size_t worlds = trace_align(sizeof(matrix_t) * r->count);
+                const color_t *colors = (r->size - sizeof(trace_record_t) > worlds)? 
+                    (const color_t*)(p + worlds) : NULL;
+                device_draw_instanced(device, vertices, normals, size[0], indices, size[1], 
+                    (const matrix_t*)p, colors, r->count);
+            }
+            break;
+        }
+        case TRACE_FRAME:
+            *hash = ((const IUINT64*)p)[0];
+            return offset;
+        }
+    }
+    return offset;
+}
+
+
+//=====================================================================
+// 纹理文件：BMP / TGA / DDS。像素已经是 32 位 BGRA（即小端的 0xAARRGGBB）且
+// 对齐时直接引用映射的文件，自下而上存储的用负的 pitch 表示，不做复制；8 位调色板
+// 和灰度按 TEXTURE_P8、DDS 的 DXT1 / DXT5 按 TEXTURE_BC1 / BC3 同样直接引用；
+// 其它格式（24 位、RLE）逐行转换到新分配的 32 位缓冲
+//=====================================================================
+typedef struct {
+    int format;                 // TEXTURE_RGB32 / P8 / BC1 / BC3
+    const void *bits;           // 第 0 行（图像最上面一行），BC 为第一行块
+    long pitch;                 // 相邻两行的间隔，RGB32 为 IUINT32 个数，其它为字节数，可以为负
+    int width;
+    int height;
+    IUINT32 palette[256];       // P8 的调色板
+    const void *map;            // 像素直接引用映射的文件时非 NULL
+    size_t map_size;
+    IUINT32 *buffer;            // 格式经过转换时分配的像素
+}   texture_t;
+
+// 位于文件偏移 offset 的 32 位像素能否直接引用。BMP 的像素通常从 54 字节开始，
+// 不是 4 字节对齐的；x86 上非对齐的读取和 gather 都没有限制，其它平台需要对齐
+int texture_can_map(size_t offset) {
+#ifdef MINI3D_X86
+    (void)offset;
+    return 1;
+#else
+    return offset % 4 == 0;
+#endif
+}
+
+// 分配 width x height 的转换缓冲，自上而下存储
+int texture_alloc(texture_t *tex, int width, int height) {
+    tex->buffer = (IUINT32*)malloc(sizeof(IUINT32) * width * height);
+    if (tex->buffer == NULL) return -1;
+    tex->format = TEXTURE_RGB32;
+    tex->bits = tex->buffer;
+    tex->pitch = width;
+    tex->width = width;
+    tex->height = height;
+    return 0;
+}
+
+// 把一行 bpp 位的像素转换为 0x00RRGGBB，8 位像素是灰度
+void texture_convert_row(IUINT32 *dst, const unsigned char *src, int width, int bpp) {
+    int i;
+    if (bpp == 32) {
+        memcpy(dst, src, width * 4);
+    }
+    else if (bpp == 24) {
+        for (i = 0; i < width; i++, src += 3) 
+            dst[i] = src[0] | (src[1] << 8) | (src[2] << 16);
+    }
+    else {
+        for (i = 0; i < width; i++) dst[i] = src[i] * 0x010101;
+    }
+}
+
+// 解析 BMP：支持不压缩的 8 / 24 / 32 位，以及标准掩码的 32 位 BI_BITFIELDS
+int texture_parse_bmp(texture_t *tex, const unsigned char *data, size_t size) {
+    unsigned int offset, header, bpp, compression, colors, i;
+    long stride;
+    int width, height, bottom_up, j;
+    if (size < 54) return -2;
+    offset = read_u32(data + 10);
+    header = read_u32(data + 14);
+    width = (int)read_u32(data + 18);
+    height = (int)read_u32(data + 22);
+    bpp = read_u16(data + 28);
+    compression = read_u32(data + 30);
+    colors = read_u32(data + 46);
+    bottom_up = (height > 0);
+    if (height < 0) height = -height;
+    if (header < 40 || width <= 0 || height <= 0 || width > 65536 || height > 65536) return -2;
+    if (bpp != 8 && bpp != 24 && bpp != 32) return -2;
+    if (compression == 3) {     // BI_BITFIELDS：掩码紧跟在 40 字节的信息头之后
+        if (bpp != 32 || size < 66 || read_u32(data + 54) != 0xff0000 || 
+            read_u32(data + 58) != 0xff00 || read_u32(data + 62) != 0xff) return -2;
+    }
+    else if (compression != 0) {
+        return -2;
+    }
+    stride = ((long)width * bpp / 8 + 3) & ~3L;
+    if (offset > size || (size - offset) / stride < (size_t)height) return -2;
+    if (bpp == 32 && texture_can_map(offset)) {
+        tex->bits = data + offset + (bottom_up? stride * (height - 1) : 0);
+        tex->pitch = bottom_up? -(stride / 4) : stride / 4;
+        tex->width = width;
+        tex->height = height;
+        return 0;
+    }
+    if (bpp == 8) {
+        if (colors == 0 || colors > 256) colors = 256;
+        if (14 + header + colors * 4 > offset) return -2;
+        for (i = 0; i < colors; i++) tex->palette[i] = read_u32(data + 14 + header + i * 4) & 0xffffff;
+        tex->format = TEXTURE_P8;
+        tex->bits = data + offset + (bottom_up? stride * (height - 1) : 0);
+        tex->pitch = bottom_up? -stride : stride;
+        tex->width = width;
+        tex->height = height;
+        return 0;
+    }
+    if (texture_alloc(tex, width, height) != 0) return -1;
+    for (j = 0; j < height; j++) {
+        const unsigned char *src = data + offset + stride * (bottom_up? height - 1 - j : j);
+        texture_convert_row(tex->buffer + (size_t)width * j, src, width, bpp);
+    }
+    return 0;
+}
+
+// 解析 TGA：支持真彩色（类型 2 / 10）和灰度（类型 3 / 11），8 / 24 / 32 位，
+// 类型 10 / 11 为 RLE 压缩
+int texture_parse_tga(texture_t *tex, const unsigned char *data, size_t size) {
+    unsigned int type, bpp, desc, bytes;
+    size_t offset, end;
+    int width, height, bottom_up, j;
+    if (size < 18 || data[1] != 0) return -2;   // 不支持调色板
+    type = data[2];
+    width = (int)read_u16(data + 12);
+    height = (int)read_u16(data + 14);
+    bpp = data[16];
+    desc = data[17];
+    bottom_up = !(desc & 0x20);
+    offset = 18 + data[0];
+    if (width == 0 || height == 0 || (desc & 0x10)) return -2;     // 不支持从右到左
+    if (type == 2 || type == 10) {
+        if (bpp != 24 && bpp != 32) return -2;
+    }
+    else if (type == 3 || type == 11) {
+        if (bpp != 8) return -2;
+    }
+    else {
+        return -2;
+    }
+    bytes = bpp / 8;
+    if (offset > size) return -2;
+    if (type == 2 || type == 3) {
+        long stride = (long)width * bytes;
+        if ((size - offset) / stride < (size_t)height) return -2;
+        if (bpp == 32 && texture_can_map(offset)) {
+            tex->bits = data + offset + (bottom_up? stride * (height - 1) : 0);
+            tex->pitch = bottom_up? -(long)width : width;
+            tex->width = width;
+            tex->height = height;
+            return 0;
+        }
+        if (bpp == 8) {         // 灰度：用灰阶调色板按 P8 引用
+            for (j = 0; j < 256; j++) tex->palette[j] = j * 0x010101;
+            tex->format = TEXTURE_P8;
+            tex->bits = data + offset + (bottom_up? stride * (height - 1) : 0);
+            tex->pitch = bottom_up? -stride : stride;
+            tex->width = width;
+            tex->height = height;
+            return 0;
+        }
+        if (texture_alloc(tex, width, height) != 0) return -1;
+        for (j = 0; j < height; j++) {
+            const unsigned char *src = data + offset + stride * (bottom_up? height - 1 - j : j);
+            texture_convert_row(tex->buffer + (size_t)width * j, src, width, bpp);
+        }
+        return 0;
+    }
+    // RLE：包头的最高位为 1 时后面一个像素重复 (n & 127) + 1 次，否则后面是 n + 1 个像素，
+    // 包可以跨行。先解码到与文件相同的像素格式，再逐行转换
+    {
+        unsigned char *raw = (unsigned char*)malloc((size_t)width * height * bytes);
+        size_t pos = 0, total = (size_t)width * height * bytes;
+        if (raw == NULL) return -1;
+        end = size;
+        while (pos < total && offset < end) {
+            unsigned int n = data[offset++], count = (n & 127) + 1;
+            size_t length = (size_t)count * bytes;
+            if (length > total - pos) length = total - pos;
+            if (n & 128) {
+                if (end - offset < bytes) break;
+                for (; length > 0; length -= bytes, pos += bytes) memcpy(raw + pos, data + offset, bytes);
+                offset += bytes;
+            }
+            else {
+                if (end - offset < length) break;
+                memcpy(raw + pos, data + offset, length);
+                pos += length, offset += length;
+            }
+        }
+        if (pos < total || texture_alloc(tex, width, height) != 0) {
+            free(raw);
+            return (pos < total)? -2 : -1;
+        }
+        for (j = 0; j < height; j++) {
+            const unsigned char *src = raw + (size_t)width * bytes * (bottom_up? height - 1 - j : j);
+            texture_convert_row(tex->buffer + (size_t)width * j, src, width, bpp);
+        }
+        free(raw);
+        return 0;
+    }
 }
 
-// 设置当前纹理
-void device_set_texture(device_t *device, void *bits, long pitch, int w, int h) {
-    IUINT32 *ptr = (IUINT32*)bits;
-    int j;
-    assert(w <= 1024 && h <= 1024);
-    for (j = 0; j < h; ptr += pitch, j++)   // 重新计算每行纹理的指针
-        device->texture[j] = (IUINT32*)ptr;
-    device->tex_width = w;
-    device->tex_height = h;
-    device->max_u = (float)(w - 1);
-    device->max_v = (float)(h - 1);
+// 解析 DDS：支持 DXT1 / DXT5，即 BC1 / BC3，只使用第 0 层
+int texture_parse_dds(texture_t *tex, const unsigned char *data, size_t size) {
+    unsigned int width, height, fourcc, block;
+    size_t pitch;
+    if (size < 128 || read_u32(data + 4) != 124) return -2;
+    height = read_u32(data + 12);
+    width = read_u32(data + 16);
+    fourcc = read_u32(data + 84);
+    if (!(read_u32(data + 80) & 4)) return -2;  // DDPF_FOURCC
+    if (fourcc == 0x31545844) tex->format = TEXTURE_BC1, block = 8;         // "DXT1"
+    else if (fourcc == 0x35545844) tex->format = TEXTURE_BC3, block = 16;   // "DXT5"
+    else return -2;
+    if (width == 0 || height == 0 || width > 65536 || height > 65536) return -2;
+    pitch = (width + 3) / 4 * block;
+    if ((size - 128) / pitch < (height + 3) / 4) return -2;
+    tex->bits = data + 128;
+    tex->pitch = (long)pitch;
+    tex->width = (int)width;
+    tex->height = (int)height;
+    return 0;
 }
 
-// 清空 framebuffer 和 zbuffer
-void device_clear(device_t *device, int mode) {
-    int y, x, height = device->height;
-    for (y = 0; y < device->height; y++) {
-        IUINT32 *dst = device->framebuffer[y];
-        IUINT32 cc = (height - 1 - y) * 230 / (height - 1);
-        cc = (cc << 16) | (cc << 8) | cc;
-        if (mode == 0) cc = device->background;
-        for (x = device->width; x > 0; dst++, x--) dst[0] = cc;
+// 载入 BMP（以 "BM" 开头）、DDS（以 "DDS " 开头）或 TGA 纹理，成功返回 0，无法打开或内存不足返回 -1，
+// 格式不支持返回 -2。直接引用映射的纹理在 texture_free 之前保持映射
+int texture_load(texture_t *tex, const char *filename) {
+    const unsigned char *data;
+    size_t size;
+    int hr;
+    memset(tex, 0, sizeof(texture_t));
+    data = (const unsigned char*)file_map(filename, &size);
+    if (data == NULL) return -1;
+    if (size >= 2 && data[0] == 'B' && data[1] == 'M') hr = texture_parse_bmp(tex, data, size);
+    else if (size >= 4 && memcmp(data, "DDS ", 4) == 0) hr = texture_parse_dds(tex, data, size);
+    else hr = texture_parse_tga(tex, data, size);
+    if (hr == 0 && tex->buffer == NULL) {
+        tex->map = data;
+        tex->map_size = size;
     }
-    for (y = 0; y < device->height; y++) {
-        float *dst = device->zbuffer[y];
-        for (x = device->width; x > 0; dst++, x--) dst[0] = 0.0f;
+    else {
+        file_unmap(data, size);
     }
+    return hr;
 }
 
-// 画点
-void device_pixel(device_t *device, int x, int y, IUINT32 color) {
-    if (((IUINT32)x) < (IUINT32)device->width && ((IUINT32)y) < (IUINT32)device->height) {
-        device->framebuffer[y][x] = color;
-    }
+// 释放纹理的映射或缓冲，纹理仍被设备使用时先用 device_set_texture 换掉
+void texture_free(texture_t *tex) {
+    if (tex->map) file_unmap(tex->map, tex->map_size);
+    if (tex->buffer) free(tex->buffer);
+    memset(tex, 0, sizeof(texture_t));
 }
 
-// 绘制线段
-void device_draw_line(device_t *device, int x1, int y1, int x2, int y2, IUINT32 c) {
-    int x, y, rem = 0;
-    if (x1 == x2 && y1 == y2) {
-        device_pixel(device, x1, y1, c);
-    }   else if (x1 == x2) {
-        int inc = (y1 <= y2)? 1 : -1;
-        for (y = y1; y != y2; y += inc) device_pixel(device, x1, y, c);
-        device_pixel(device, x2, y2, c);
-    }   else if (y1 == y2) {
-        int inc = (x1 <= x2)? 1 : -1;
-        for (x = x1; x != x2; x += inc) device_pixel(device, x, y1, c);
-        device_pixel(device, x2, y2, c);
-    }   else {
-        int dx = (x1 < x2)? x2 - x1 : x1 - x2;
-        int dy = (y1 < y2)? y2 - y1 : y1 - y2;
-        if (dx >= dy) {
-            if (x2 < x1) x = x1, y = y1, x1 = x2, y1 = y2, x2 = x, y2 = y;
-            for (x = x1, y = y1; x <= x2; x++) {
-                device_pixel(device, x, y, c);
-                rem += dy;
-                if (rem >= dx) {
-                    rem -= dx;
-                    y += (y2 >= y1)? 1 : -1;
-                    device_pixel(device, x, y, c);
-                }
-            }
-            device_pixel(device, x2, y2, c);
-        }   else {
-            if (y2 < y1) x = x1, y = y1, x1 = x2, y1 = y2, x2 = x, y2 = y;
-            for (x = x1, y = y1; y <= y2; y++) {
-                device_pixel(device, x, y, c);
-                rem += dx;
-                if (rem >= dy) {
-                    rem -= dy;
-                    x += (x2 >= x1)? 1 : -1;
-                    device_pixel(device, x, y, c);
-                }
-            }
-            device_pixel(device, x2, y2, c);
+
+//=====================================================================
+// 离屏目标：device_init 传入 fb == NULL 时由设备自己持有帧缓存，
+// 这里提供与平台无关的计时和 PPM 输出，用于无窗口的测试环境
+//=====================================================================
+
+// 单调时钟，单位毫秒
+double timer_ms(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER now;
+    if (freq.QuadPart == 0) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart * 1000.0 / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec * 1e-6;
+#endif
+}
+
+// 把 width x height 的像素（每行相隔 pitch 个像素）写为二进制 PPM (P6)，成功返回 0
+int ppm_write(FILE *fp, const IUINT32 *pixels, long pitch, int width, int height) {
+    unsigned char *row;
+    int x, y, hr = 0;
+    row = (unsigned char*)malloc(width * 3);
+    if (row == NULL) return -1;
+    fprintf(fp, "P6\n%d %d\n255\n", width, height);
+    for (y = 0; y < height && hr == 0; y++) {
+        const IUINT32 *src = pixels + pitch * y;
+        for (x = 0; x < width; x++) {
+            row[x * 3 + 0] = (unsigned char)((src[x] >> 16) & 255);
+            row[x * 3 + 1] = (unsigned char)((src[x] >> 8) & 255);
+            row[x * 3 + 2] = (unsigned char)(src[x] & 255);
         }
+        if (fwrite(row, 1, width * 3, fp) != (size_t)(width * 3)) hr = -1;
     }
+    free(row);
+    return hr;
 }
 
-// 根据坐标读取纹理
-IUINT32 device_texture_read(const device_t *device, float u, float v) {
-    int x, y;
-    u = u * device->max_u;
-    v = v * device->max_v;
-    x = (int)(u + 0.5f);
-    y = (int)(v + 0.5f);
-    x = CMID(x, 0, device->tex_width - 1);
-    y = CMID(y, 0, device->tex_height - 1);
-    return device->texture[y][x];
+// 将 framebuffer 保存为二进制 PPM (P6)，成功返回 0
+int device_save_ppm(const device_t *device, const char *filename) {
+    FILE *fp;
+    int hr;
+    fp = fopen(filename, "wb");
+    if (fp == NULL) return -1;
+    hr = ppm_write(fp, device->framebuffer[0], device->fb_pitch, device->width, device->height);
+    if (fclose(fp) != 0) hr = -1;
+    return hr;
 }
 
 
 //=====================================================================
-// 渲染实现
+// 呈现：设备在多个颜色缓冲之间轮换，第 N 帧由呈现线程显示或编码的同时
+// 渲染第 N+1 帧；帧节拍器按固定的时间步长推进，代替主循环中的 Sleep(1)
 //=====================================================================
+#define PRESENT_MAX_BUFFERS     3
 
-// 绘制扫描线
-void device_draw_scanline(device_t *device, scanline_t *scanline) {
-    IUINT32 *framebuffer = device->framebuffer[scanline->y];
-    float *zbuffer = device->zbuffer[scanline->y];
-    int x = scanline->x;
-    int w = scanline->w;
-    int width = device->width;
-    int render_state = device->render_state;
-    for (; w > 0; x++, w--) {
-        if (x >= 0 && x < width) {
-            float rhw = scanline->v.rhw;
-            if (rhw >= zbuffer[x]) {    
-                float w = 1.0f / rhw;
-                zbuffer[x] = rhw;
-                if (render_state & RENDER_STATE_COLOR) {
-                    float r = scanline->v.color.r * w;
-                    float g = scanline->v.color.g * w;
-                    float b = scanline->v.color.b * w;
-                    int R = (int)(r * 255.0f);
-                    int G = (int)(g * 255.0f);
-                    int B = (int)(b * 255.0f);
-                    R = CMID(R, 0, 255);
-                    G = CMID(G, 0, 255);
-                    B = CMID(B, 0, 255);
-                    framebuffer[x] = (R << 16) | (G << 8) | (B);
-                }
-                if (render_state & RENDER_STATE_TEXTURE) {
-                    float u = scanline->v.tc.u * w;
-                    float v = scanline->v.tc.v * w;
-                    IUINT32 cc = device_texture_read(device, u, v);
-                    framebuffer[x] = ((int)((cc >> 16) * scanline->v.light) << 16) +
-                                     ((int)(((cc & 65535)>> 8) * scanline->v.light) << 8) +
-                                     (int)((cc & 255) * scanline->v.light);
-                }
-            }
-        }
-        vertex_add(&scanline->v, &scanline->step);
-        if (x >= width) break;
+// 呈现一帧：pixels 为 width x height 的像素，每行相隔 pitch 个像素，在呈现线程上调用
+typedef void (*present_proc_t)(void *user, const IUINT32 *pixels, long pitch, int width, int height);
+
+typedef struct {
+    int width, height;
+    long pitch;                     // 每行的像素数，16 的倍数（每行 64 字节对齐）
+    int count;                      // 颜色缓冲的数量，1 为在渲染线程上同步呈现
+    IUINT32 *buffers[PRESENT_MAX_BUFFERS];
+    void *memory;                   // 所有颜色缓冲的存储（page_alloc）
+    size_t memory_size;
+    int busy[PRESENT_MAX_BUFFERS];  // 已提交、尚未呈现完的缓冲
+    int queue[PRESENT_MAX_BUFFERS]; // 等待呈现的缓冲，按提交顺序
+    int head, queued;
+    int current;                    // 正在渲染的缓冲
+    int quit;
+    present_proc_t proc;
+    void *user;
+    mutex_t lock;
+    cond_t cond;
+    thread_t thread;
+    double wait_ms;                 // 渲染线程等待空闲缓冲的累计时间
+}   presenter_t;
+
+THREAD_PROC(presenter_thread, arg) {
+    presenter_t *p = (presenter_t*)arg;
+    mutex_lock(&p->lock);
+    while (1) {
+        int index;
+        while (p->queued == 0 && !p->quit) cond_wait(&p->cond, &p->lock);
+        if (p->queued == 0) break;
+        index = p->queue[p->head];
+        mutex_unlock(&p->lock);
+        p->proc(p->user, p->buffers[index], p->pitch, p->width, p->height);
+        mutex_lock(&p->lock);
+        p->head = (p->head + 1) % p->count;
+        p->queued--;
+        p->busy[index] = 0;
+        cond_broadcast(&p->cond);
     }
+    mutex_unlock(&p->lock);
+    THREAD_RETURN;
 }
 
-// 主渲染函数
-void device_render_trap(device_t *device, trapezoid_t *trap) {
-    scanline_t scanline;
-    int j, top, bottom;
-    top = (int)(trap->top + 0.5f);
-    bottom = (int)(trap->bottom + 0.5f);
-    for (j = top; j < bottom; j++) {
-        if (j >= 0 && j < device->height) {
-            trapezoid_edge_interp(trap, (float)j + 0.5f);
-            trapezoid_init_scan_line(trap, &scanline, j);
-            device_draw_scanline(device, &scanline);
+// 分配 count 个颜色缓冲（每行 64 字节对齐），count >= 2 时启动呈现线程，成功返回 0
+int presenter_init(presenter_t *p, int width, int height, int count, 
+    present_proc_t proc, void *user) {
+    long pitch = (width + 15) & ~15;
+    size_t size = (size_t)pitch * height * 4;
+    int i, pages;
+    memset(p, 0, sizeof(presenter_t));
+    if (count < 1 || count > PRESENT_MAX_BUFFERS) return -1;
+    p->memory_size = size * count;
+    p->memory = page_alloc(&p->memory_size, &pages);
+    if (p->memory == NULL) return -2;
+    for (i = 0; i < count; i++) p->buffers[i] = (IUINT32*)((char*)p->memory + size * i);
+    p->pitch = pitch;
+    p->width = width;
+    p->height = height;
+    p->count = count;
+    p->proc = proc;
+    p->user = user;
+    if (count > 1) {
+        mutex_init(&p->lock);
+        cond_init(&p->cond);
+        if (thread_create(&p->thread, presenter_thread, p) != 0) {
+            mutex_destroy(&p->lock);
+            cond_destroy(&p->cond);
+            page_free(p->memory, p->memory_size);
+            p->memory = NULL;
+            return -3;
         }
-        if (j >= device->height) break;
     }
+    return 0;
 }
 
-// 根据 render_state 绘制原始三角形
-void device_draw_primitive(device_t *device, const vertex_t *v1, 
-    const vertex_t *v2, const vertex_t *v3, const vector_t *normal) {
-	if (REMOVE_BACKFACE) {
-		//在世界坐标系下进行背面消除
-		vector_t u, v, normal_backTest, view_backTest;
-		point_sub(&u, &v2->pos, &v1->pos);
-		point_sub(&v, &v3->pos, &v1->pos);
-		vector_sub(&view_backTest, &cameraPosition, &v1->pos);
-		vector_crossproduct(&normal_backTest, &u, &v);
-		if (vector_dotproduct(&normal_backTest, &view_backTest) < 0) return;//背面
-	}	
-
-    point_t p1, p2, p3, c1, c2, c3;
-    vector_t trans_normal, trans_revViewDirection, 
-             trans_revLightDirection, trans_reflectDirection;
-    int render_state = device->render_state;
-    matrix_t normal_transform;
-    float ln;
-    vector_t nnl;
-    float t1_light, t2_light, t3_light;
+// 取得下一帧要渲染的缓冲，它仍在呈现时等待
+IUINT32 *presenter_acquire(presenter_t *p) {
+    int index = p->current;
+    if (p->count > 1) {
+        double t0 = timer_ms();
+        mutex_lock(&p->lock);
+        while (p->busy[index]) cond_wait(&p->cond, &p->lock);
+        mutex_unlock(&p->lock);
+        p->wait_ms += timer_ms() - t0;
+    }
+    return p->buffers[index];
+}
 
-    //变换图元法向量(旋转变换+摄影机变换)
-    matrix_mul(&normal_transform, &device->transform.world, &device->transform.view);
-    matrix_apply(&trans_normal, normal, &normal_transform);
-
-    vector_normalize(&trans_normal);
-
-    //变换光线方向(摄影机变换)
-    matrix_apply(&trans_revLightDirection, &lightDirection, &device->transform.view);
-    trans_revLightDirection.x = -trans_revLightDirection.x;
-    trans_revLightDirection.y = -trans_revLightDirection.y;
-    trans_revLightDirection.z = -trans_revLightDirection.z;
-
-    vector_normalize(&trans_revLightDirection);
-
-    ln = vector_dotproduct(&trans_revLightDirection, &trans_normal);
-    nnl.x = 2 * ln * trans_normal.x;
-    nnl.y = 2 * ln * trans_normal.y;
-    nnl.z = 2 * ln * trans_normal.z;
-    nnl.w = 0;
-    vector_sub(&trans_reflectDirection, &nnl, &trans_revLightDirection);
-
-    vector_normalize(&trans_reflectDirection);
-
-    //计算能进入人眼的反射光方向
-    c1.x = NEAR_PLANE * v1->pos.x / v1->pos.z;
-    c1.y = NEAR_PLANE * v1->pos.y / v1->pos.z;
-    c1.z = NEAR_PLANE;
-    c1.w = 1;
-    matrix_apply(&p1, &v1->pos, &device->transform.view);
-    point_sub(&trans_revViewDirection, &c1, &p1);
-    //point_sub(&trans_revViewDirection, &c1, &v1->pos);
-    vector_normalize(&trans_revViewDirection);
-    //printf("%lf %lf %lf %lf\n", trans_revViewDirection.x, trans_revViewDirection.y, trans_revViewDirection.z, trans_revViewDirection.w);
-    t1_light = ambientLightIntensity + lightIntensity * (diffuseRate * ln + 
-                                                     specularRate * 
-                                 pow(vector_dotproduct(&trans_reflectDirection, &trans_revViewDirection), (float)reflectIndex));
-    
-    if (t1_light < ambientLightIntensity) t1_light = ambientLightIntensity;
-    else if (t1_light > 1) t1_light = 1;
-    
-    c2.x = NEAR_PLANE * v2->pos.x / v2->pos.z;
-    c2.y = NEAR_PLANE * v2->pos.y / v2->pos.z;
-    c2.z = NEAR_PLANE;
-    c2.w = 1;
-    matrix_apply(&p2, &v2->pos, &device->transform.view);
-    point_sub(&trans_revViewDirection, &c2, &p2);
-    //point_sub(&trans_revViewDirection, &c2, &v2->pos);
-    
-    vector_normalize(&trans_revViewDirection);
-    
-    t2_light = ambientLightIntensity + lightIntensity * (diffuseRate * ln + 
-                                                     specularRate * 
-                                     pow(vector_dotproduct(&trans_reflectDirection, &trans_revViewDirection), (float)reflectIndex));
-
-    if (t2_light < ambientLightIntensity) t2_light = ambientLightIntensity;
-    else if (t2_light > 1) t2_light = 1;
-
-    c3.x = NEAR_PLANE * v3->pos.x / v3->pos.z;
-    c3.y = NEAR_PLANE * v3->pos.y / v3->pos.z;
-    c3.z = NEAR_PLANE;
-    c3.w = 1;
-    matrix_apply(&p3, &v3->pos, &device->transform.view);
-    point_sub(&trans_revViewDirection, &c3, &p3);
-    //point_sub(&trans_revViewDirection, &c3, &v3->pos);
-    
-    vector_normalize(&trans_revViewDirection);
-    
-    t3_light = ambientLightIntensity + lightIntensity * (diffuseRate * ln + 
-                                                     specularRate * 
-                                 pow(vector_dotproduct(&trans_reflectDirection, &trans_revViewDirection), (float)reflectIndex));
+// 提交 presenter_acquire 取得的缓冲，调用前设备必须已经 device_flush
+void presenter_submit(presenter_t *p) {
+    int index = p->current;
+    p->current = (index + 1) % p->count;
+    if (p->count == 1) {
+        p->proc(p->user, p->buffers[index], p->pitch, p->width, p->height);
+        return;
+    }
+    mutex_lock(&p->lock);
+    p->busy[index] = 1;
+    p->queue[(p->head + p->queued) % p->count] = index;
+    p->queued++;
+    cond_broadcast(&p->cond);
+    mutex_unlock(&p->lock);
+}
 
-    if (t3_light < ambientLightIntensity) t3_light = ambientLightIntensity;
-    else if (t3_light > 1) t3_light = 1;
+// 等待所有已提交的帧呈现完毕
+void presenter_finish(presenter_t *p) {
+    if (p->count <= 1) return;
+    mutex_lock(&p->lock);
+    while (p->queued > 0) cond_wait(&p->cond, &p->lock);
+    mutex_unlock(&p->lock);
+}
 
-    // 按照 Transform 变化
-    transform_apply(&device->transform, &c1, &v1->pos);
-    transform_apply(&device->transform, &c2, &v2->pos);
-    transform_apply(&device->transform, &c3, &v3->pos);
+// 呈现完剩余的帧后结束呈现线程并释放缓冲
+void presenter_destroy(presenter_t *p) {
+    if (p->memory == NULL) return;
+    if (p->count > 1) {
+        mutex_lock(&p->lock);
+        p->quit = 1;
+        cond_broadcast(&p->cond);
+        mutex_unlock(&p->lock);
+        thread_join(p->thread);
+        mutex_destroy(&p->lock);
+        cond_destroy(&p->cond);
+    }
+    page_free(p->memory, p->memory_size);
+    memset(p, 0, sizeof(presenter_t));
+}
 
-    // 裁剪，注意此处可以完善为具体判断几个点在 cvv内以及同cvv相交平面的坐标比例
-    // 进行进一步精细裁剪，将一个分解为几个完全处在 cvv内的三角形
-    if (transform_check_cvv(&c1) != 0) return;
-    if (transform_check_cvv(&c2) != 0) return;
-    if (transform_check_cvv(&c3) != 0) return;
+// 让出 CPU 大约 ms 毫秒
+void sleep_ms(int ms) {
+#ifdef _WIN32
+    Sleep(ms);
+#else
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (long)(ms % 1000) * 1000000L;
+    nanosleep(&ts, NULL);
+#endif
+}
 
-    // 归一化
-    transform_homogenize(&device->transform, &p1, &c1);
-    transform_homogenize(&device->transform, &p2, &c2);
-    transform_homogenize(&device->transform, &p3, &c3);
+// 固定时间步长的帧节拍器
+#define PACER_MAX_STEPS     8       // 落后太多时一次最多补的步数，其余丢弃
 
-    // 纹理或者色彩绘制
-    if (render_state & (RENDER_STATE_TEXTURE | RENDER_STATE_COLOR)) {
-        vertex_t t1 = *v1, t2 = *v2, t3 = *v3;
-        trapezoid_t traps[2];
-        int n;
-
-        t1.pos = p1; 
-        t2.pos = p2;
-        t3.pos = p3;
-        t1.pos.w = c1.w;
-        t2.pos.w = c2.w;
-        t3.pos.w = c3.w;
-        t1.light = t1_light;
-        t2.light = t2_light;
-        t3.light = t3_light;
-        
-        vertex_rhw_init(&t1);   // 初始化 w
-        vertex_rhw_init(&t2);   // 初始化 w
-        vertex_rhw_init(&t3);   // 初始化 w
-        
-        // 拆分三角形为0-2个梯形，并且返回可用梯形数量
-        n = trapezoid_init_triangle(traps, &t1, &t2, &t3);
+typedef struct {
+    double period;                  // 每步的毫秒数
+    double next;                    // 下一步开始的时刻
+}   pacer_t;
 
-        if (n >= 1) device_render_trap(device, &traps[0]);
-        if (n >= 2) device_render_trap(device, &traps[1]);
-    }
+void pacer_init(pacer_t *pacer, double fps) {
+    pacer->period = 1000.0 / fps;
+    pacer->next = timer_ms() + pacer->period;
+}
 
-    if (render_state & RENDER_STATE_WIREFRAME) {        // 线框绘制
-        device_draw_line(device, (int)p1.x, (int)p1.y, (int)p2.x, (int)p2.y, device->foreground);
-        device_draw_line(device, (int)p1.x, (int)p1.y, (int)p3.x, (int)p3.y, device->foreground);
-        device_draw_line(device, (int)p3.x, (int)p3.y, (int)p2.x, (int)p2.y, device->foreground);
+// 等到下一步开始，返回自上次调用以来经过的步数（至少为 1），调用者按步数推进模拟。
+// 系统的睡眠粒度较粗，先睡到只剩 2 毫秒，再让出时间片直到时刻到达
+int pacer_wait(pacer_t *pacer) {
+    double now = timer_ms();
+    int steps;
+    while (now < pacer->next) {
+        if (pacer->next - now > 2.0) sleep_ms((int)(pacer->next - now - 2.0));
+        else sleep_ms(0);
+        now = timer_ms();
     }
+    steps = 1 + (int)((now - pacer->next) / pacer->period);
+    if (steps > PACER_MAX_STEPS) {
+        steps = PACER_MAX_STEPS;
+        pacer->next = now;
+    }
+    pacer->next += steps * pacer->period;
+    return steps;
 }
 
 
+#ifdef _WIN32
 //=====================================================================
 // Win32 窗口及图形绘制：为 device 提供一个 DibSection 的 FB
 //=====================================================================
@@ -491,7 +4794,7 @@ long screen_pitch = 0;
 int screen_init(int w, int h, const TCHAR *title);  // 屏幕初始化
 int screen_close(void);                             // 关闭屏幕
 void screen_dispatch(void);                         // 处理消息
-void screen_update(void);                           // 显示 FrameBuffer
+void screen_present(void *user, const IUINT32 *pixels, long pitch, int width, int height);
 
 // win32 event handler
 static LRESULT screen_events(HWND, UINT, WPARAM, LPARAM);   
@@ -596,12 +4899,20 @@ void screen_dispatch(void) {
     }
 }
 
-void screen_update(void) {
-    HDC hDC = GetDC(screen_handle);
-    BitBlt(hDC, 0, 0, screen_w, screen_h, screen_dc, 0, 0, SRCCOPY);
+// presenter 的呈现函数：复制到 DibSection 后 BitBlt，在呈现线程上运行，
+// 消息循环仍留在主线程
+void screen_present(void *user, const IUINT32 *pixels, long pitch, int width, int height) {
+    HDC hDC;
+    int y;
+    (void)user;
+    for (y = 0; y < height; y++) {
+        memcpy(screen_fb + (size_t)width * 4 * y, pixels + pitch * y, (size_t)width * 4);
+    }
+    hDC = GetDC(screen_handle);
+    BitBlt(hDC, 0, 0, width, height, screen_dc, 0, 0, SRCCOPY);
     ReleaseDC(screen_handle, hDC);
-    screen_dispatch();
 }
+#endif  // _WIN32
 
 
 //=====================================================================
@@ -621,6 +4932,33 @@ vertex_t mesh[8] = {
 vector_t nor[6] = {{0, 0, 1, 0}, {0, 0, -1, 0}, {0, -1, 0, 0}, 
                    {-1, 0, 0, 0}, {0, 1, 0, 0}, {1, 0, 0, 0}};
 
+// 立方体的 6 个面，每个面引用 mesh 中的 4 个角
+int box_faces[6][4] = {{0, 1, 2, 3}, {6, 5, 4, 7}, {5, 1, 0, 4},
+                       {1, 5, 6, 2}, {2, 6, 7, 3}, {3, 7, 4, 0}};
+
+// 索引形式的立方体：每个面 4 个顶点（各自带面法向量和纹理坐标），2 个三角形
+vertex_t box_vertices[24];
+vector_t box_normals[24];
+int box_indices[36];
+
+void box_init(void) {
+    static const texcoord_t tc[4] = {{0, 0}, {0, 1}, {1, 1}, {1, 0}};
+    int i, k;
+    for (i = 0; i < 6; i++) {
+        for (k = 0; k < 4; k++) {
+            box_vertices[i * 4 + k] = mesh[box_faces[i][k]];
+            box_vertices[i * 4 + k].tc = tc[k];
+            box_normals[i * 4 + k] = nor[i];
+        }
+        box_indices[i * 6 + 0] = i * 4 + 0;
+        box_indices[i * 6 + 1] = i * 4 + 1;
+        box_indices[i * 6 + 2] = i * 4 + 2;
+        box_indices[i * 6 + 3] = i * 4 + 2;
+        box_indices[i * 6 + 4] = i * 4 + 3;
+        box_indices[i * 6 + 5] = i * 4 + 0;
+    }
+}
+
 void draw_plane(device_t *device, int a, int b, int c, int d, vector_t normal) {
     vertex_t p1 = mesh[a], p2 = mesh[b], p3 = mesh[c], p4 = mesh[d];
     p1.tc.u = 0, p1.tc.v = 0, p2.tc.u = 0, p2.tc.v = 1;
@@ -629,19 +4967,36 @@ void draw_plane(device_t *device, int a, int b, int c, int d, vector_t normal) {
     device_draw_primitive(device, &p3, &p4, &p1, &normal);
 }
 
+// 以给定的世界矩阵绘制立方体
+void draw_box_world(device_t *device, const matrix_t *world) {
+    static int inited = 0;
+    if (!inited) box_init(), inited = 1;
+    device->transform.world = *world;
+    transform_update(&device->transform);
+    device_draw_indexed(device, box_vertices, box_normals, 24, box_indices, 36);
+}
+
+// 在 y = h 处绘制边长 2 * size 的地面，摄影机在其上方时地面会穿过近平面
+void draw_floor(device_t *device, float size, float h) {
+    static int indices[6] = { 0, 3, 2, 2, 1, 0 };
+    static vector_t n[4] = {{0, 1, 0, 0}, {0, 1, 0, 0}, {0, 1, 0, 0}, {0, 1, 0, 0}};
+    static vertex_t v[4];       // 录制到命令缓冲时在执行时才读取，不能放在栈上
+    vertex_t quad[4] = {
+        { {  size, h,  size, 1 }, { 0, 0 }, { 1.0f, 0.2f, 0.2f }, 1 },
+        { {  size, h, -size, 1 }, { 0, 1 }, { 0.2f, 1.0f, 0.2f }, 1 },
+        { { -size, h, -size, 1 }, { 1, 1 }, { 0.2f, 0.2f, 1.0f }, 1 },
+        { { -size, h,  size, 1 }, { 1, 0 }, { 1.0f, 0.2f, 1.0f }, 1 },
+    };
+    memcpy(v, quad, sizeof(quad));
+    matrix_set_identity(&device->transform.world);
+    transform_update(&device->transform);
+    device_draw_indexed(device, v, n, 4, indices, 6);
+}
+
 void draw_box(device_t *device, float theta) {
     matrix_t m;
-
     matrix_set_rotate(&m, -1, 1, 1, theta);
-    device->transform.world = m;
-    transform_update(&device->transform);
-    
-    draw_plane(device, 0, 1, 2, 3, nor[0]);
-    draw_plane(device, 6, 5, 4, 7, nor[1]);
-    draw_plane(device, 5, 1, 0, 4, nor[2]);
-    draw_plane(device, 1, 5, 6, 2, nor[3]);
-    draw_plane(device, 2, 6, 7, 3, nor[4]);
-    draw_plane(device, 3, 7, 4, 0, nor[5]);
+    draw_box_world(device, &m);
 }
 
 void camera_at_zero(device_t *device, float x, float y, float z) {
@@ -666,68 +5021,77 @@ void init_texture(device_t *device) {
     device_set_texture(device, texture, 256, 256, 256);
 }
 
-void setAmbientLightIntensity(float intensity) {
-    ambientLightIntensity = intensity;
-}
-
-void setLightDirection(float x, float y, float z) {
-    lightDirection.x = x;
-    lightDirection.y = y;
-    lightDirection.z = z;
-    lightDirection.w = 0;
-}
-
-void setLightIntensity(float value) {
-    lightIntensity = value;
-}
-
-void setReflectIndex(IUINT32 n) {
-    reflectIndex = n;
-}
-
-void setDiffuseRate(float r) {
-    diffuseRate = r;
-}
-
-void setSpecularRate(float r) {
-    specularRate = r;
+// 演示用的光照：环境光加一个平行光
+void init_lighting(device_t *device) {
+    lighting_t *lighting = &device->lighting;
+    lighting_init(lighting);
+    lighting->ambient = 0.25f;
+    lighting->diffuse = 0.6f;
+    lighting->specular = 0.15f;
+    lighting->shininess = 300;
+    lighting_add_directional(lighting, -1, 0, -1, 1.0f);
 }
 
+#ifndef MINI3D_BENCH
 int main(void)
 {
     device_t device;
+    presenter_t presenter;
+    pacer_t pacer;
     int states[] = { RENDER_STATE_TEXTURE, RENDER_STATE_COLOR, RENDER_STATE_WIREFRAME };
     int indicator = 0;
+    int steps, i;
     int kbhit = 0;//用于保证当空格键被持续按下时，显示模式只切换一次
+    int fkhit = 0;//同上，用于 F 键切换纹理过滤
+    int lkhit = 0;//同上，用于 L 键切换纹理存储方式
+    int ckhit = 0;//同上，用于 C 键开始/停止录制
+    trace_writer_t trace;
     float alpha = 0;
     float pos = 5.5;
 
     TCHAR *title = _T("Mini3d (software render tutorial) - ")
-        _T("Left/Right: rotation, Up/Down: forward/backward, Space: switch state");
+        _T("Left/Right: rotation, Up/Down: forward/backward, Space: switch state, F: filter, L: layout, ")
+        _T("C: capture to mini3d.trace");
 
     if (screen_init(800, 600, title)) 
         return -1;
 
-    device_init(&device, 800, 600, screen_fb);
+    // 双缓冲：呈现线程 BitBlt 上一帧的同时渲染这一帧
+    device_init(&device, 800, 600, NULL);
+    if (presenter_init(&presenter, 800, 600, 2, screen_present, NULL) != 0)
+        return -1;
+    pacer_init(&pacer, 100.0);
 
-    setAmbientLightIntensity(0.25f);
-    setLightDirection(-1, 0, -1);
-    setLightIntensity(1.0);
-    setReflectIndex(300);
-    setDiffuseRate(0.6f);
-    setSpecularRate(0.15f);
+    init_lighting(&device);
     init_texture(&device);
     device.render_state = RENDER_STATE_TEXTURE;
 
     while (screen_exit == 0 && screen_keys[VK_ESCAPE] == 0) {
+        steps = pacer_wait(&pacer);
         screen_dispatch();
+
+        // 录制从这一帧的清屏开始，mini3d_bench -replay 可以重放
+        if (screen_keys['C']) {
+            if (ckhit == 0) {
+                ckhit = 1;
+                if (device.trace) trace_end(&device);
+                else trace_begin(&device, &trace, "mini3d.trace");
+            }
+        }   else {
+            ckhit = 0;
+        }
+
+        device_set_framebuffer(&device, presenter_acquire(&presenter), presenter.pitch);
         device_clear(&device, 0);
-        camera_at_zero(&device, pos, 0, 0);
         
-        if (screen_keys[VK_UP]) pos -= 0.01f;
-        if (screen_keys[VK_DOWN]) pos += 0.01f;
-        if (screen_keys[VK_LEFT]) alpha += 0.01f;
-        if (screen_keys[VK_RIGHT]) alpha -= 0.01f;
+        // 移动按固定步长推进，与帧率无关
+        for (i = 0; i < steps; i++) {
+            if (screen_keys[VK_UP]) pos -= 0.01f;
+            if (screen_keys[VK_DOWN]) pos += 0.01f;
+            if (screen_keys[VK_LEFT]) alpha += 0.01f;
+            if (screen_keys[VK_RIGHT]) alpha -= 0.01f;
+        }
+        camera_at_zero(&device, pos, 0, 0);
 
         if (screen_keys[VK_TAB]) REMOVE_BACKFACE = (REMOVE_BACKFACE + 1) % 2;
 
@@ -741,9 +5105,709 @@ int main(void)
             kbhit = 0;
         }
 
+        if (screen_keys['F']) {
+            if (fkhit == 0) {
+                fkhit = 1;
+                device_set_texture_filter(&device, (device.tex_filter + 1) % 4);
+            }
+        }   else {
+            fkhit = 0;
+        }
+
+        if (screen_keys['L']) {
+            if (lkhit == 0) {
+                lkhit = 1;
+                device_set_texture_layout(&device, (device.tex_layout + 1) % 4);
+            }
+        }   else {
+            lkhit = 0;
+        }
+
         draw_box(&device, alpha);
-        screen_update();
-        Sleep(1);
+        device_flush(&device);
+        trace_frame(&device);
+        presenter_submit(&presenter);
+    }
+    trace_end(&device);
+    presenter_destroy(&presenter);
+    device_destroy(&device);
+    return 0;
+}
+#endif  // !MINI3D_BENCH
+
+
+#ifdef MINI3D_BENCH
+//=====================================================================
+// Benchmark：无窗口渲染 N 帧，统计每帧耗时
+//=====================================================================
+typedef struct {
+    const char *scene;          // 场景：box / close / floor / grid / stack / occlude / mesh / city / hizedge
+    int width, height;          // 分辨率
+    int frames;                 // 计时帧数
+    int warmup;                 // 预热帧数（不计时）
+    int render_state;           // 渲染状态
+    int cull;                   // 背面剔除
+    int clear_mode;             // device_clear 的模式
+    int count;                  // grid / stack / city 场景中立方体的数量（每个维度）
+    int threads;                // 光栅化线程数，0 为立即绘制
+    int rasterizer;             // RASTERIZER_*
+    int simd;                   // 扫描线内核的 SIMD 级别上限，-1 为自动检测
+    int hiz;                    // 分层深度剔除
+    int lights;                 // 光源数量：一个平行光，其余为点光源
+    int filter;                 // 纹理过滤：TEXTURE_*
+    int layout;                 // 纹理存储方式：TEXTURE_LINEAR 等
+    int bvh;                    // city 场景用 BVH 做视锥剔除，0 为逐个绘制所有物体
+    int instanced;              // grid 场景用一次实例化绘制代替逐个 draw_box_world
+    int commands;               // BENCH_COMMANDS_*：是否经过命令缓冲排序后绘制
+    const char *pipe;           // 非 NULL 时每帧以 PPM 写入这个命令的标准输入
+    int buffers;                // 颜色缓冲数：1 为同步写管道，2 / 3 由呈现线程写
+    int pitch;                  // 颜色缓冲和深度缓存每行的像素数，0 为默认
+    int huge_pages;             // 颜色缓冲和深度缓存是否尝试使用大页
+    int depth_format;           // DEPTH_*
+    float far;                  // 远平面，0 为无限远
+    double fps;                 // 大于 0 时用帧节拍器限制帧率
+    int timers;                 // 各阶段计时（device->stats_timing），-1 为有 -csv 时打开
+    const char *csv;            // 非 NULL 时把每帧的统计逐行写入这个 CSV 文件
+    const char *capture;        // 非 NULL 时把计时的各帧录制到这个 trace 文件
+    const char *replay;         // 非 NULL 时重放这个 trace 文件代替场景
+    scene_t city;               // city 场景的物体
+    double drawn;               // city 场景累计绘制的物体数
+    const char *mesh_file;      // mesh 场景绘制的网格文件
+    mesh_t mesh;
+    const char *texture_file;   // 代替棋盘格的纹理文件（BMP / TGA / DDS）
+    texture_t texture;
+    const char *ppm;            // 非 NULL 时按 "前缀%04d.ppm" 输出每帧
+}   bench_opts_t;
+
+#ifdef _WIN32
+#define popen _popen
+#define pclose _pclose
+#define BENCH_PIPE_MODE "wb"
+#else
+#define BENCH_PIPE_MODE "w"
+#endif
+
+int bench_pipe_error = 0;
+
+// 呈现函数：把帧以 PPM 写入管道，例如交给 ffmpeg -f image2pipe 编码
+void bench_present_pipe(void *user, const IUINT32 *pixels, long pitch, int width, int height) {
+    if (ppm_write((FILE*)user, pixels, pitch, width, height) != 0) bench_pipe_error = 1;
+}
+
+#define BENCH_COMMANDS_OFF      0   // 立即绘制
+#define BENCH_COMMANDS_SORT     1   // 每帧录制、排序后执行
+#define BENCH_COMMANDS_REPLAY   2   // 只录制第一帧，之后每帧重新执行
+
+// 建立 city 场景：n x n 个高低不同的立方体铺在间距 6 的网格上，
+// 远平面之外和视线背后的大部分物体都不可见
+int bench_build_city(bench_opts_t *opts) {
+    int i, j, n = opts->count;
+    box_init();
+    for (j = 0; j < n; j++) {
+        for (i = 0; i < n; i++) {
+            float h = 1.0f + 3.0f * (((unsigned)(i * 7919 + j * 104729) * 2654435761u) >> 24) / 255.0f;
+            matrix_t s, t, m;
+            matrix_set_scale(&s, 1.0f, h, 1.0f);
+            matrix_set_translate(&t, (i - 0.5f * (n - 1)) * 6.0f, h - 2.0f, (j - 0.5f * (n - 1)) * 6.0f);
+            matrix_mul(&m, &s, &t);
+            if (scene_add(&opts->city, box_vertices, box_normals, 24, box_indices, 36, &m) < 0) 
+                return -1;
+        }
+    }
+    return scene_build(&opts->city);
+}
+
+// 观察空间中投影到屏幕 (x, y)、深度为 rhw 的顶点（世界和观察矩阵为单位矩阵时）
+void bench_screen_vertex(const device_t *device, vertex_t *v, float x, float y, float rhw) {
+    const transform_t *ts = &device->transform;
+    float z = 1.0f / rhw;
+    v->pos.x = (2.0f * x / ts->w - 1.0f) * z / ts->projection.m[0][0];
+    v->pos.y = (1.0f - 2.0f * y / ts->h) * z / ts->projection.m[1][1];
+    v->pos.z = z;
+    v->pos.w = 1.0f;
+    v->tc.u = x / ts->w, v->tc.v = y / ts->h;
+    v->color.r = 1.0f, v->color.g = 0.5f, v->color.b = 0.2f;
+    v->rhw = 1.0f;
+}
+
+// 绘制第 frame 帧的场景，场景名无效时返回 -1
+int bench_draw_scene(device_t *device, bench_opts_t *opts, int frame) {
+    float theta = 0.01f * frame;
+    matrix_t r, s, t, m;
+    int i, j, n = opts->count;
+    if (strcmp(opts->scene, "box") == 0) {
+        camera_at_zero(device, 5.5f, 0, 0);
+        draw_box(device, theta);
+    }
+    else if (strcmp(opts->scene, "close") == 0) {      // 摄像机贴近立方体，纹理铺满屏幕
+        camera_at_zero(device, 2.2f, 0, 0);
+        draw_box(device, theta);
+    }
+    else if (strcmp(opts->scene, "floor") == 0) {      // 穿过近平面的大块地面，测试齐次裁剪
+        camera_at_zero(device, 3.5f, 0.5f, 0.3f);
+        draw_floor(device, 20.0f, -1.5f);
+        draw_box(device, theta);
+    }
+    else if (strcmp(opts->scene, "occlude") == 0) {    // 与 stack 相同，但由近及远绘制，后面的立方体大多被遮挡
+        camera_at_zero(device, 3.5f, 0, 0);
+        for (i = n - 1; i >= 0; i--) {
+            matrix_set_rotate(&r, -1, 1, 1, theta + i * 0.2f);
+            matrix_set_translate(&t, -2.0f * (n - 1 - i), 0, 0);
+            matrix_mul(&m, &r, &t);
+            draw_box_world(device, &m);
+        }
+    }
+    else if (strcmp(opts->scene, "grid") == 0) {       // n x n 个小立方体平铺在视平面上
+        float step = 4.0f / n;
+        matrix_t *worlds = NULL;
+        camera_at_zero(device, 3.5f, 0, 0);
+        matrix_set_scale(&s, step * 0.35f, step * 0.35f, step * 0.35f);
+        if (opts->instanced) {
+            worlds = (matrix_t*)malloc(sizeof(matrix_t) * n * n);
+            assert(worlds);
+        }
+        for (j = 0; j < n; j++) {
+            for (i = 0; i < n; i++) {
+                matrix_set_rotate(&r, -1, 1, 1, theta + i * 0.3f + j * 0.7f);
+                matrix_set_translate(&t, 0, (j + 0.5f) * step - 2.0f, (i + 0.5f) * step - 2.0f);
+                matrix_mul(&m, &s, &r);
+                matrix_mul(&m, &m, &t);
+                if (worlds) worlds[j * n + i] = m;
+                else draw_box_world(device, &m);
+            }
+        }
+        if (worlds) {
+            box_init();
+            device_draw_instanced(device, box_vertices, box_normals, 24, box_indices, 36, 
+                worlds, NULL, n * n);
+            free(worlds);
+        }
+    }
+    else if (strcmp(opts->scene, "stack") == 0) {      // n 个立方体沿视线由远及近排列，制造重叠绘制
+        camera_at_zero(device, 3.5f, 0, 0);
+        for (i = 0; i < n; i++) {
+            matrix_set_rotate(&r, -1, 1, 1, theta + i * 0.2f);
+            matrix_set_translate(&t, -2.0f * (n - 1 - i), 0, 0);
+            matrix_mul(&m, &r, &t);
+            draw_box_world(device, &m);
+        }
+    }
+    else if (strcmp(opts->scene, "mesh") == 0 && opts->mesh.base) {  // 网格缩放到半径为 1.5 的球内并旋转
+        const mesh_header_t *h = opts->mesh.header;
+        vector_t size;
+        float scale;
+        vector_sub(&size, &h->bound_max, &h->bound_min);
+        scale = 3.0f / vector_length(&size);
+        camera_at_zero(device, 3.5f, 0, 0);
+        matrix_set_translate(&t, -0.5f * (h->bound_min.x + h->bound_max.x), 
+            -0.5f * (h->bound_min.y + h->bound_max.y), -0.5f * (h->bound_min.z + h->bound_max.z));
+        matrix_set_scale(&s, scale, scale, scale);
+        matrix_set_rotate(&r, 0, 1, 0, theta);
+        matrix_mul(&m, &t, &s);
+        matrix_mul(&device->transform.world, &m, &r);
+        transform_update(&device->transform);
+        device_draw_mesh(device, &opts->mesh);
+    }
+    else if (strcmp(opts->scene, "hizedge") == 0) {    // 铺满屏幕的遮挡面之后，左边缘恰好露出一列像素的三角形
+        vector_t normal = {0, 0, -1, 0};
+        vertex_t v[4];
+        float w = device->transform.w, h = device->transform.h;
+        matrix_set_identity(&device->transform.world);
+        matrix_set_identity(&device->transform.view);
+        transform_update(&device->transform);
+        // 遮挡面的 rhw 比三角形的最大 rhw 大 0.11%，在 max_rhw * 1.001 的余量之外；
+        // 左边取整到 28.4 后覆盖 x = 100.5 的像素中心，外推的 rhw 能通过深度测试
+        bench_screen_vertex(device, &v[0], -10.0f, -10.0f, 0.90099f);
+        bench_screen_vertex(device, &v[1], -10.0f, h + 10.0f, 0.90099f);
+        bench_screen_vertex(device, &v[2], w + 10.0f, h + 10.0f, 0.90099f);
+        bench_screen_vertex(device, &v[3], w + 10.0f, -10.0f, 0.90099f);
+        device_draw_primitive(device, &v[0], &v[1], &v[2], &normal);
+        device_draw_primitive(device, &v[2], &v[3], &v[0], &normal);
+        bench_screen_vertex(device, &v[0], 100.53f, 100.0f, 0.9f);
+        bench_screen_vertex(device, &v[1], 100.53f, 300.0f, 0.9f);
+        bench_screen_vertex(device, &v[2], 115.53f, 200.0f, 0.24f);
+        device_draw_primitive(device, &v[0], &v[1], &v[2], &normal);
+    }
+    else if (strcmp(opts->scene, "city") == 0) {       // 摄影机站在 city 中央原地转圈
+        point_t eye = {0, 3.0f, 0, 1}, up = {0, 1, 0, 0};
+        point_t at = {(float)cos(theta), 2.8f, (float)sin(theta), 1};
+        matrix_set_lookat(&device->transform.view, &eye, &at, &up);
+        if (opts->bvh) {
+            opts->drawn += device_draw_scene(device, &opts->city);
+        }   else {
+            for (i = 0; i < opts->city.count; i++) {
+                device_draw_object(device, &opts->city.objects[i]);
+            }
+            opts->drawn += opts->city.count;
+        }
+    }
+    else {
+        return -1;
     }
     return 0;
 }
+
+// 按 TEXTURE_RGB32 等格式索引
+const char *bench_format_names[] = { "rgb32", "p8", "bc1", "bc3" };
+
+// 把一帧的统计累加到 sum
+void bench_stats_add(device_stats_t *sum, const device_stats_t *stats) {
+    int i;
+    sum->triangles += stats->triangles;
+    sum->culled += stats->culled;
+    sum->rejected += stats->rejected;
+    sum->trapezoids += stats->trapezoids;
+    sum->spans += stats->spans;
+    sum->tested += stats->tested;
+    sum->depth_failed += stats->depth_failed;
+    sum->written += stats->written;
+    for (i = 0; i < STAGE_COUNT; i++) sum->ms[i] += stats->ms[i];
+}
+
+// 写出一帧的统计，frame < 0 时写表头
+void bench_csv_row(FILE *fp, int frame, double ms, const device_stats_t *s) {
+    if (frame < 0) {
+        fprintf(fp, "frame,ms,triangles,culled,rejected,trapezoids,spans,tested,depth_failed,"
+            "written,vertex_ms,setup_ms,raster_ms,clear_ms,present_ms\n");
+        return;
+    }
+    fprintf(fp, "%d,%.4f,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%lld,%.4f,%.4f,%.4f,%.4f,%.4f\n", 
+        frame, ms, s->triangles, s->culled, s->rejected, s->trapezoids, s->spans, s->tested, 
+        s->depth_failed, s->written, s->ms[STAGE_VERTEX], s->ms[STAGE_SETUP], 
+        s->ms[STAGE_RASTER], s->ms[STAGE_CLEAR], s->ms[STAGE_PRESENT]);
+}
+
+int bench_compare_double(const void *a, const void *b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x < y)? -1 : ((x > y)? 1 : 0);
+}
+
+void bench_usage(void) {
+    printf("usage: mini3d_bench [options]\n"
+        "  -scene box|close|floor|grid|stack|occlude|mesh|city|hizedge  scene to render (default box)\n"
+        "  -mesh FILE                      mesh file for the mesh scene (see obj2mesh)\n"
+        "  -texture FILE                   BMP/TGA/DDS texture instead of the checkerboard\n"
+        "  -filter nearest|mipmap|bilinear|trilinear  texture filter (default nearest)\n"
+        "  -layout linear|tile4|tile8|morton  texture storage order (default linear)\n"
+        "  -size WxH                       resolution (default 800x600)\n"
+        "  -frames N                       timed frames (default 200)\n"
+        "  -warmup N                       untimed frames (default 10)\n"
+        "  -state texture|color|wireframe  render state (default texture)\n"
+        "  -cull 0|1                       backface culling (default 1)\n"
+        "  -clear 0|1                      0: background color, 1: gradient\n"
+        "  -count N                        cubes per axis for grid/stack/city (default 8)\n"
+        "  -bvh 0|1                        frustum culling through the BVH in city (default 1)\n"
+        "  -instanced 0|1                  draw the grid with one instanced call (default 0)\n"
+        "  -commands off|sort|replay       record into a sorted command buffer (default off)\n"
+        "  -pipe CMD                       write every frame as PPM to the stdin of CMD\n"
+        "  -buffers 1|2|3                  color buffers; 2, 3: present on a separate thread\n"
+        "  -fps N                          pace frames with a fixed timestep (default off)\n"
+        "  -pitch N                        pixels per color/depth row, rounded up to 16 (default width)\n"
+        "  -hugepages 0|1                  try huge pages for color/depth buffers (default 1)\n"
+        "  -depth f32|u16                  depth buffer: float rhw or 16-bit integer (default f32)\n"
+        "  -far N                          far clip plane, 0 for infinite (default 500)\n"
+        "  -timers 0|1                     time every pipeline stage (default: on with -csv)\n"
+        "  -csv FILE                       write per-frame pipeline statistics to FILE\n"
+        "  -capture FILE                   record the timed frames into a trace file\n"
+        "  -replay FILE                    replay a trace (looping) instead of a scene\n"
+        "  -threads N                      0: immediate, N >= 1: tiled with N threads\n"
+        "  -raster trapezoid|halfspace     triangle rasterizer (default trapezoid)\n"
+        "  -simd auto|scalar|sse41|avx2    span kernel instruction set (default auto)\n"
+        "  -hiz 0|1                        hierarchical depth rejection (default 1)\n"
+        "  -lights N                       1 directional + N-1 point lights (default 1)\n"
+        "  -ppm PREFIX                     dump every timed frame as PREFIX%%04d.ppm\n");
+}
+
+int main(int argc, char *argv[])
+{
+    bench_opts_t opts;
+    device_t device;
+    command_buffer_t commands;
+    presenter_t presenter;
+    pacer_t pacer;
+    device_stats_t stats, stats_sum;
+    FILE *pipe = NULL, *csv = NULL;
+    trace_writer_t writer;
+    trace_t trace;
+    size_t trace_offset = 0;
+    IUINT64 frame_hash = 0;
+    int mismatch = 0;
+    IUINT64 start;
+    double *times, *clears, total = 0, clear_total = 0, t0, t1, tc, t2, wall = 0;
+    const char *state_name = "texture";
+    int i, n;
+
+    opts.scene = "box";
+    opts.width = 800;
+    opts.height = 600;
+    opts.frames = 200;
+    opts.warmup = 10;
+    opts.render_state = RENDER_STATE_TEXTURE;
+    opts.cull = 1;
+    opts.clear_mode = 0;
+    opts.count = 8;
+    opts.threads = 0;
+    opts.rasterizer = RASTERIZER_TRAPEZOID;
+    opts.simd = -1;
+    opts.hiz = 1;
+    opts.lights = 1;
+    opts.filter = TEXTURE_NEAREST;
+    opts.layout = TEXTURE_LINEAR;
+    opts.bvh = 1;
+    opts.instanced = 0;
+    opts.commands = BENCH_COMMANDS_OFF;
+    opts.pipe = NULL;
+    opts.buffers = 2;
+    opts.pitch = 0;
+    opts.huge_pages = 1;
+    opts.depth_format = DEPTH_FLOAT32;
+    opts.far = FAR_PLANE;
+    opts.fps = 0;
+    opts.timers = -1;
+    opts.csv = NULL;
+    opts.capture = NULL;
+    opts.replay = NULL;
+    opts.drawn = 0;
+    opts.mesh_file = NULL;
+    opts.texture_file = NULL;
+    opts.ppm = NULL;
+
+    for (i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *val = (i + 1 < argc)? argv[i + 1] : NULL;
+        if (strcmp(arg, "-help") == 0) {
+            bench_usage();
+            return 0;
+        }
+        if (val == NULL) {
+            bench_usage();
+            return -1;
+        }
+        i++;
+        if (strcmp(arg, "-scene") == 0) opts.scene = val;
+        else if (strcmp(arg, "-size") == 0) {
+            if (sscanf(val, "%dx%d", &opts.width, &opts.height) != 2) opts.width = 0;
+        }
+        else if (strcmp(arg, "-frames") == 0) opts.frames = atoi(val);
+        else if (strcmp(arg, "-warmup") == 0) opts.warmup = atoi(val);
+        else if (strcmp(arg, "-state") == 0) {
+            state_name = val;
+            if (strcmp(val, "texture") == 0) opts.render_state = RENDER_STATE_TEXTURE;
+            else if (strcmp(val, "color") == 0) opts.render_state = RENDER_STATE_COLOR;
+            else if (strcmp(val, "wireframe") == 0) opts.render_state = RENDER_STATE_WIREFRAME;
+            else opts.render_state = 0;
+        }
+        else if (strcmp(arg, "-cull") == 0) opts.cull = atoi(val);
+        else if (strcmp(arg, "-clear") == 0) opts.clear_mode = atoi(val);
+        else if (strcmp(arg, "-count") == 0) opts.count = atoi(val);
+        else if (strcmp(arg, "-threads") == 0) opts.threads = atoi(val);
+        else if (strcmp(arg, "-raster") == 0) {
+            if (strcmp(val, "trapezoid") == 0) opts.rasterizer = RASTERIZER_TRAPEZOID;
+            else if (strcmp(val, "halfspace") == 0) opts.rasterizer = RASTERIZER_HALFSPACE;
+            else opts.rasterizer = -1;
+        }
+        else if (strcmp(arg, "-simd") == 0) {
+            if (strcmp(val, "auto") == 0) opts.simd = -1;
+            else if (strcmp(val, "scalar") == 0) opts.simd = SIMD_SCALAR;
+            else if (strcmp(val, "sse41") == 0) opts.simd = SIMD_SSE41;
+            else if (strcmp(val, "avx2") == 0) opts.simd = SIMD_AVX2;
+            else opts.simd = -2;
+        }
+        else if (strcmp(arg, "-hiz") == 0) opts.hiz = atoi(val);
+        else if (strcmp(arg, "-bvh") == 0) opts.bvh = atoi(val);
+        else if (strcmp(arg, "-instanced") == 0) opts.instanced = atoi(val);
+        else if (strcmp(arg, "-pipe") == 0) opts.pipe = val;
+        else if (strcmp(arg, "-buffers") == 0) opts.buffers = atoi(val);
+        else if (strcmp(arg, "-pitch") == 0) opts.pitch = atoi(val);
+        else if (strcmp(arg, "-hugepages") == 0) opts.huge_pages = atoi(val);
+        else if (strcmp(arg, "-depth") == 0) {
+            if (strcmp(val, "f32") == 0) opts.depth_format = DEPTH_FLOAT32;
+            else if (strcmp(val, "u16") == 0) opts.depth_format = DEPTH_UNORM16;
+            else opts.depth_format = -1;
+        }
+        else if (strcmp(arg, "-far") == 0) opts.far = (float)atof(val);
+        else if (strcmp(arg, "-fps") == 0) opts.fps = atof(val);
+        else if (strcmp(arg, "-timers") == 0) opts.timers = atoi(val);
+        else if (strcmp(arg, "-csv") == 0) opts.csv = val;
+        else if (strcmp(arg, "-capture") == 0) opts.capture = val;
+        else if (strcmp(arg, "-replay") == 0) opts.replay = val;
+        else if (strcmp(arg, "-commands") == 0) {
+            if (strcmp(val, "off") == 0) opts.commands = BENCH_COMMANDS_OFF;
+            else if (strcmp(val, "sort") == 0) opts.commands = BENCH_COMMANDS_SORT;
+            else if (strcmp(val, "replay") == 0) opts.commands = BENCH_COMMANDS_REPLAY;
+            else opts.commands = -1;
+        }
+        else if (strcmp(arg, "-lights") == 0) opts.lights = atoi(val);
+        else if (strcmp(arg, "-mesh") == 0) opts.mesh_file = val;
+        else if (strcmp(arg, "-texture") == 0) opts.texture_file = val;
+        else if (strcmp(arg, "-filter") == 0) {
+            if (strcmp(val, "nearest") == 0) opts.filter = TEXTURE_NEAREST;
+            else if (strcmp(val, "mipmap") == 0) opts.filter = TEXTURE_MIPMAP;
+            else if (strcmp(val, "bilinear") == 0) opts.filter = TEXTURE_BILINEAR;
+            else if (strcmp(val, "trilinear") == 0) opts.filter = TEXTURE_TRILINEAR;
+            else opts.filter = -1;
+        }
+        else if (strcmp(arg, "-layout") == 0) {
+            if (strcmp(val, "linear") == 0) opts.layout = TEXTURE_LINEAR;
+            else if (strcmp(val, "tile4") == 0) opts.layout = TEXTURE_TILE4;
+            else if (strcmp(val, "tile8") == 0) opts.layout = TEXTURE_TILE8;
+            else if (strcmp(val, "morton") == 0) opts.layout = TEXTURE_MORTON;
+            else opts.layout = -1;
+        }
+        else if (strcmp(arg, "-ppm") == 0) opts.ppm = val;
+        else {
+            bench_usage();
+            return -1;
+        }
+    }
+
+    if (opts.width < 2 || opts.height < 2 || opts.frames < 1 || opts.warmup < 0 ||
+        opts.render_state == 0 || opts.count < 1 || opts.threads < 0 || opts.rasterizer < 0 ||
+        opts.simd < -1 || opts.lights < 0 || opts.lights > MAX_LIGHTS || opts.filter < 0 || 
+        opts.layout < 0 || opts.commands < 0 || opts.buffers < 1 || 
+        opts.buffers > PRESENT_MAX_BUFFERS || opts.fps < 0 || opts.depth_format < 0 || 
+        opts.far < 0 || (opts.far > 0 && opts.far <= NEAR_PLANE)) {
+        bench_usage();
+        return -1;
+    }
+
+    memset(&trace, 0, sizeof(trace_t));
+    if (opts.replay) {
+        int hr = trace_load(&trace, opts.replay);
+        if (hr != 0) {
+            printf("%s trace %s\n", (hr == -1)? "can not load" : "invalid", opts.replay);
+            return -1;
+        }
+        opts.scene = "replay";
+        opts.width = trace.header->width;
+        opts.height = trace.header->height;
+        printf("trace: %dx%d  %d frames  %d textures  %d meshes  %.1f MB\n", opts.width, 
+            opts.height, trace.frame_count, trace.texture_count, trace.geometry_count, 
+            trace.size / 1048576.0);
+    }
+
+    memset(&opts.mesh, 0, sizeof(mesh_t));
+    if (opts.mesh_file) {
+        t0 = timer_ms();
+        if (mesh_load(&opts.mesh, opts.mesh_file) != 0) {
+            printf("can not load mesh %s\n", opts.mesh_file);
+            return -1;
+        }
+        printf("mesh: %d vertices  %d triangles  %.1f MB  load %.3f ms\n", 
+            opts.mesh.vertex_count, opts.mesh.index_count / 3, 
+            opts.mesh.size / 1048576.0, timer_ms() - t0);
+    }
+
+    scene_init(&opts.city);
+    if (strcmp(opts.scene, "city") == 0) {
+        t0 = timer_ms();
+        if (bench_build_city(&opts) != 0) {
+            printf("can not build city\n");
+            return -1;
+        }
+        printf("city: %d objects  %d nodes  build %.3f ms\n", opts.city.count, 
+            opts.city.node_count, timer_ms() - t0);
+    }
+
+    memset(&opts.texture, 0, sizeof(texture_t));
+    if (opts.texture_file) {
+        t0 = timer_ms();
+        if (texture_load(&opts.texture, opts.texture_file) != 0) {
+            printf("can not load texture %s\n", opts.texture_file);
+            return -1;
+        }
+        printf("texture: %dx%d  %s  %s  load %.3f ms\n", opts.texture.width, opts.texture.height, 
+            bench_format_names[opts.texture.format], opts.texture.map? "mapped" : "converted", 
+            timer_ms() - t0);
+    }
+
+    HUGE_PAGES = opts.huge_pages;
+    device_init_pitch(&device, opts.width, opts.height, NULL, opts.pitch);
+    printf("buffers: pitch %d  %.1f MB  %s pages\n", device.pitch, device.planes_size / 1048576.0, 
+        (device.planes_pages == PAGES_HUGE)? "huge" : 
+        ((device.planes_pages == PAGES_TRANSPARENT)? "transparent huge" : "normal"));
+    device_set_depth_format(&device, opts.depth_format);
+    if (opts.far != FAR_PLANE) device_set_far_plane(&device, opts.far);
+    printf("depth: %s  far %g%s\n", (opts.depth_format == DEPTH_UNORM16)? "u16" : "f32", 
+        opts.far, (opts.far > 0)? "" : " (infinite)");
+
+    init_lighting(&device);
+    if (opts.lights == 0) device.lighting.count = 0;
+    for (i = 1; i < opts.lights; i++) {     // 点光源均匀分布在摄影机一侧
+        float a = 6.2831853f * i / opts.lights;
+        lighting_add_point(&device.lighting, 3.0f, 2.5f * (float)cos(a), 2.5f * (float)sin(a), 
+            0.8f, 0.05f);
+    }
+    init_texture(&device);
+    if (opts.texture_file) {
+        device_set_texture_format(&device, opts.texture.format, opts.texture.bits, 
+            opts.texture.pitch, opts.texture.width, opts.texture.height, opts.texture.palette);
+    }
+    device_set_texture_filter(&device, opts.filter);
+    device_set_texture_layout(&device, opts.layout);
+    device.render_state = opts.render_state;
+    device.rasterizer = opts.rasterizer;
+    if (opts.simd >= 0 && opts.simd < span_simd) span_simd = opts.simd;
+    device.hiz_test = opts.hiz;
+    REMOVE_BACKFACE = opts.cull;
+    device_set_threads(&device, opts.threads);
+    device.stats_timing = (opts.timers < 0)? (opts.csv != NULL) : opts.timers;
+    memset(&stats_sum, 0, sizeof(device_stats_t));
+
+    command_buffer_init(&commands);
+    times = (double*)malloc(sizeof(double) * opts.frames * 2);
+    assert(times);
+    clears = times + opts.frames;
+
+    if (opts.pipe) {
+#ifndef _WIN32
+        signal(SIGPIPE, SIG_IGN);       // 编码器提前退出时让 fwrite 返回错误而不是结束进程
+#endif
+        pipe = popen(opts.pipe, BENCH_PIPE_MODE);
+        if (pipe == NULL) {
+            printf("can not run %s\n", opts.pipe);
+            return -1;
+        }
+        if (presenter_init(&presenter, opts.width, opts.height, opts.buffers, 
+            bench_present_pipe, pipe) != 0) {
+            printf("can not create presenter\n");
+            return -1;
+        }
+    }
+    if (opts.fps > 0) pacer_init(&pacer, opts.fps);
+    if (opts.csv) {
+        csv = fopen(opts.csv, "w");
+        if (csv == NULL) {
+            printf("can not write %s\n", opts.csv);
+            return -1;
+        }
+        bench_csv_row(csv, -1, 0, NULL);
+    }
+
+    for (n = -opts.warmup; n < opts.frames; n++) {
+        if (opts.fps > 0) pacer_wait(&pacer);
+        t0 = timer_ms();
+        if (n == 0) wall = t0;
+        if (n == 0 && opts.capture && trace_begin(&device, &writer, opts.capture) != 0) {
+            printf("can not write %s\n", opts.capture);
+            return -1;
+        }
+        device_stats_reset(&device);
+        start = device_stage_begin(&device);
+        if (pipe) device_set_framebuffer(&device, presenter_acquire(&presenter), presenter.pitch);
+        device_stage_end(&device, STAGE_PRESENT, start);
+        if (opts.replay) {
+            // 重放的清屏在 trace 中，计入 tc 之后的绘制时间
+            tc = timer_ms();
+            trace_offset = trace_play(&device, &trace, trace_offset, &frame_hash);
+        }   else {
+            device_clear(&device, opts.clear_mode);
+            tc = timer_ms();
+        }
+        if (opts.replay == NULL && (opts.commands == BENCH_COMMANDS_OFF || 
+            opts.commands == BENCH_COMMANDS_SORT || n == -opts.warmup)) {
+            if (opts.commands != BENCH_COMMANDS_OFF) device_begin_commands(&device, &commands);
+            if (bench_draw_scene(&device, &opts, n + opts.warmup) != 0) {
+                printf("unknown scene: %s\n", opts.scene);
+                return -1;
+            }
+            if (opts.commands != BENCH_COMMANDS_OFF) device_end_commands(&device);
+        }
+        if (opts.replay == NULL && opts.commands != BENCH_COMMANDS_OFF) 
+            device_execute_commands(&device, &commands);
+        device_flush(&device);
+        t1 = timer_ms();
+        trace_frame(&device);
+        if (opts.replay && trace_frame_hash(&device) != frame_hash) mismatch++;
+        if (n >= 0 && opts.ppm) {
+            char name[1024];
+            sprintf(name, "%.1000s%04d.ppm", opts.ppm, n);
+            if (device_save_ppm(&device, name) != 0) {
+                printf("can not write %s\n", name);
+                return -1;
+            }
+        }
+        // 呈现计入帧时间：单缓冲时是整次写管道，多缓冲时只是入队
+        t2 = timer_ms();
+        start = device_stage_begin(&device);
+        if (pipe) presenter_submit(&presenter);
+        device_stage_end(&device, STAGE_PRESENT, start);
+        t1 += timer_ms() - t2;
+        if (n < 0) continue;
+        device_get_stats(&device, &stats);
+        bench_stats_add(&stats_sum, &stats);
+        if (csv) bench_csv_row(csv, n, t1 - t0, &stats);
+        times[n] = t1 - t0;
+        total += t1 - t0;
+        clears[n] = tc - t0;
+        clear_total += tc - t0;
+    }
+    if (pipe) {
+        presenter_finish(&presenter);
+        wall = timer_ms() - wall;
+    }
+
+    qsort(times, opts.frames, sizeof(double), bench_compare_double);
+    qsort(clears, opts.frames, sizeof(double), bench_compare_double);
+    printf("scene=%s size=%dx%d state=%s cull=%d threads=%d raster=%s simd=%s hiz=%d frames=%d\n", 
+        opts.scene, opts.width, opts.height, state_name, opts.cull, opts.threads, 
+        (opts.rasterizer == RASTERIZER_HALFSPACE)? "halfspace" : "trapezoid", 
+        (span_simd == SIMD_AVX2)? "avx2" : ((span_simd == SIMD_SSE41)? "sse41" : "scalar"),
+        opts.hiz, opts.frames);
+    printf("frame ms: min %.3f  median %.3f  p99 %.3f  mean %.3f\n", times[0], 
+        times[opts.frames / 2], times[(opts.frames * 99 + 99) / 100 - 1], 
+        total / opts.frames);
+    printf("clear ms: min %.3f  median %.3f  p99 %.3f  mean %.3f\n", clears[0], 
+        clears[opts.frames / 2], clears[(opts.frames * 99 + 99) / 100 - 1], 
+        clear_total / opts.frames);
+    printf("fill: %.2f Mpixels/s\n", 
+        (double)opts.width * opts.height * opts.frames / (total * 1000.0));
+    if (pipe) {
+        printf("present: buffers=%d  wait %.3f ms/frame  wall %.3f ms/frame%s\n", opts.buffers, 
+            presenter.wait_ms / (opts.frames + opts.warmup), wall / opts.frames, 
+            bench_pipe_error? "  (pipe write failed)" : "");
+        presenter_destroy(&presenter);
+        pclose(pipe);
+    }
+    if (opts.commands != BENCH_COMMANDS_OFF) {
+        printf("commands: %d per frame  %s\n", commands.count, 
+            (opts.commands == BENCH_COMMANDS_SORT)? "recorded every frame" : "replayed");
+    }
+    if (opts.city.count > 0) {
+        double drawn = opts.drawn / (opts.frames + opts.warmup);
+        printf("objects: %.1f of %d drawn per frame (%.1f%%)  bvh=%d\n", drawn, 
+            opts.city.count, 100.0 * drawn / opts.city.count, opts.bvh);
+    }
+    printf("triangles: %.0f  culled %.0f  rejected %.0f  trapezoids %.0f  spans %.0f per frame\n", 
+        (double)stats_sum.triangles / opts.frames, (double)stats_sum.culled / opts.frames, 
+        (double)stats_sum.rejected / opts.frames, (double)stats_sum.trapezoids / opts.frames, 
+        (double)stats_sum.spans / opts.frames);
+    printf("pixels: tested %.0f  depth failed %.0f  written %.0f per frame  overdraw %.2f\n", 
+        (double)stats_sum.tested / opts.frames, (double)stats_sum.depth_failed / opts.frames, 
+        (double)stats_sum.written / opts.frames, 
+        (double)stats_sum.written / ((double)opts.width * opts.height * opts.frames));
+    if (device.stats_timing) {
+        printf("stage ms: vertex %.3f  setup %.3f  raster %.3f  clear %.3f  present %.3f\n", 
+            stats_sum.ms[STAGE_VERTEX] / opts.frames, stats_sum.ms[STAGE_SETUP] / opts.frames, 
+            stats_sum.ms[STAGE_RASTER] / opts.frames, stats_sum.ms[STAGE_CLEAR] / opts.frames, 
+            stats_sum.ms[STAGE_PRESENT] / opts.frames);
+    }
+    if (csv && fclose(csv) != 0) printf("can not write %s\n", opts.csv);
+    if (opts.capture) {
+        printf("capture: %d frames  %s%s\n", writer.frames, opts.capture, 
+            (trace_end(&device) != 0)? "  (write failed)" : "");
+    }
+    if (opts.replay) {
+        printf("replay: %d frames played  %d mismatched\n", opts.frames + opts.warmup, mismatch);
+    }
+
+    free(times);
+    device_destroy(&device);
+    mesh_free(&opts.mesh);
+    texture_free(&opts.texture);
+    scene_destroy(&opts.city);
+    command_buffer_destroy(&commands);
+    trace_free(&trace);
+    return (mismatch > 0)? 1 : 0;
+}
+#endif  // MINI3D_BENCH
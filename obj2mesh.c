@@ -0,0 +1,341 @@
+//=====================================================================
+// obj2mesh：把 Wavefront OBJ 离线转换为 mini3d 的网格文件（mesh_header_t）
+//
+// build:
+//   gcc -O2 obj2mesh.c -o obj2mesh -lm
+//   cl -O2 -nologo obj2mesh.c
+//
+// usage:
+//   obj2mesh [-flip] [-lh] input.obj output.m3d
+//
+// 支持 v（可带 r g b 顶点色）/ vt / vn / f，面的顶点可以写成 v、v/vt、
+// v//vn、v/vt/vn，索引可以为负数（相对于当前末尾），多边形按扇形拆成
+// 三角形。相同的 v/vt/vn 组合只输出一个顶点；没有 vn 的顶点使用共享
+// 该位置的各个面的面积加权法向量。输出的顶点、法向量与索引段与内存中
+// vertex_t / vector_t / int 的布局一致，mini3d 映射文件后直接绘制
+//=====================================================================
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "3dMath.h"
+
+// 可增长数组：元素大小为 size，容量不足时按两倍扩展
+typedef struct { char *data; size_t count, capacity, size; } array_t;
+
+void array_init(array_t *a, size_t size) {
+    a->data = NULL;
+    a->count = a->capacity = 0;
+    a->size = size;
+}
+
+// 在末尾追加一个元素，返回其地址
+void *array_push(array_t *a) {
+    if (a->count == a->capacity) {
+        a->capacity = (a->capacity > 0)? a->capacity * 2 : 1024;
+        a->data = (char*)realloc(a->data, a->capacity * a->size);
+        if (a->data == NULL) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    return a->data + (a->count++) * a->size;
+}
+
+#define ARRAY_AT(a, type, i) (((type*)(a).data)[i])
+
+// 面中一个顶点引用的 v / vt / vn，从 0 开始，-1 表示没有
+typedef struct { int v, t, n; } corner_t;
+
+// 从 (v, vt, vn) 到输出顶点编号的开放寻址哈希表
+typedef struct { corner_t *keys; int *values; size_t capacity, count; } corner_map_t;
+
+size_t corner_hash(const corner_t *c) {
+    size_t h = (size_t)c->v * 73856093u;
+    h ^= (size_t)c->t * 19349663u;
+    h ^= (size_t)c->n * 83492791u;
+    return h;
+}
+
+void corner_map_init(corner_map_t *map, size_t capacity) {
+    map->capacity = capacity;
+    map->count = 0;
+    map->keys = (corner_t*)malloc(sizeof(corner_t) * capacity);
+    map->values = (int*)malloc(sizeof(int) * capacity);
+    if (map->keys == NULL || map->values == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    memset(map->values, 0xff, sizeof(int) * capacity);
+}
+
+// 查找 c 对应的顶点编号，不存在时以 next 插入并返回 next
+int corner_map_get(corner_map_t *map, const corner_t *c, int next) {
+    size_t i;
+    if (map->count * 2 >= map->capacity) {      // 装载率到一半时扩大一倍
+        corner_map_t bigger;
+        corner_map_init(&bigger, map->capacity * 2);
+        for (i = 0; i < map->capacity; i++) {
+            if (map->values[i] >= 0) corner_map_get(&bigger, &map->keys[i], map->values[i]);
+        }
+        free(map->keys);
+        free(map->values);
+        *map = bigger;
+    }
+    i = corner_hash(c) & (map->capacity - 1);
+    while (map->values[i] >= 0) {
+        const corner_t *k = &map->keys[i];
+        if (k->v == c->v && k->t == c->t && k->n == c->n) return map->values[i];
+        i = (i + 1) & (map->capacity - 1);
+    }
+    map->keys[i] = *c;
+    map->values[i] = next;
+    map->count++;
+    return next;
+}
+
+// 读取一行到 *line（按需扩大缓冲），文件结束返回 0
+int read_line(FILE *fp, char **line, size_t *capacity) {
+    size_t n = 0;
+    if (*capacity == 0) {
+        *capacity = 256;
+        *line = (char*)malloc(*capacity);
+    }
+    while (fgets(*line + n, (int)(*capacity - n), fp)) {
+        n += strlen(*line + n);
+        if (n > 0 && (*line)[n - 1] == '\n') return 1;
+        *capacity *= 2;
+        *line = (char*)realloc(*line, *capacity);
+    }
+    return n > 0;
+}
+
+// 把 OBJ 中的索引（从 1 开始，负数为相对末尾）转换为从 0 开始，无效返回 -2
+int obj_index(long index, size_t count) {
+    if (index > 0 && (size_t)index <= count) return (int)(index - 1);
+    if (index < 0 && (size_t)(-index) <= count) return (int)(count + index);
+    return -2;
+}
+
+// 解析 "v/vt/vn" 形式的面顶点，*p 指向其开头，完成后指向其后
+int parse_corner(char **p, corner_t *c, size_t nv, size_t nt, size_t nn) {
+    char *s = *p;
+    c->t = c->n = -1;
+    c->v = obj_index(strtol(s, &s, 10), nv);
+    if (*s == '/') {
+        s++;
+        if (*s != '/') c->t = obj_index(strtol(s, &s, 10), nt);
+        if (*s == '/') {
+            s++;
+            c->n = obj_index(strtol(s, &s, 10), nn);
+        }
+    }
+    *p = s;
+    return c->v >= 0 && c->t != -2 && c->n != -2;
+}
+
+// 补齐到 MESH_ALIGN 的整数倍
+int write_padding(FILE *fp) {
+    static const char zero[MESH_ALIGN] = { 0 };
+    long pos = ftell(fp);
+    size_t n = (MESH_ALIGN - pos % MESH_ALIGN) % MESH_ALIGN;
+    return fwrite(zero, 1, n, fp) == n;
+}
+
+int main(int argc, char *argv[])
+{
+    array_t positions, colors, texcoords, normals, smooth, vertex_normals;
+    array_t vertices, corners, indices, face;
+    corner_map_t map;
+    mesh_header_t header;
+    const char *input = NULL, *output = NULL;
+    char *line = NULL;
+    size_t capacity = 0, i;
+    int flip = 0, lh = 0, lineno = 0;
+    FILE *fp;
+
+    for (i = 1; i < (size_t)argc; i++) {
+        if (strcmp(argv[i], "-flip") == 0) flip = 1;
+        else if (strcmp(argv[i], "-lh") == 0) lh = 1;
+        else if (input == NULL) input = argv[i];
+        else if (output == NULL) output = argv[i];
+        else input = NULL, i = argc;
+    }
+    if (input == NULL || output == NULL) {
+        printf("usage: obj2mesh [-flip] [-lh] input.obj output.m3d\n"
+            "  -flip   reverse the triangle winding\n"
+            "  -lh     the OBJ is already in a left-handed frame, do not mirror z\n");
+        return -1;
+    }
+
+    fp = fopen(input, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "can not open %s\n", input);
+        return -1;
+    }
+    array_init(&positions, sizeof(vector_t));
+    array_init(&colors, sizeof(color_t));
+    array_init(&texcoords, sizeof(texcoord_t));
+    array_init(&normals, sizeof(vector_t));
+    array_init(&corners, sizeof(corner_t));
+    array_init(&indices, sizeof(int));
+    array_init(&face, sizeof(int));
+    corner_map_init(&map, 1024);
+
+    while (read_line(fp, &line, &capacity)) {
+        char *s = line;
+        lineno++;
+        while (*s == ' ' || *s == '\t') s++;
+        if (s[0] == 'v' && (s[1] == ' ' || s[1] == '\t')) {
+            vector_t *p = (vector_t*)array_push(&positions);
+            color_t *c = (color_t*)array_push(&colors);
+            char *end;
+            p->x = (float)strtod(s + 2, &s);
+            p->y = (float)strtod(s, &s);
+            p->z = (float)strtod(s, &s);
+            p->w = 1.0f;
+            c->r = (float)strtod(s, &end);      // 可选的顶点色
+            if (end == s) c->r = c->g = c->b = 1.0f;
+            else {
+                c->g = (float)strtod(end, &s);
+                c->b = (float)strtod(s, &s);
+            }
+        }
+        else if (s[0] == 'v' && s[1] == 't') {
+            texcoord_t *t = (texcoord_t*)array_push(&texcoords);
+            t->u = (float)strtod(s + 2, &s);
+            t->v = (float)strtod(s, &s);
+        }
+        else if (s[0] == 'v' && s[1] == 'n') {
+            vector_t *n = (vector_t*)array_push(&normals);
+            n->x = (float)strtod(s + 2, &s);
+            n->y = (float)strtod(s, &s);
+            n->z = (float)strtod(s, &s);
+            n->w = 0.0f;
+        }
+        else if (s[0] == 'f' && (s[1] == ' ' || s[1] == '\t')) {
+            face.count = 0;
+            s++;
+            for (;;) {
+                corner_t c;
+                while (*s == ' ' || *s == '\t') s++;
+                if (*s == '\0' || *s == '\r' || *s == '\n' || *s == '#') break;
+                if (!parse_corner(&s, &c, positions.count, texcoords.count, normals.count)) {
+                    fprintf(stderr, "%s:%d: bad face\n", input, lineno);
+                    return -1;
+                }
+                *(int*)array_push(&face) = corner_map_get(&map, &c, (int)corners.count);
+                if (ARRAY_AT(face, int, face.count - 1) == (int)corners.count) {
+                    *(corner_t*)array_push(&corners) = c;
+                }
+            }
+            for (i = 2; i < face.count; i++) {  // 扇形拆分
+                *(int*)array_push(&indices) = ARRAY_AT(face, int, 0);
+                *(int*)array_push(&indices) = ARRAY_AT(face, int, i - 1);
+                *(int*)array_push(&indices) = ARRAY_AT(face, int, i);
+            }
+        }
+    }
+    fclose(fp);
+    free(line);
+    if (corners.count > 0x7fffffff || indices.count > 0x7fffffff) {
+        fprintf(stderr, "mesh too large\n");
+        return -1;
+    }
+
+    // OBJ 为右手系、逆时针为正面：镜像 z 转为左手系后，从外面看正面恰好变为
+    // 顺时针，与 D3D 的约定相同，绕序不需要改变
+    if (!lh) {
+        for (i = 0; i < positions.count; i++) ARRAY_AT(positions, vector_t, i).z *= -1.0f;
+        for (i = 0; i < normals.count; i++) ARRAY_AT(normals, vector_t, i).z *= -1.0f;
+    }
+    if (flip) {
+        for (i = 0; i < indices.count; i += 3) {
+            int t = ARRAY_AT(indices, int, i + 1);
+            ARRAY_AT(indices, int, i + 1) = ARRAY_AT(indices, int, i + 2);
+            ARRAY_AT(indices, int, i + 2) = t;
+        }
+    }
+
+    // 没有 vn 的顶点：累加共享该位置的三角形的法向量（叉积的长度即两倍面积）
+    array_init(&smooth, sizeof(vector_t));
+    for (i = 0; i < positions.count; i++) {
+        vector_t *n = (vector_t*)array_push(&smooth);
+        n->x = n->y = n->z = n->w = 0.0f;
+    }
+    for (i = 0; i < indices.count; i += 3) {
+        const corner_t *c1 = &ARRAY_AT(corners, corner_t, ARRAY_AT(indices, int, i));
+        const corner_t *c2 = &ARRAY_AT(corners, corner_t, ARRAY_AT(indices, int, i + 1));
+        const corner_t *c3 = &ARRAY_AT(corners, corner_t, ARRAY_AT(indices, int, i + 2));
+        vector_t e1, e2, n;
+        if (c1->n >= 0 && c2->n >= 0 && c3->n >= 0) continue;
+        vector_sub(&e1, &ARRAY_AT(positions, vector_t, c2->v), &ARRAY_AT(positions, vector_t, c1->v));
+        vector_sub(&e2, &ARRAY_AT(positions, vector_t, c3->v), &ARRAY_AT(positions, vector_t, c1->v));
+        vector_crossproduct(&n, &e2, &e1);
+        vector_add(&ARRAY_AT(smooth, vector_t, c1->v), &ARRAY_AT(smooth, vector_t, c1->v), &n);
+        vector_add(&ARRAY_AT(smooth, vector_t, c2->v), &ARRAY_AT(smooth, vector_t, c2->v), &n);
+        vector_add(&ARRAY_AT(smooth, vector_t, c3->v), &ARRAY_AT(smooth, vector_t, c3->v), &n);
+    }
+
+    // 生成输出顶点与包围盒
+    memset(&header, 0, sizeof(header));
+    array_init(&vertices, sizeof(vertex_t));
+    for (i = 0; i < corners.count; i++) {
+        const corner_t *c = &ARRAY_AT(corners, corner_t, i);
+        vertex_t *v = (vertex_t*)array_push(&vertices);
+        const point_t *p = &ARRAY_AT(positions, vector_t, c->v);
+        v->pos = *p;
+        v->color = ARRAY_AT(colors, color_t, c->v);
+        v->tc.u = (c->t >= 0)? ARRAY_AT(texcoords, texcoord_t, c->t).u : 0.0f;
+        v->tc.v = (c->t >= 0)? 1.0f - ARRAY_AT(texcoords, texcoord_t, c->t).v : 0.0f;
+        v->rhw = 1.0f;
+        v->light = 0.0f;
+        if (i == 0) header.bound_min = header.bound_max = *p;
+        if (p->x < header.bound_min.x) header.bound_min.x = p->x;
+        if (p->y < header.bound_min.y) header.bound_min.y = p->y;
+        if (p->z < header.bound_min.z) header.bound_min.z = p->z;
+        if (p->x > header.bound_max.x) header.bound_max.x = p->x;
+        if (p->y > header.bound_max.y) header.bound_max.y = p->y;
+        if (p->z > header.bound_max.z) header.bound_max.z = p->z;
+    }
+    array_init(&vertex_normals, sizeof(vector_t));
+    for (i = 0; i < corners.count; i++) {
+        const corner_t *c = &ARRAY_AT(corners, corner_t, i);
+        vector_t *n = (vector_t*)array_push(&vertex_normals);
+        *n = (c->n >= 0)? ARRAY_AT(normals, vector_t, c->n) : ARRAY_AT(smooth, vector_t, c->v);
+        if (vector_length(n) > 0.0f) vector_normalize(n);
+        n->w = 0.0f;
+    }
+
+    // 文件头之后依次为顶点、法向量、索引，每段按 MESH_ALIGN 对齐
+    header.magic = MESH_MAGIC;
+    header.version = MESH_VERSION;
+    header.vertex_size = sizeof(vertex_t);
+    header.normal_size = sizeof(vector_t);
+    header.vertex_count = (unsigned int)vertices.count;
+    header.index_count = (unsigned int)indices.count;
+    header.vertex_offset = (sizeof(header) + MESH_ALIGN - 1) / MESH_ALIGN * MESH_ALIGN;
+    header.normal_offset = header.vertex_offset + 
+        (vertices.count * sizeof(vertex_t) + MESH_ALIGN - 1) / MESH_ALIGN * MESH_ALIGN;
+    header.index_offset = header.normal_offset + 
+        (vertices.count * sizeof(vector_t) + MESH_ALIGN - 1) / MESH_ALIGN * MESH_ALIGN;
+    header.file_size = header.index_offset + indices.count * sizeof(int);
+
+    fp = fopen(output, "wb");
+    if (fp == NULL) {
+        fprintf(stderr, "can not create %s\n", output);
+        return -1;
+    }
+    if (fwrite(&header, sizeof(header), 1, fp) != 1 || !write_padding(fp) ||
+        fwrite(vertices.data, vertices.size, vertices.count, fp) != vertices.count || 
+        !write_padding(fp) ||
+        fwrite(vertex_normals.data, vertex_normals.size, vertex_normals.count, fp) != 
+        vertex_normals.count || !write_padding(fp) ||
+        fwrite(indices.data, indices.size, indices.count, fp) != indices.count || 
+        fclose(fp) != 0) {
+        fprintf(stderr, "can not write %s\n", output);
+        return -1;
+    }
+    printf("%s: %d vertices  %d triangles\n", output, (int)vertices.count, 
+        (int)indices.count / 3);
+    return 0;
+}